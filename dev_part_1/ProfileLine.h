@@ -0,0 +1,49 @@
+#ifndef PROFILE_LINE_H
+#define PROFILE_LINE_H
+
+/*
+ * The "<tag>_<id>: a, b, c" lines of branch_info.txt, foobar's <trace>.info
+ * and the profiles liblogger writes. Shared by the pass and the offline
+ * tools. The pass is built without exceptions, so nothing here throws: a
+ * malformed line or number makes the parse fail instead.
+ */
+#include <charconv>
+#include <string>
+#include <vector>
+
+// Parses a whole field as a decimal number.
+template <typename T>
+inline bool ParseProfileNumber(const std::string &field, T &value) {
+    const char *end = field.data() + field.size();
+    auto result = std::from_chars(field.data(), end, value);
+    return result.ec == std::errc() && result.ptr == end && !field.empty();
+}
+
+// Splits "<tag>_<id>: a, b, c" into the id and its comma separated fields.
+// False if the line has another tag or no valid id.
+inline bool ParseProfileLine(const std::string &line, const char *tag, int &id, std::vector<std::string> &fields) {
+    std::string prefix = std::string(tag) + "_";
+    if (line.compare(0, prefix.size(), prefix) != 0)
+        return false;
+
+    size_t colon = line.find(':');
+    if (colon == std::string::npos || !ParseProfileNumber(line.substr(prefix.size(), colon - prefix.size()), id) ||
+        id < 0)
+        return false;
+
+    fields.clear();
+    size_t start = colon + 1;
+    while (start <= line.size()) {
+        size_t comma = line.find(',', start);
+        if (comma == std::string::npos)
+            comma = line.size();
+        std::string field = line.substr(start, comma - start);
+        field.erase(0, field.find_first_not_of(' '));
+        field.erase(field.find_last_not_of(" \r") + 1);
+        fields.push_back(field);
+        start = comma + 1;
+    }
+    return true;
+}
+
+#endif
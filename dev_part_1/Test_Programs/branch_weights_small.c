@@ -0,0 +1,19 @@
+#include <stdio.h>
+
+/*
+ * An if without else whose then block runs 9 times out of 10. The join block
+ * after it is entered from the then block as well as from the false edge, so
+ * the false edge must not be counted by the entries into that block.
+ */
+int main() {
+    int common = 0, total = 0;
+
+    for (int i = 0; i < 1000; i++) {
+        if (i % 10 != 0)
+            common++;
+        total += i;
+    }
+
+    printf("%d of %d, total %d\n", common, 1000, total);
+    return 0;
+}
@@ -0,0 +1,70 @@
+# Shared setup for the benchmark scripts in this directory. Source it, do not run it.
+#
+# Environment overrides:
+#   CLANG   clang binary used to build the Test_Programs (default: clang)
+#   BUILD   cmake build directory of the pass (default: dev_part_1/build)
+#   RUNS    timed runs per binary, the best one is reported (default: 5)
+#   WORK    scratch directory (default: a fresh mktemp -d)
+
+ROOT=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+CLANG=${CLANG:-clang}
+BUILD=${BUILD:-$ROOT/build}
+PLUGIN=$(echo "$BUILD"/skeleton/SkeletonPass.*)
+RUNS=${RUNS:-5}
+WORK=${WORK:-$(mktemp -d)}
+
+PROGRAMS="contact_mgmt_small encryption_small segment_tree_large bank_management_large words_alphabetical_large"
+
+if [ ! -f "$PLUGIN" ]; then
+    echo "SkeletonPass not found in $BUILD, build it first (see README.md)" >&2
+    exit 1
+fi
+
+# liblogger is rebuilt so the benchmark always measures the current runtime.
+gcc -O2 -shared -fPIC -o "$WORK/liblogger.so" "$ROOT/logger.c" -ldl || exit 1
+export LD_LIBRARY_PATH="$WORK${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}"
+
+# Creates the files a program reads and prints its stdin.
+prepare_input() {
+    case $1 in
+        contact_mgmt_small)
+            printf 'Jane Smith\n' ;;
+        encryption_small)
+            [ -f "$WORK/plain.dat" ] || head -c 67108864 /dev/urandom > "$WORK/plain.dat"
+            printf 'plain.dat\ncipher.dat\n7\n' ;;
+        segment_tree_large)
+            printf '2\n' ;;
+        bank_management_large)
+            [ -f "$WORK/record.dat" ] || awk 'BEGIN { for (i = 1; i <= 200000; i++)
+                printf "%d name%d 1/2/1990 34 street%d US %d Saving %.2f 3/4/2020\n", i, i, i, 5550000 + i, i * 1.5 }' \
+                > "$WORK/record.dat"
+            printf 'codewithc\n6\n0\n' ;;
+        words_alphabetical_large)
+            ;;
+    esac
+}
+
+# run_program <program> <binary> [VAR=value...]: one run inside $WORK, output discarded.
+run_program() {
+    local prog=$1 binary=$2
+    shift 2
+    (cd "$WORK" && prepare_input "$prog" | env "$@" "$binary" > /dev/null 2>&1)
+}
+
+# time_program <program> <binary> [VAR=value...]: best wall time of $RUNS runs, in seconds.
+time_program() {
+    local prog=$1 binary=$2 best="" start end
+    shift 2
+    for _ in $(seq "$RUNS"); do
+        start=$(date +%s.%N)
+        run_program "$prog" "$binary" "$@"
+        end=$(date +%s.%N)
+        best=$(awk -v s="$start" -v e="$end" -v b="$best" 'BEGIN { d = e - s; print (b == "" || d < b) ? d : b }')
+    done
+    printf '%.4f' "$best"
+}
+
+# ratio <a> <b>: a / b with three decimals.
+ratio() {
+    awk -v a="$1" -v b="$2" 'BEGIN { printf "%.3f", (b > 0) ? a / b : 0 }'
+}
@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""Compares the branch trace of the pass with the one of foobar --branch-trace.
+
+    bench/compare_traces.py <program output> <branch_info.txt> <foobar trace>
+
+The program output holds the br_N and *funcptr_N lines printed by liblogger,
+other lines are ignored. The foobar trace is read with its <trace>.info file.
+The ids of the two differ, so events are compared by what they resolve to:
+br_N as (file, source line, destination line), *funcptr_N as the function
+name. Prints the events and distinct edges on both sides, the edges whose
+counts differ most and where the two sequences first diverge.
+"""
+import collections
+import os
+import re
+import struct
+import sys
+
+FB_TRACE_MAGIC = 0x52544246
+FB_TRACE_VERSION = 3
+FB_CHUNK_MAGIC = 0x4b434246
+FB_CHUNK_WORDS = 74
+
+
+def read_info(path):
+    """br_N, cs_N and fn_N lines of a branch_info.txt style file."""
+    branches, functions = {}, {}
+    with open(path) as info:
+        for line in info:
+            name, _, rest = line.partition(": ")
+            fields = [field.strip() for field in rest.split(",")]
+            if name.startswith("br_"):
+                branches[int(name[3:])] = (os.path.basename(fields[0]), int(fields[1]), int(fields[2]))
+            elif name.startswith("fn_"):
+                functions[int(name[3:])] = fields[0]
+    return branches, functions
+
+
+def read_pass_trace(path, info_path):
+    branches, functions = read_info(info_path)
+    events = []
+    pattern = re.compile(r"^(br_(\d+)|\*funcptr_(\S+))$")
+    with open(path, errors="replace") as output:
+        for line in output:
+            match = pattern.match(line.strip())
+            if not match:
+                continue
+            if match.group(2):
+                events.append(("br",) + branches[int(match.group(2))])
+            else:
+                target = match.group(3)
+                events.append(("fn", functions.get(int(target), target) if target.isdigit() else target))
+    return events
+
+
+def read_foobar_trace(path):
+    branches, functions = read_info(path + ".info")
+    with open(path, "rb") as trace:
+        data = trace.read()
+    words = struct.unpack("=%dI" % (len(data) // 4), data)
+    if len(words) < 2 or words[0] != FB_TRACE_MAGIC or words[1] != FB_TRACE_VERSION:
+        sys.exit("%s: not a foobar branch trace" % path)
+    events = []
+    chunk = 2
+    # The index after the last chunk is not needed to read it in order
+    while chunk + FB_CHUNK_WORDS <= len(words) and words[chunk] == FB_CHUNK_MAGIC:
+        i, end = chunk + FB_CHUNK_WORDS, chunk + FB_CHUNK_WORDS + words[chunk + 1]
+        while i < end:
+            word = words[i]
+            if word & 3 == 1:
+                events.append(("fn", functions.get(words[i + 1] >> 2, "???")))
+                i += 2
+            else:
+                events.append(("br",) + branches[word >> 2])
+                i += 1
+        chunk = end
+    return events
+
+
+def describe(event):
+    if event[0] == "br":
+        return "%s: %d -> %d" % event[1:]
+    return "*" + event[1]
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit(__doc__)
+    pass_events = read_pass_trace(sys.argv[1], sys.argv[2])
+    foobar_events = read_foobar_trace(sys.argv[3])
+    pass_counts = collections.Counter(pass_events)
+    foobar_counts = collections.Counter(foobar_events)
+
+    print("%-24s %12s %12s" % ("", "pass", "foobar"))
+    print("%-24s %12d %12d" % ("events", len(pass_events), len(foobar_events)))
+    print("%-24s %12d %12d" % ("distinct events", len(pass_counts), len(foobar_counts)))
+    print("%-24s %12d %12d" % ("only on this side", len(pass_counts - foobar_counts), len(foobar_counts - pass_counts)))
+
+    differences = sorted(set(pass_counts) | set(foobar_counts),
+                         key=lambda event: -abs(pass_counts[event] - foobar_counts[event]))
+    differences = [event for event in differences if pass_counts[event] != foobar_counts[event]]
+    if differences:
+        print("\ncounts that differ (pass, foobar):")
+        for event in differences[:10]:
+            print("%12d %12d  %s" % (pass_counts[event], foobar_counts[event], describe(event)))
+
+    for index, (a, b) in enumerate(zip(pass_events, foobar_events)):
+        if a != b:
+            print("\nfirst difference at event %d: %s in the pass trace, %s in foobar's" %
+                  (index, describe(a), describe(b)))
+            break
+    else:
+        if len(pass_events) == len(foobar_events):
+            print("\nthe traces are the same")
+    return 0 if pass_events == foobar_events else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,51 @@
+#!/bin/bash
+# Compile time and peak memory of clang with and without SkeletonPass on
+# generated modules of growing size, to check that the pass scales linearly
+# with the number of functions and edges it instruments.
+#
+#   bench/compile_bench.sh [functions...]
+#
+# SIZES sets the branches per function (default: 20), OPT_LEVELS the levels
+# compared (default: "-O0 -O2"). Each compile is timed RUNS times, the best
+# wall time and the peak RSS of that run are reported.
+. "$(dirname "$0")/common.sh"
+
+FUNCTIONS=${*:-"250 1000 4000"}
+BRANCHES=${SIZES:-20}
+OPT_LEVELS=${OPT_LEVELS:-"-O0 -O2"}
+
+# compile_stats <args...>: best "seconds max-rss-kb" of $RUNS compiles. python3
+# measures it so the numbers do not depend on which time(1) is installed.
+compile_stats() {
+    python3 - "$RUNS" "$@" <<'PY'
+import resource, subprocess, sys, time
+best = None
+for _ in range(int(sys.argv[1])):
+    start = time.time()
+    if subprocess.run(sys.argv[2:], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL).returncode:
+        sys.exit(1)
+    elapsed = time.time() - start
+    # The largest child so far, every run compiles the same module.
+    rss = resource.getrusage(resource.RUSAGE_CHILDREN).ru_maxrss
+    if best is None or elapsed < best[0]:
+        best = (elapsed, rss)
+print("%.3f %d" % best)
+PY
+}
+
+printf '%-8s %-6s %8s %10s %10s %9s %10s %10s\n' \
+    functions level edges "base (s)" "pass (s)" overhead "base (MB)" "pass (MB)"
+for n in $FUNCTIONS; do
+    src=$WORK/module_$n.c
+    "$(dirname "$0")/gen_module.py" "$n" "$BRANCHES" > "$src" || exit 1
+
+    for level in $OPT_LEVELS; do
+        read -r base_time base_rss < <(compile_stats "$CLANG" -g "$level" -c "$src" -o "$WORK/module_$n.o") || continue
+        read -r pass_time pass_rss < <(cd "$WORK" && compile_stats "$CLANG" -fpass-plugin="$PLUGIN" \
+            -Xclang -load -Xclang "$PLUGIN" -g "$level" -c "$src" -o "$WORK/module_$n.skeleton.o") || continue
+        edges=$(grep -c '^br_' "$WORK/branch_info.txt")
+
+        printf '%-8s %-6s %8s %10s %10s %8sx %10s %10s\n' "$n" "$level" "$edges" "$base_time" "$pass_time" \
+            "$(ratio "$pass_time" "$base_time")" $((base_rss / 1024)) $((pass_rss / 1024))
+    done
+done
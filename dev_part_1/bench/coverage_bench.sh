@@ -0,0 +1,20 @@
+#!/bin/bash
+# Runtime of each Test_Program built with -skeleton-coverage against the
+# uninstrumented -O2 build, to check that the bitmap can stay enabled.
+#
+#   bench/coverage_bench.sh
+. "$(dirname "$0")/common.sh"
+
+printf '%-26s %10s %10s %9s %s\n' program "-O2 (s)" "cov (s)" overhead covered
+for prog in $PROGRAMS; do
+    src=$ROOT/Test_Programs/$prog.c
+
+    "$CLANG" -g -O2 "$src" -o "$WORK/$prog.base" 2> /dev/null || continue
+    "$CLANG" -fpass-plugin="$PLUGIN" -Xclang -load -Xclang "$PLUGIN" -mllvm -skeleton-coverage \
+        -g -O2 "$src" -L"$WORK" -llogger -o "$WORK/$prog.cov" 2> /dev/null || continue
+
+    base=$(time_program "$prog" "$WORK/$prog.base")
+    cov=$(time_program "$prog" "$WORK/$prog.cov" BRANCH_COVERAGE="$WORK/$prog.coverage")
+    covered=$(awk -F', ' '{ n++; c += $NF } END { printf "%d/%d", c, n }' "$WORK/$prog.coverage")
+    printf '%-26s %10s %10s %8sx %s\n' "$prog" "$base" "$cov" "$(ratio "$cov" "$base")" "$covered"
+done
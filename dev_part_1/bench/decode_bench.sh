@@ -0,0 +1,58 @@
+#!/bin/bash
+# Throughput of trace_decode on a synthetic trace of the pass, in each output
+# format, on one thread and on every core.
+#
+#   bench/decode_bench.sh [size in MB]      (default: 4096)
+#
+# The trace has 1000 edges, an indirect call every 50 events and a line of
+# program output every 100. It is written once to $WORK and read from the
+# page cache, so the numbers are the decoder's and not the disk's. The target
+# is 1000 MB/s on every core for the counts format.
+#
+# Environment overrides:
+#   BUILD   cmake build directory (default: dev_part_1/build)
+#   RUNS    timed runs per setting, the best one is reported (default: 3)
+#   WORK    scratch directory (default: a fresh mktemp -d)
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BUILD=${BUILD:-$ROOT/build}
+DECODE=$BUILD/tools/trace_decode
+RUNS=${RUNS:-3}
+WORK=${WORK:-$(mktemp -d)}
+SIZE=${1:-4096}
+
+if [ ! -x "$DECODE" ]; then
+    echo "trace_decode not found in $BUILD, build it first (see README.md)" >&2
+    exit 1
+fi
+
+awk 'BEGIN { for (i = 1; i <= 1000; i++) printf "br_%d: bench.c, %d, %d\n", i, i, i + 1 }' > "$WORK/branch_info.txt"
+
+# One 1 MB block, repeated up to the requested size.
+awk 'BEGIN { srand(1); for (n = 0; bytes < 1048576; n++) {
+         if (n % 100 == 99) line = "program output " n
+         else if (n % 50 == 49) line = "*funcptr_" int(rand() * 20 + 1)
+         else line = "br_" int(rand() * 1000 + 1)
+         print line; bytes += length(line) + 1 } }' > "$WORK/block.txt"
+for _ in $(seq "$SIZE"); do cat "$WORK/block.txt"; done > "$WORK/trace.txt"
+
+# mb_per_s <format> <threads>: best decoding rate of $RUNS runs.
+mb_per_s() {
+    local best="" rate
+    for _ in $(seq "$RUNS"); do
+        rate=$("$DECODE" --info="$WORK/branch_info.txt" --format="$1" --threads="$2" --stats -o /dev/null \
+               "$WORK/trace.txt" 2>&1 | awk '/MB\/s/ { print $(NF - 4) }')
+        best=$(awk -v r="$rate" -v b="$best" 'BEGIN { print (b == "" || r > b) ? r : b }')
+    done
+    printf '%.1f' "$best"
+}
+
+cores=$(nproc)
+printf '%-8s %16s %16s %8s\n' format "1 thread MB/s" "$cores threads MB/s" scaling
+for format in counts text csv; do
+    one=$(mb_per_s "$format" 1)
+    all=$(mb_per_s "$format" "$cores")
+    printf '%-8s %16s %16s %7sx\n' "$format" "$one" "$all" \
+        "$(awk -v a="$all" -v b="$one" 'BEGIN { printf "%.2f", (b > 0) ? a / b : 0 }')"
+done
+rm -f "$WORK/trace.txt"
@@ -0,0 +1,43 @@
+#!/bin/bash
+# Slowdown of each Test_Program under valgrind --tool=foobar against the
+# native -O2 build, and the instruction count it reports. With VALGRIND_BEFORE
+# set to a second valgrind installation the two builds of foobar are compared
+# and their counts must agree.
+#
+#   VALGRIND=<valgrind> [VALGRIND_BEFORE=<older valgrind>] bench/foobar_bench.sh [foobar options]
+. "$(dirname "$0")/common.sh"
+
+VALGRIND=${VALGRIND:-valgrind}
+VALGRIND_BEFORE=${VALGRIND_BEFORE:-}
+
+# foobar_run <valgrind> <program> <binary> [options...]: "<instructions> <seconds>", best of $RUNS.
+foobar_run() {
+    local valgrind=$1 prog=$2 binary=$3 best="" count start end
+    shift 3
+    for _ in $(seq "$RUNS"); do
+        start=$(date +%s.%N)
+        count=$(cd "$WORK" && prepare_input "$prog" | "$valgrind" --tool=foobar "$@" "$binary" 2>&1 > /dev/null |
+                awk '/Total number of instructions executed/ { print $NF }')
+        end=$(date +%s.%N)
+        best=$(awk -v s="$start" -v e="$end" -v b="$best" 'BEGIN { d = e - s; print (b == "" || d < b) ? d : b }')
+    done
+    printf '%s %.4f\n' "$count" "$best"
+}
+
+printf '%-26s %10s %16s %10s %9s %10s %9s\n' program "-O2 (s)" instructions "vg (s)" slowdown "before (s)" slowdown
+for prog in $PROGRAMS; do
+    src=$ROOT/Test_Programs/$prog.c
+
+    "$CLANG" -g -O2 "$src" -o "$WORK/$prog.base" 2> /dev/null || continue
+    base=$(time_program "$prog" "$WORK/$prog.base")
+    read -r count after < <(foobar_run "$VALGRIND" "$prog" "$WORK/$prog.base" "$@")
+
+    before=- before_ratio=-
+    if [ -n "$VALGRIND_BEFORE" ]; then
+        read -r before_count before < <(foobar_run "$VALGRIND_BEFORE" "$prog" "$WORK/$prog.base" "$@")
+        before_ratio=$(ratio "$before" "$base")x
+        [ "$before_count" = "$count" ] || echo "$prog: counts differ, $before_count before and $count after" >&2
+    fi
+    printf '%-26s %10s %16s %10s %8sx %10s %9s\n' "$prog" "$base" "$count" "$after" "$(ratio "$after" "$base")" \
+        "$before" "$before_ratio"
+done
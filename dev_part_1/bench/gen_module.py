@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+"""Writes a synthetic C module for compile-time benchmarks of SkeletonPass.
+
+    bench/gen_module.py <functions> <branches per function> > module.c
+
+Every function is a chain of if/else diamonds with a loop around every fourth
+one, so the CFG gets deep, and an indirect call through a table of all the
+functions on every other branch, so cs_N sites scale with the br_N edges.
+main() calls each function once, so the module also links and runs.
+"""
+import sys
+
+
+def emit_function(out, index, branches, functions):
+    out.append("int f%d(int x, int depth)\n{\n    int acc = x;\n" % index)
+    for b in range(branches):
+        indent = "    "
+        if b % 4 == 3:
+            out.append("    for (int i%d = 0; i%d < (x & 3); i%d++) {\n" % (b, b, b))
+            indent = "        "
+        out.append("%sif (acc %% %d == %d) {\n" % (indent, b + 2, b % (b + 2)))
+        if b % 2 == 0:
+            out.append("%s    if (depth)\n%s        acc += table[(acc + %d) %% %d](acc >> 8, depth - 1) & 1;\n"
+                       % (indent, indent, b, functions))
+        else:
+            out.append("%s    acc = acc * 3 + %d;\n" % (indent, b))
+        out.append("%s} else {\n%s    acc ^= %d;\n%s}\n" % (indent, indent, b * 7 + 1, indent))
+        if indent != "    ":
+            out.append("    }\n")
+    out.append("    return acc;\n}\n\n")
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: gen_module.py <functions> <branches per function>")
+    functions, branches = int(sys.argv[1]), int(sys.argv[2])
+
+    out = ["/* Generated by bench/gen_module.py %d %d */\n" % (functions, branches)]
+    for f in range(functions):
+        out.append("int f%d(int x, int depth);\n" % f)
+    out.append("\nstatic int (*const table[%d])(int, int) = {\n" % functions)
+    out.append("".join("    f%d,\n" % f for f in range(functions)))
+    out.append("};\n\n")
+    for f in range(functions):
+        emit_function(out, f, branches, functions)
+    out.append("int main(void)\n{\n    int sum = 0;\n")
+    out.append("    for (int f = 0; f < %d; f++)\n        sum += table[f](f, 2) & 1;\n" % functions)
+    out.append("    return sum & 1;\n}\n")
+    sys.stdout.write("".join(out))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,44 @@
+#!/bin/bash
+# Instruction counts of each Test_Program from -skeleton-count-instructions
+# against valgrind --tool=foobar on the same -O2 binary without probes, with
+# the error of the estimate and how much faster the instrumented run is.
+#
+#   VALGRIND=<valgrind with foobar installed> bench/icount_bench.sh
+#
+# foobar also counts the dynamic loader and libc, which the pass never sees,
+# so the error includes them. Pass -skeleton-count-machine in COUNT_FLAGS to
+# compare the machine instruction estimate instead of IR instructions.
+. "$(dirname "$0")/common.sh"
+
+VALGRIND=${VALGRIND:-valgrind}
+COUNT_FLAGS=${COUNT_FLAGS:-}
+
+# foobar_run <program> <binary>: "<instructions> <seconds>" of one run under foobar.
+foobar_run() {
+    local prog=$1 binary=$2 start end count
+    start=$(date +%s.%N)
+    count=$(cd "$WORK" && prepare_input "$prog" | "$VALGRIND" --tool=foobar "$binary" 2>&1 > /dev/null |
+            awk '/Total number of instructions executed/ { print $NF }')
+    end=$(date +%s.%N)
+    echo "$count" "$(awk -v s="$start" -v e="$end" 'BEGIN { printf "%.4f", e - s }')"
+}
+
+printf '%-26s %14s %14s %8s %10s %10s %8s\n' \
+    program foobar skeleton error "vg (s)" "ic (s)" speedup
+for prog in $PROGRAMS; do
+    src=$ROOT/Test_Programs/$prog.c
+
+    "$CLANG" -g -O2 "$src" -o "$WORK/$prog.base" 2> /dev/null || continue
+    "$CLANG" -fpass-plugin="$PLUGIN" -Xclang -load -Xclang "$PLUGIN" -mllvm -skeleton-count-instructions \
+        $(for flag in $COUNT_FLAGS; do printf -- '-mllvm %s ' "$flag"; done) \
+        -g -O2 "$src" -L"$WORK" -llogger -o "$WORK/$prog.ic" 2> /dev/null || continue
+
+    read -r vg_count vg_time < <(foobar_run "$prog" "$WORK/$prog.base")
+    [ -n "$vg_count" ] || { echo "$prog: no count from $VALGRIND --tool=foobar" >&2; continue; }
+    ic_time=$(time_program "$prog" "$WORK/$prog.ic" INSTRUCTION_COUNTS="$WORK/$prog.counts")
+    ic_count=$(awk '/^Total number of instructions executed/ { print $NF }' "$WORK/$prog.counts")
+
+    error=$(awk -v a="$ic_count" -v b="$vg_count" 'BEGIN { printf "%.1f%%", (b > 0) ? 100 * (a - b) / b : 0 }')
+    printf '%-26s %14s %14s %8s %10s %10s %7sx\n' "$prog" "$vg_count" "$ic_count" "$error" \
+        "$vg_time" "$ic_time" "$(ratio "$vg_time" "$ic_time")"
+done
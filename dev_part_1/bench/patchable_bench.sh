@@ -0,0 +1,22 @@
+#!/bin/bash
+# Overhead of -skeleton-patchable builds with tracing off and on, next to the
+# uninstrumented -O2 build and the regular LogBranch/LogPointer calls.
+#
+#   bench/patchable_bench.sh
+. "$(dirname "$0")/common.sh"
+
+printf '%-26s %10s %10s %8s %10s %10s\n' program "-O2 (s)" "off (s)" overhead "on (s)" "calls (s)"
+for prog in $PROGRAMS; do
+    src=$ROOT/Test_Programs/$prog.c
+
+    "$CLANG" -g -O2 "$src" -o "$WORK/$prog.base" 2> /dev/null || continue
+    "$CLANG" -fpass-plugin="$PLUGIN" -Xclang -load -Xclang "$PLUGIN" -mllvm -skeleton-patchable \
+        -g -O2 "$src" -L"$WORK" -llogger -o "$WORK/$prog.sleds" 2> /dev/null || continue
+    "$CLANG" -fpass-plugin="$PLUGIN" -g -O2 "$src" -L"$WORK" -llogger -o "$WORK/$prog.calls" 2> /dev/null || continue
+
+    base=$(time_program "$prog" "$WORK/$prog.base")
+    off=$(time_program "$prog" "$WORK/$prog.sleds")
+    on=$(time_program "$prog" "$WORK/$prog.sleds" BRANCH_TRACE=1)
+    calls=$(time_program "$prog" "$WORK/$prog.calls")
+    printf '%-26s %10s %10s %7sx %10s %10s\n' "$prog" "$base" "$off" "$(ratio "$off" "$base")" "$on" "$calls"
+done
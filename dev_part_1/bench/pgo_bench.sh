@@ -0,0 +1,25 @@
+#!/bin/bash
+# Rebuilds every Test_Program at -O2 with the branch weights and indirect call
+# targets from its own BRANCH_PROFILE and compares the runtime with plain -O2.
+#
+#   bench/pgo_bench.sh
+. "$(dirname "$0")/common.sh"
+
+printf '%-26s %10s %10s %8s %s\n' program "-O2 (s)" "pgo (s)" speedup "matched"
+for prog in $PROGRAMS; do
+    src=$ROOT/Test_Programs/$prog.c
+
+    # Phase 1: instrumented build, one training run with the benchmark input.
+    "$CLANG" -fpass-plugin="$PLUGIN" -g -O2 "$src" -L"$WORK" -llogger -o "$WORK/$prog.instr" 2> /dev/null || continue
+    run_program "$prog" "$WORK/$prog.instr" BRANCH_PROFILE="$WORK/$prog.profile"
+
+    # Phase 2: the same program rebuilt with and without its profile.
+    "$CLANG" -g -O2 "$src" -o "$WORK/$prog.base" 2> /dev/null || continue
+    matched=$("$CLANG" -fpass-plugin="$PLUGIN" -Xclang -load -Xclang "$PLUGIN" \
+        -mllvm -skeleton-profile-use="$WORK/$prog.profile" -g -O2 "$src" -o "$WORK/$prog.pgo" 2>&1 |
+        sed -n 's/^skeleton: matched \([0-9]* of [0-9]*\) edges.*/\1/p')
+
+    base=$(time_program "$prog" "$WORK/$prog.base")
+    pgo=$(time_program "$prog" "$WORK/$prog.pgo")
+    printf '%-26s %10s %10s %7sx %s\n' "$prog" "$base" "$pgo" "$(ratio "$base" "$pgo")" "$matched"
+done
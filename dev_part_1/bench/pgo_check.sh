@@ -0,0 +1,44 @@
+#!/bin/bash
+# Checks the branch weights -skeleton-profile-use attaches to an if without
+# else. branch_weights_small takes the then block of its if 9 times out of
+# 10, so the !prof of that branch must weigh the true edge above the false
+# one, although the false edge leads to a block entered 1000 times.
+#
+#   bench/pgo_check.sh
+. "$(dirname "$0")/common.sh"
+
+src=$ROOT/Test_Programs/branch_weights_small.c
+line=$(grep -n 'if (i % 10 != 0)' "$src" | cut -d: -f1)
+
+"$CLANG" -fpass-plugin="$PLUGIN" -g -O0 "$src" -L"$WORK" -llogger -o "$WORK/instr" 2> /dev/null || exit 1
+BRANCH_PROFILE="$WORK/profile" "$WORK/instr" > /dev/null
+"$CLANG" -fpass-plugin="$PLUGIN" -Xclang -load -Xclang "$PLUGIN" -mllvm -skeleton-profile-use="$WORK/profile" \
+    -g -O0 -S -emit-llvm "$src" -o "$WORK/pgo.ll" 2> /dev/null || exit 1
+
+# The weights of the br whose !dbg location is on the line of the if
+weights=$(awk -v line="$line" '
+    NR == FNR {
+        if ($0 ~ "^![0-9]+ = !DILocation\\(line: " line ",")
+            at_line[$1] = 1
+        if (match($0, /^![0-9]+ = !\{!"branch_weights", i32 [0-9]+, i32 [0-9]+\}/))
+            weights[$1] = $5 " " $7
+        next
+    }
+    /^ *br i1 / && match($0, /!dbg ![0-9]+/) {
+        location = substr($0, RSTART + 5, RLENGTH - 5)
+        if (at_line[location] && match($0, /!prof ![0-9]+/))
+            print weights[substr($0, RSTART + 6, RLENGTH - 6)]
+    }' "$WORK/pgo.ll" "$WORK/pgo.ll" | tr -d ',}')
+
+cat "$WORK/profile"
+if [ -z "$weights" ]; then
+    echo "FAIL: no branch weights on line $line"
+    exit 1
+fi
+set -- $weights
+if [ "$1" -gt "$2" ]; then
+    echo "OK: line $line weighs true $1, false $2"
+else
+    echo "FAIL: line $line weighs true $1, false $2"
+    exit 1
+fi
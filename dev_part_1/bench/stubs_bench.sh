@@ -0,0 +1,41 @@
+#!/bin/bash
+# Runtime, size of the probed code and L1 I-cache misses of each Test_Program
+# with the logger calls inline and in -skeleton-cold-stubs stubs.
+#
+#   bench/stubs_bench.sh
+#
+# I-cache misses come from perf stat and are left out when perf is missing
+# or not allowed to count (see /proc/sys/kernel/perf_event_paranoid).
+. "$(dirname "$0")/common.sh"
+
+# hot_text <binary>: bytes of code in functions other than the stubs. The
+# linker merges .text.unlikely into .text, so section sizes cannot tell them apart.
+hot_text() {
+    nm -S -t d --defined-only "$1" | awk '$3 ~ /^[tT]$/ && $4 !~ /^skeleton\.stub\./ { n += $2 } END { print n + 0 }'
+}
+
+# icache_misses <program> <binary>: L1 I-cache load misses of one run, or "-".
+icache_misses() {
+    local prog=$1 binary=$2 misses
+    command -v perf > /dev/null || { echo -; return; }
+    misses=$(cd "$WORK" && prepare_input "$prog" |
+             perf stat -x, -e L1-icache-load-misses "$binary" 2>&1 > /dev/null |
+             awk -F, '/L1-icache-load-misses/ && $1 ~ /^[0-9]+$/ { print $1 }')
+    echo "${misses:--}"
+}
+
+printf '%-26s %10s %10s %8s %10s %10s %12s %12s\n' \
+    program "inline (s)" "stubs (s)" speedup "inline (B)" "stubs (B)" "inline miss" "stubs miss"
+for prog in $PROGRAMS; do
+    src=$ROOT/Test_Programs/$prog.c
+
+    "$CLANG" -fpass-plugin="$PLUGIN" -g -O2 "$src" -L"$WORK" -llogger -o "$WORK/$prog.inline" 2> /dev/null || continue
+    "$CLANG" -fpass-plugin="$PLUGIN" -Xclang -load -Xclang "$PLUGIN" -mllvm -skeleton-cold-stubs \
+        -g -O2 "$src" -L"$WORK" -llogger -o "$WORK/$prog.stubs" 2> /dev/null || continue
+
+    inline=$(time_program "$prog" "$WORK/$prog.inline")
+    stubs=$(time_program "$prog" "$WORK/$prog.stubs")
+    printf '%-26s %10s %10s %7sx %10s %10s %12s %12s\n' "$prog" "$inline" "$stubs" "$(ratio "$inline" "$stubs")" \
+        "$(hot_text "$WORK/$prog.inline")" "$(hot_text "$WORK/$prog.stubs")" \
+        "$(icache_misses "$prog" "$WORK/$prog.inline")" "$(icache_misses "$prog" "$WORK/$prog.stubs")"
+done
@@ -0,0 +1,35 @@
+#!/bin/bash
+# Cross-checks foobar --branch-trace against the branch-trace pass. Every
+# Test_Program is built at -O0 twice, with the pass and without it. The br_N
+# and *funcptr_N output of the first is compared with the trace foobar
+# records from the second, see compare_traces.py.
+#
+#   VALGRIND=<valgrind> bench/trace_crosscheck.sh [program...]
+. "$(dirname "$0")/common.sh"
+
+VALGRIND=${VALGRIND:-valgrind}
+
+# Smaller inputs than the benchmarks, the traces grow with them
+head -c 65536 /dev/urandom > "$WORK/plain.dat"
+awk 'BEGIN { for (i = 1; i <= 200; i++)
+    printf "%d name%d 1/2/1990 34 street%d US %d Saving %.2f 3/4/2020\n", i, i, i, 5550000 + i, i * 1.5 }' \
+    > "$WORK/record.dat"
+
+status=0
+for prog in ${@:-$PROGRAMS}; do
+    src=$ROOT/Test_Programs/$prog.c
+    dir=$WORK/$prog
+    mkdir -p "$dir"
+
+    # branch_info.txt is written to the working directory of the compiler
+    (cd "$dir" && "$CLANG" -fpass-plugin="$PLUGIN" -g -O0 "$src" -L"$WORK" -llogger -o traced) 2> /dev/null || continue
+    "$CLANG" -g -O0 "$src" -o "$dir/base" 2> /dev/null || continue
+
+    (cd "$WORK" && prepare_input "$prog" | "$dir/traced" > "$dir/pass_trace.txt" 2> /dev/null)
+    (cd "$WORK" && prepare_input "$prog" |
+        "$VALGRIND" --tool=foobar --hotspots=0 --branch-trace="$dir/foobar.trace" "$dir/base" > /dev/null 2>&1)
+
+    echo "== $prog"
+    python3 "$ROOT/bench/compare_traces.py" "$dir/pass_trace.txt" "$dir/branch_info.txt" "$dir/foobar.trace" || status=1
+done
+exit $status
@@ -1,16 +1,834 @@
+#define _GNU_SOURCE
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+#include <dlfcn.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+/* Source locations of br_N / cs_N, registered by the pass from a module constructor. */
+struct BranchRecord {
+    int branch_id;
+    const char *filepath;
+    int src_lno;
+    int dest_lno;
+};
+
+struct CallSiteRecord {
+    int callsite_id;
+    const char *filepath;
+    int lno;
+};
+
+struct FunctionRecord {
+    int function_id;
+    void *address;
+    const char *name;
+    const char *filepath;
+    int lno;
+};
+
+struct TargetCount {
+    int callsite_id;
+    uintptr_t target;
+    unsigned long long count;
+};
+
+/*
+ * One entry per instrumented module. Every module numbers its ids from 1, so
+ * the arrays indexed by id hold the ids of a module from base on.
+ */
+struct RecordTable {
+    const void *records;
+    int count;
+    int base;
+};
+
+static struct RecordTable *branch_tables;
+static int num_branch_tables;
+static struct RecordTable *callsite_tables;
+static int num_callsite_tables;
+static int callsite_ids;
+
+/* -skeleton-coverage modules: a byte per br_N, set to 1 by the probe itself. */
+struct CoverageTable {
+    const struct BranchRecord *records;
+    int count;
+    const unsigned char *bitmap;
+};
+
+static struct CoverageTable *coverage_tables;
+static int num_coverage_tables;
+
+/* -skeleton-patchable: one record per sled in the skeleton_sleds section. */
+enum SledKind { SLED_BRANCH = 0, SLED_POINTER = 1 };
+
+struct SledRecord {
+    uintptr_t address;
+    int kind;
+    int id;
+    /* Where the module keeps the base of its ids, see LogRegisterBranches. */
+    const int *base;
+};
+
+/* One entry per linked object, sorted by sled address. */
+struct SledTable {
+    struct SledRecord *begin;
+    struct SledRecord *end;
+    uintptr_t trampoline;
+};
+
+static struct SledTable *sled_tables;
+static int num_sled_tables;
+
+/*
+ * Size of the xsave area skeleton_sled_trampoline keeps the x87, SSE and
+ * AVX state in while a sled calls into liblogger. 0 without xsave, and then
+ * sleds are never patched.
+ */
+unsigned int LogSledSaveSize;
+
+static volatile sig_atomic_t tracing_enabled = 1;
+
+/* -skeleton-value-profile: operands of the compare deciding each cmp_N branch. */
+struct CompareRecord {
+    int compare_id;
+    const char *filepath;
+    int lno;
+    const char *predicate;
+    int is_fp;
+};
+
+/*
+ * Bounded summary of one operand: exact min/max and the most frequent values
+ * by the space-saving algorithm, so counts of the top values are upper bounds.
+ */
+#define VALUE_TOP_K 8
+
+struct ValueSketch {
+    unsigned long long evaluations;
+    int64_t min, max;
+    int used;
+    int64_t values[VALUE_TOP_K];
+    unsigned long long counts[VALUE_TOP_K];
+};
+
+struct CompareProfile {
+    struct ValueSketch lhs, rhs;
+};
+
+static struct RecordTable *compare_tables;
+static int num_compare_tables;
+
+/* Indexed by compare id plus the base of its module; compare_ids are handed out. */
+static struct CompareProfile *compare_profiles;
+static int compare_profiles_size;
+static int compare_ids;
+
+/* -skeleton-count-instructions: per-function counters the probes add block sizes to. */
+struct CountedFunctionRecord {
+    const char *name;
+    const char *filepath;
+    int lno;
+    unsigned long long static_instructions;
+};
+
+/* One entry per instrumented module, counters[i] belongs to records[i]. */
+struct CountTable {
+    const struct CountedFunctionRecord *records;
+    int count;
+    const unsigned long long *counters;
+};
+
+static struct CountTable *count_tables;
+static int num_count_tables;
+
+/*
+ * Every registered address-taken function, sorted by address for
+ * LookupFunction. id is the fn_N of the trace: the module's id plus the
+ * base of the module, like branch ids, so it is the same in every run of
+ * the binary and unique across modules.
+ */
+struct FunctionEntry {
+    const struct FunctionRecord *record;
+    int id;
+};
+
+static struct FunctionEntry *function_index;
+static int function_index_size;
+static int function_ids;
+/* Last LookupFunction result, cleared when the index moves */
+static const struct FunctionEntry *function_last_hit;
+
+/* Indexed by branch id plus the base of its module; branch_ids are handed out. */
+static unsigned long long *branch_counts;
+static int branch_counts_size;
+static int branch_ids;
+
+/* Open addressing on (callsite id plus the base of its module, target), grown at half load. */
+static struct TargetCount *target_counts;
+static size_t target_counts_size;
+static size_t target_counts_used;
+
+static void WriteProfile(void);
+static void WriteInfo(void);
+static void WriteCoverage(void);
+static void WriteValues(void);
+static void WriteInstructionCounts(void);
+
+static void ReserveBranchCounts(int branch_id) {
+    if (branch_id < branch_counts_size)
+        return;
+    int new_size = branch_counts_size ? branch_counts_size : 64;
+    while (new_size <= branch_id)
+        new_size *= 2;
+    unsigned long long *counts = realloc(branch_counts, new_size * sizeof(*counts));
+    if (!counts)
+        return;
+    for (int i = branch_counts_size; i < new_size; i++)
+        counts[i] = 0;
+    branch_counts = counts;
+    branch_counts_size = new_size;
+}
+
+static void AddRecordTable(struct RecordTable **tables, int *num_tables, const void *records, int count, int base) {
+    struct RecordTable *grown = realloc(*tables, (*num_tables + 1) * sizeof(*grown));
+    if (!grown)
+        return;
+    grown[*num_tables].records = records;
+    grown[*num_tables].count = count;
+    grown[*num_tables].base = base;
+    *tables = grown;
+    (*num_tables)++;
+}
+
+/* The id a module gave an entry, from its index in an array indexed by id. */
+static int LocalId(const struct RecordTable *tables, int num_tables, int index) {
+    int low = 0, high = num_tables;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (tables[mid].base <= index)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low ? index - tables[low - 1].base : index;
+}
+
+/* Returns the base of the module's br_N ids, which its probes add to their ids. */
+int LogRegisterBranches(const struct BranchRecord *records, int count) {
+    static int profile_registered, info_registered;
+
+    int base = branch_ids, max_id = 0;
+    for (int i = 0; i < count; i++) {
+        if (records[i].branch_id > max_id)
+            max_id = records[i].branch_id;
+    }
+    AddRecordTable(&branch_tables, &num_branch_tables, records, count, base);
+    ReserveBranchCounts(base + max_id);
+    branch_ids = base + max_id + 1;
+    if (!profile_registered && getenv("BRANCH_PROFILE")) {
+        atexit(WriteProfile);
+        profile_registered = 1;
+    }
+    if (!info_registered && getenv("BRANCH_INFO")) {
+        atexit(WriteInfo);
+        info_registered = 1;
+    }
+    return base;
+}
+
+/* Returns the base of the module's cs_N ids, which its probes add to their ids. */
+int LogRegisterCallSites(const struct CallSiteRecord *records, int count) {
+    int base = callsite_ids, max_id = 0;
+    for (int i = 0; i < count; i++) {
+        if (records[i].callsite_id > max_id)
+            max_id = records[i].callsite_id;
+    }
+    AddRecordTable(&callsite_tables, &num_callsite_tables, records, count, base);
+    callsite_ids = base + max_id + 1;
+    return base;
+}
+
+/*
+ * A function whose address is taken in several modules is in the table of
+ * each. The record of the module defining it, the one with a file, sorts
+ * first, so its fn_N id is the one in the trace.
+ */
+static int CompareFunctions(const void *a, const void *b) {
+    const struct FunctionRecord *x = ((const struct FunctionEntry *)a)->record;
+    const struct FunctionRecord *y = ((const struct FunctionEntry *)b)->record;
+    if (x->address != y->address)
+        return ((uintptr_t)x->address > (uintptr_t)y->address) - ((uintptr_t)x->address < (uintptr_t)y->address);
+    if ((y->filepath[0] != 0) != (x->filepath[0] != 0))
+        return (y->filepath[0] != 0) - (x->filepath[0] != 0);
+    return ((const struct FunctionEntry *)a)->id - ((const struct FunctionEntry *)b)->id;
+}
+
+void LogRegisterFunctions(const struct FunctionRecord *records, int count) {
+    struct FunctionEntry *index = realloc(function_index, (function_index_size + count) * sizeof(*index));
+    if (!index)
+        return;
+    int base = function_ids, max_id = 0;
+    for (int i = 0; i < count; i++) {
+        index[function_index_size + i].record = &records[i];
+        index[function_index_size + i].id = base + records[i].function_id;
+        if (records[i].function_id > max_id)
+            max_id = records[i].function_id;
+    }
+    function_ids = base + max_id + 1;
+    function_index = index;
+    function_index_size += count;
+    qsort(function_index, function_index_size, sizeof(*function_index), CompareFunctions);
+    function_last_hit = NULL;
+}
+
+/*
+ * Maps a call target to its table entry, or NULL for functions no module
+ * registered. Indirect call sites tend to hit the same target repeatedly,
+ * so the last hit is checked before the binary search.
+ */
+static const struct FunctionEntry *LookupFunction(uintptr_t target) {
+    if (function_last_hit && (uintptr_t)function_last_hit->record->address == target)
+        return function_last_hit;
+
+    int low = 0, high = function_index_size;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if ((uintptr_t)function_index[mid].record->address < target)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low == function_index_size || (uintptr_t)function_index[low].record->address != target)
+        return NULL;
+    function_last_hit = &function_index[low];
+    return function_last_hit;
+}
+
+void LogRegisterCoverage(const struct BranchRecord *records, int count, const unsigned char *bitmap) {
+    struct CoverageTable *grown = realloc(coverage_tables, (num_coverage_tables + 1) * sizeof(*grown));
+    if (!grown)
+        return;
+    grown[num_coverage_tables].records = records;
+    grown[num_coverage_tables].count = count;
+    grown[num_coverage_tables].bitmap = bitmap;
+    coverage_tables = grown;
+    if (num_coverage_tables++ == 0)
+        atexit(WriteCoverage);
+}
+
+/* Returns the base of the module's cmp_N ids, which its probes add to their ids. */
+int LogRegisterCompares(const struct CompareRecord *records, int count) {
+    int base = compare_ids, max_id = 0;
+    for (int i = 0; i < count; i++) {
+        if (records[i].compare_id > max_id)
+            max_id = records[i].compare_id;
+    }
+    AddRecordTable(&compare_tables, &num_compare_tables, records, count, base);
+    compare_ids = base + max_id + 1;
+
+    if (compare_ids > compare_profiles_size) {
+        struct CompareProfile *profiles = realloc(compare_profiles, compare_ids * sizeof(*profiles));
+        if (!profiles)
+            return base;
+        memset(profiles + compare_profiles_size, 0, (compare_ids - compare_profiles_size) * sizeof(*profiles));
+        compare_profiles = profiles;
+        compare_profiles_size = compare_ids;
+    }
+
+    if (num_compare_tables == 1)
+        atexit(WriteValues);
+    return base;
+}
+
+void LogRegisterInstructionCounts(const struct CountedFunctionRecord *records, int count,
+                                  const unsigned long long *counters) {
+    struct CountTable *grown = realloc(count_tables, (num_count_tables + 1) * sizeof(*grown));
+    if (!grown)
+        return;
+    grown[num_count_tables].records = records;
+    grown[num_count_tables].count = count;
+    grown[num_count_tables].counters = counters;
+    count_tables = grown;
+    if (num_count_tables++ == 0)
+        atexit(WriteInstructionCounts);
+}
+
+struct FunctionCount {
+    const struct CountedFunctionRecord *record;
+    unsigned long long count;
+};
+
+static int CompareFunctionCounts(const void *a, const void *b) {
+    unsigned long long x = ((const struct FunctionCount *)a)->count, y = ((const struct FunctionCount *)b)->count;
+    return (x < y) - (x > y);
+}
+
+/* The total line matches foobar's, then functions by executed instructions, most first. */
+static void WriteInstructionCounts(void) {
+    const char *path = getenv("INSTRUCTION_COUNTS");
+    FILE *file = fopen(path ? path : "instruction_counts.txt", "w");
+    if (!file)
+        return;
+
+    int num_functions = 0;
+    for (int t = 0; t < num_count_tables; t++)
+        num_functions += count_tables[t].count;
+    struct FunctionCount *functions = malloc((num_functions ? num_functions : 1) * sizeof(*functions));
+    if (!functions) {
+        fclose(file);
+        return;
+    }
+
+    unsigned long long total = 0;
+    int n = 0;
+    for (int t = 0; t < num_count_tables; t++) {
+        for (int i = 0; i < count_tables[t].count; i++) {
+            functions[n].record = &count_tables[t].records[i];
+            functions[n].count = count_tables[t].counters[i];
+            total += functions[n++].count;
+        }
+    }
+    qsort(functions, n, sizeof(*functions), CompareFunctionCounts);
+
+    fprintf(file, "Total number of instructions executed: %llu\n", total);
+    for (int i = 0; i < n; i++) {
+        const struct CountedFunctionRecord *record = functions[i].record;
+        fprintf(file, "%s: %s, %d, %llu, %llu\n", record->name, record->filepath, record->lno,
+                record->static_instructions, functions[i].count);
+    }
+    free(functions);
+    fclose(file);
+}
+
+/* Doubles are stored by bit pattern; is_fp only changes how min/max order them. */
+static void AddValue(struct ValueSketch *sketch, int64_t value, int is_fp) {
+    if (sketch->evaluations++ == 0) {
+        sketch->min = sketch->max = value;
+    } else if (is_fp) {
+        double number, min, max;
+        memcpy(&number, &value, sizeof(number));
+        memcpy(&min, &sketch->min, sizeof(min));
+        memcpy(&max, &sketch->max, sizeof(max));
+        if (number < min)
+            sketch->min = value;
+        if (number > max)
+            sketch->max = value;
+    } else {
+        if (value < sketch->min)
+            sketch->min = value;
+        if (value > sketch->max)
+            sketch->max = value;
+    }
+
+    int smallest = 0;
+    for (int i = 0; i < sketch->used; i++) {
+        if (sketch->values[i] == value) {
+            sketch->counts[i]++;
+            return;
+        }
+        if (sketch->counts[i] < sketch->counts[smallest])
+            smallest = i;
+    }
+    if (sketch->used < VALUE_TOP_K) {
+        sketch->values[sketch->used] = value;
+        sketch->counts[sketch->used++] = 1;
+        return;
+    }
+    sketch->values[smallest] = value;
+    sketch->counts[smallest]++;
+}
+
+static void WriteValue(FILE *file, int64_t value, int is_fp) {
+    if (is_fp) {
+        double number;
+        memcpy(&number, &value, sizeof(number));
+        fprintf(file, "%g", number);
+    } else {
+        fprintf(file, "%lld", (long long)value);
+    }
+}
+
+static void WriteSketch(FILE *file, const char *name, const struct ValueSketch *sketch, int is_fp) {
+    fprintf(file, "  %s: min ", name);
+    WriteValue(file, sketch->min, is_fp);
+    fprintf(file, ", max ");
+    WriteValue(file, sketch->max, is_fp);
+    fprintf(file, ", top");
+
+    /* Most frequent first; used is at most VALUE_TOP_K. */
+    int order[VALUE_TOP_K];
+    for (int i = 0; i < sketch->used; i++) {
+        int j = i;
+        for (; j > 0 && sketch->counts[order[j - 1]] < sketch->counts[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+    for (int i = 0; i < sketch->used; i++) {
+        fprintf(file, "%s ", i ? "," : "");
+        WriteValue(file, sketch->values[order[i]], is_fp);
+        fprintf(file, " x%llu", sketch->counts[order[i]]);
+    }
+    fprintf(file, "\n");
+}
+
+static void WriteValues(void) {
+    const char *path = getenv("BRANCH_VALUES");
+    FILE *file = fopen(path ? path : "branch_values.txt", "w");
+    if (!file)
+        return;
+
+    for (int t = 0; t < num_compare_tables; t++) {
+        const struct CompareRecord *compares = compare_tables[t].records;
+        for (int i = 0; i < compare_tables[t].count; i++) {
+            const struct CompareRecord *compare = &compares[i];
+            int index = compare_tables[t].base + compare->compare_id;
+            if (index >= compare_profiles_size)
+                continue;
+            const struct CompareProfile *profile = &compare_profiles[index];
+            fprintf(file, "cmp_%d: %s, %d, %s, %llu\n", compare->compare_id, compare->filepath, compare->lno,
+                    compare->predicate, profile->lhs.evaluations);
+            if (profile->lhs.evaluations) {
+                WriteSketch(file, "lhs", &profile->lhs, compare->is_fp);
+                WriteSketch(file, "rhs", &profile->rhs, compare->is_fp);
+            }
+        }
+    }
+    fclose(file);
+}
+
+void LogCompare(int compareId, int64_t lhs, int64_t rhs) {
+    if (!tracing_enabled || compareId >= compare_profiles_size)
+        return;
+    AddValue(&compare_profiles[compareId].lhs, lhs, 0);
+    AddValue(&compare_profiles[compareId].rhs, rhs, 0);
+}
+
+void LogCompareFP(int compareId, double lhs, double rhs) {
+    int64_t lhs_bits, rhs_bits;
+
+    if (!tracing_enabled || compareId >= compare_profiles_size)
+        return;
+    memcpy(&lhs_bits, &lhs, sizeof(lhs_bits));
+    memcpy(&rhs_bits, &rhs, sizeof(rhs_bits));
+    AddValue(&compare_profiles[compareId].lhs, lhs_bits, 1);
+    AddValue(&compare_profiles[compareId].rhs, rhs_bits, 1);
+}
+
+static int CompareSleds(const void *a, const void *b) {
+    uintptr_t x = ((const struct SledRecord *)a)->address, y = ((const struct SledRecord *)b)->address;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Sleds are 8 byte aligned, so one atomic 8 byte store switches between the
+ * nop and "call rel32 trampoline; 3 byte nop" while other threads run.
+ */
+static void PatchSledTable(const struct SledTable *table, int enable) {
+    static const unsigned char nop[8] = {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+    if (table->begin == table->end || (enable && !LogSledSaveSize))
+        return;
+
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t low = table->begin[0].address & ~(page - 1);
+    uintptr_t high = table->end[-1].address + 8;
+    if (mprotect((void *)low, high - low, PROT_READ | PROT_WRITE | PROT_EXEC) != 0)
+        return;
+
+    for (const struct SledRecord *sled = table->begin; sled < table->end; sled++) {
+        unsigned char code[8];
+        if (enable) {
+            int32_t offset = (int32_t)(table->trampoline - (sled->address + 5));
+            code[0] = 0xe8;
+            memcpy(&code[1], &offset, 4);
+            code[5] = 0x0f;
+            code[6] = 0x1f;
+            code[7] = 0x00;
+        } else {
+            memcpy(code, nop, 8);
+        }
+        uint64_t word;
+        memcpy(&word, code, 8);
+        __atomic_store_n((uint64_t *)sled->address, word, __ATOMIC_RELEASE);
+    }
+
+    mprotect((void *)low, high - low, PROT_READ | PROT_EXEC);
+}
+
+static void PatchAllSleds(int enable) {
+    for (int t = 0; t < num_sled_tables; t++)
+        PatchSledTable(&sled_tables[t], enable);
+}
+
+void LogTracingEnable(void) {
+    tracing_enabled = 1;
+    PatchAllSleds(1);
+}
+
+void LogTracingDisable(void) {
+    tracing_enabled = 0;
+    PatchAllSleds(0);
+}
+
+int LogTracingEnabled(void) {
+    return tracing_enabled;
+}
+
+static void HandleTracingSignal(int signo) {
+    if (signo == SIGUSR1)
+        LogTracingEnable();
+    else
+        LogTracingDisable();
+}
+
+/* Only takes signals nobody handles yet, so a handler of the program or of a preloaded library stays. */
+static void InstallTracingSignal(int signo) {
+    struct sigaction action;
+    if (sigaction(signo, NULL, &action) != 0 || action.sa_handler != SIG_DFL) {
+        fprintf(stderr, "liblogger: signal %d already has a handler, not switching tracing with it\n", signo);
+        return;
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = HandleTracingSignal;
+    action.sa_flags = SA_RESTART;
+    sigaction(signo, &action, NULL);
+}
+
+/* Bytes xsave writes for every state component the OS enabled, 0 without xsave. */
+static unsigned int XsaveSize(void) {
+#if defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE))
+        return 0;
+    __cpuid_count(0xd, 0, eax, ebx, ecx, edx);
+    return ebx;
+#else
+    return 0;
+#endif
+}
+
+/* Called by every module of a patchable build; modules of one object share the section. */
+void LogRegisterSleds(struct SledRecord *begin, struct SledRecord *end, void *trampoline) {
+    for (int t = 0; t < num_sled_tables; t++) {
+        if (sled_tables[t].begin == begin)
+            return;
+    }
+
+    struct SledTable *grown = realloc(sled_tables, (num_sled_tables + 1) * sizeof(*grown));
+    if (!grown)
+        return;
+    sled_tables = grown;
+
+    struct SledTable *table = &sled_tables[num_sled_tables];
+    table->begin = begin;
+    table->end = end;
+    table->trampoline = (uintptr_t)trampoline;
+    qsort(begin, end - begin, sizeof(*begin), CompareSleds);
+
+    if (num_sled_tables++ == 0) {
+        const char *trace = getenv("BRANCH_TRACE");
+        tracing_enabled = trace && strcmp(trace, "1") == 0;
+
+        LogSledSaveSize = XsaveSize();
+        if (!LogSledSaveSize)
+            fprintf(stderr, "liblogger: no xsave on this machine, patchable probes stay off\n");
+
+        const char *signals = getenv("BRANCH_TRACE_SIGNALS");
+        if (signals && strcmp(signals, "1") == 0) {
+            InstallTracingSignal(SIGUSR1);
+            InstallTracingSignal(SIGUSR2);
+        }
+    }
+    if (tracing_enabled)
+        PatchSledTable(table, 1);
+}
+
+static struct TargetCount *FindTargetCount(struct TargetCount *table, size_t size, int callsite_id, uintptr_t target) {
+    size_t slot = ((target >> 4) ^ ((uintptr_t)callsite_id * 0x9E3779B1u)) & (size - 1);
+    while (table[slot].count && (table[slot].callsite_id != callsite_id || table[slot].target != target))
+        slot = (slot + 1) & (size - 1);
+    return &table[slot];
+}
+
+static void CountTarget(int callsite_id, uintptr_t target) {
+    if (2 * (target_counts_used + 1) > target_counts_size) {
+        size_t new_size = target_counts_size ? 2 * target_counts_size : 64;
+        struct TargetCount *table = calloc(new_size, sizeof(*table));
+        if (!table)
+            return;
+        for (size_t i = 0; i < target_counts_size; i++) {
+            if (target_counts[i].count)
+                *FindTargetCount(table, new_size, target_counts[i].callsite_id, target_counts[i].target) = target_counts[i];
+        }
+        free(target_counts);
+        target_counts = table;
+        target_counts_size = new_size;
+    }
+
+    struct TargetCount *entry = FindTargetCount(target_counts, target_counts_size, callsite_id, target);
+    if (!entry->count) {
+        entry->callsite_id = callsite_id;
+        entry->target = target;
+        target_counts_used++;
+    }
+    entry->count++;
+}
+
+/* Same line format as branch_info.txt with the count appended, read back by -skeleton-profile-use. */
+static void WriteProfile(void) {
+    FILE *file = fopen(getenv("BRANCH_PROFILE"), "w");
+    if (!file)
+        return;
+
+    for (int t = 0; t < num_branch_tables; t++) {
+        const struct BranchRecord *branches = branch_tables[t].records;
+        for (int i = 0; i < branch_tables[t].count; i++) {
+            const struct BranchRecord *branch = &branches[i];
+            fprintf(file, "br_%d: %s, %d, %d, %llu\n", branch->branch_id, branch->filepath,
+                    branch->src_lno, branch->dest_lno, branch_counts[branch_tables[t].base + branch->branch_id]);
+        }
+    }
+
+    for (int t = 0; t < num_callsite_tables; t++) {
+        const struct CallSiteRecord *callsites = callsite_tables[t].records;
+        for (int i = 0; i < callsite_tables[t].count; i++) {
+            const struct CallSiteRecord *callsite = &callsites[i];
+            int index = callsite_tables[t].base + callsite->callsite_id;
+            for (size_t j = 0; j < target_counts_size; j++) {
+                struct TargetCount *entry = &target_counts[j];
+                if (!entry->count || entry->callsite_id != index)
+                    continue;
+
+                /* Targets outside the function tables only resolve through the dynamic symbol table. */
+                const struct FunctionEntry *function = LookupFunction(entry->target);
+                Dl_info info;
+                if (function)
+                    fprintf(file, "cs_%d: %s, %d, %s, %llu\n", callsite->callsite_id, callsite->filepath,
+                            callsite->lno, function->record->name, entry->count);
+                else if (dladdr((void *)entry->target, &info) && info.dli_sname && info.dli_saddr == (void *)entry->target)
+                    fprintf(file, "cs_%d: %s, %d, %s, %llu\n", callsite->callsite_id, callsite->filepath,
+                            callsite->lno, info.dli_sname, entry->count);
+                else
+                    fprintf(file, "cs_%d: %s, %d, %p, %llu\n", callsite->callsite_id, callsite->filepath,
+                            callsite->lno, (void *)entry->target, entry->count);
+            }
+        }
+    }
+    fclose(file);
+}
+
+static int CompareFunctionIds(const void *a, const void *b) {
+    return ((const struct FunctionEntry *)a)->id - ((const struct FunctionEntry *)b)->id;
+}
+
+/*
+ * The branch_info.txt of the whole program, for the offline tools. The pass
+ * writes the file of one module, with the fn_N ids of that module; here
+ * they are the ids the trace prints.
+ */
+static void WriteInfo(void) {
+    FILE *file = fopen(getenv("BRANCH_INFO"), "w");
+    if (!file)
+        return;
+
+    for (int t = 0; t < num_branch_tables; t++) {
+        const struct BranchRecord *branches = branch_tables[t].records;
+        for (int i = 0; i < branch_tables[t].count; i++)
+            fprintf(file, "br_%d: %s, %d, %d\n", branches[i].branch_id, branches[i].filepath, branches[i].src_lno,
+                    branches[i].dest_lno);
+    }
+    for (int t = 0; t < num_callsite_tables; t++) {
+        const struct CallSiteRecord *callsites = callsite_tables[t].records;
+        for (int i = 0; i < callsite_tables[t].count; i++)
+            fprintf(file, "cs_%d: %s, %d\n", callsites[i].callsite_id, callsites[i].filepath, callsites[i].lno);
+    }
+    /* Only the entry the trace uses for each address, in id order */
+    struct FunctionEntry *functions = malloc((function_index_size + 1) * sizeof(*functions));
+    int num_functions = 0;
+    for (int i = 0; functions && i < function_index_size; i++) {
+        if (!i || function_index[i - 1].record->address != function_index[i].record->address)
+            functions[num_functions++] = function_index[i];
+    }
+    if (functions)
+        qsort(functions, num_functions, sizeof(*functions), CompareFunctionIds);
+    for (int i = 0; i < num_functions; i++) {
+        const struct FunctionRecord *function = functions[i].record;
+        fprintf(file, "fn_%d: %s, %s, %d\n", functions[i].id, function->name, function->filepath, function->lno);
+    }
+    free(functions);
+    fclose(file);
+}
+
+/* Profile format with 0/1 counts, so it also works as a -skeleton-prune-profile. */
+static void WriteCoverage(void) {
+    const char *path = getenv("BRANCH_COVERAGE");
+    FILE *file = fopen(path ? path : "branch_coverage.txt", "w");
+    if (!file)
+        return;
+
+    for (int t = 0; t < num_coverage_tables; t++) {
+        const struct CoverageTable *table = &coverage_tables[t];
+        for (int i = 0; i < table->count; i++) {
+            const struct BranchRecord *branch = &table->records[i];
+            fprintf(file, "br_%d: %s, %d, %d, %d\n", branch->branch_id, branch->filepath,
+                    branch->src_lno, branch->dest_lno, table->bitmap[branch->branch_id]);
+        }
+    }
+    fclose(file);
+}
 
 void LogBranch(int branchId, const char* filepath, int srcLine, int successor) {
-    printf("br_%d\n",branchId);
+    if (!tracing_enabled)
+        return;
+    if (branchId < branch_counts_size)
+        branch_counts[branchId]++;
+    printf("br_%d\n", LocalId(branch_tables, num_branch_tables, branchId));
     fflush(stdout);
 }
 
 
-void LogPointer(void (*funcPtr)()) {
+void LogPointer(void (*funcPtr)(), int callSiteId) {
+    if (!tracing_enabled)
+        return;
     uintptr_t funcPtrValue = (uintptr_t)funcPtr;
-    printf("*funcptr_%p\n", (void*)funcPtrValue);
+    CountTarget(callSiteId, funcPtrValue);
+    const struct FunctionEntry *function = LookupFunction(funcPtrValue);
+    if (function)
+        printf("*funcptr_%d\n", function->id);
+    else
+        printf("*funcptr_%p\n", (void*)funcPtrValue);
 }
 
+/* Entered from skeleton_sled_trampoline with the address after the patched call. */
+void LogSledHit(void *return_address, void *value) {
+    uintptr_t address = (uintptr_t)return_address - 5;
 
+    for (int t = 0; t < num_sled_tables; t++) {
+        struct SledRecord *low = sled_tables[t].begin, *high = sled_tables[t].end;
+        while (low < high) {
+            struct SledRecord *mid = low + (high - low) / 2;
+            if (mid->address < address)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        if (low == sled_tables[t].end || low->address != address)
+            continue;
 
+        int id = low->id + *low->base;
+        if (low->kind == SLED_BRANCH)
+            LogBranch(id, NULL, 0, 0);
+        else
+            LogPointer((void (*)())value, id);
+        return;
+    }
+}
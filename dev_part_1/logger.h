@@ -0,0 +1,17 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+/*
+ * Control API of liblogger for instrumented programs.
+ *
+ * Programs built with -skeleton-patchable start with tracing off unless
+ * BRANCH_TRACE=1 is set; other builds start with it on. While tracing is
+ * off, patchable probes are plain nops and logger calls return at once.
+ * With BRANCH_TRACE_SIGNALS=1, SIGUSR1 and SIGUSR2 turn tracing on and off
+ * in patchable builds, unless the signal already has a handler.
+ */
+void LogTracingEnable(void);
+void LogTracingDisable(void);
+int LogTracingEnabled(void);
+
+#endif
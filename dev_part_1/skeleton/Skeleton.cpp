@@ -1,16 +1,105 @@
 #include "llvm/Pass.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/GlobPattern.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/Transforms/Instrumentation/PGOInstrumentation.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "ProfileLine.h"
+#include <algorithm>
+#include <cstdint>
 #include <fstream>
 #include <map>
+#include <tuple>
 #include <vector>
 #include <string>
 
 using namespace llvm;
 
+// Passed to clang as `-mllvm -skeleton-profile-use=<file>`.
+static cl::opt<std::string> ProfileUse(
+    "skeleton-profile-use",
+    cl::desc("Attach branch weights from a profile written by liblogger "
+             "(BRANCH_PROFILE) instead of instrumenting the module"),
+    cl::value_desc("filename"), cl::init(""));
+
+static cl::opt<bool> Coverage(
+    "skeleton-coverage",
+    cl::desc("Record each edge as a single byte store into a coverage bitmap "
+             "instead of calling LogBranch; indirect calls are not instrumented"),
+    cl::init(false));
+
+static cl::opt<bool> Patchable(
+    "skeleton-patchable",
+    cl::desc("Emit nop sleds that liblogger patches into logger calls only "
+             "while tracing is enabled (x86-64)"),
+    cl::init(false));
+
+static cl::opt<bool> ValueProfile(
+    "skeleton-value-profile",
+    cl::desc("Record the operands of the icmp/fcmp deciding each conditional "
+             "branch (cmp_N) in bounded per-branch histograms"),
+    cl::init(false));
+
+static cl::opt<bool> ColdStubs(
+    "skeleton-cold-stubs",
+    cl::desc("Move each LogBranch/LogPointer call into a small out-of-line stub "
+             "in .text.unlikely, leaving a single call in the probed block"),
+    cl::init(false));
+
+static cl::opt<bool> CountInstructions(
+    "skeleton-count-instructions",
+    cl::desc("Add the static instruction count of every basic block to a "
+             "per-function counter each time the block runs"),
+    cl::init(false));
+
+static cl::opt<bool> CountMachineInstructions(
+    "skeleton-count-machine",
+    cl::desc("With -skeleton-count-instructions, weigh IR instructions by the "
+             "target's code size cost to estimate machine instructions"),
+    cl::init(false));
+
+// Selective instrumentation. Each list takes comma separated globs; an empty
+// include list means everything is included.
+static cl::list<std::string> IncludeFunctions(
+    "skeleton-functions", cl::desc("Only instrument functions matching these globs"),
+    cl::value_desc("glob,..."), cl::CommaSeparated);
+
+static cl::list<std::string> ExcludeFunctions(
+    "skeleton-exclude-functions", cl::desc("Do not instrument functions matching these globs"),
+    cl::value_desc("glob,..."), cl::CommaSeparated);
+
+static cl::list<std::string> IncludeFiles(
+    "skeleton-files", cl::desc("Only instrument code from source files matching these globs"),
+    cl::value_desc("glob,..."), cl::CommaSeparated);
+
+static cl::list<std::string> ExcludeFiles(
+    "skeleton-exclude-files", cl::desc("Do not instrument code from source files matching these globs"),
+    cl::value_desc("glob,..."), cl::CommaSeparated);
+
+static cl::opt<std::string> PruneProfile(
+    "skeleton-prune-profile",
+    cl::desc("Skip edges whose count in this BRANCH_PROFILE is outside the "
+             "-skeleton-cold-threshold/-skeleton-hot-threshold range"),
+    cl::value_desc("filename"), cl::init(""));
+
+static cl::opt<uint64_t> HotThreshold(
+    "skeleton-hot-threshold", cl::desc("Skip edges taken more often than this (0 disables)"),
+    cl::init(0));
+
+static cl::opt<uint64_t> ColdThreshold(
+    "skeleton-cold-threshold", cl::desc("Skip edges taken less often than this (0 disables)"),
+    cl::init(0));
+
 namespace {
 
 
@@ -20,123 +109,1012 @@ struct BranchInfo {
     unsigned int src_lno;
     unsigned int dest_lno;
 };
-std::vector<BranchInfo> branchInfos;
 
-FunctionCallee CreateBranchFunction(Function &F) {
-    LLVMContext &func_context = F.getContext();
+struct CallSiteInfo {
+    std::string filepath;
+    int callsite_id;
+    unsigned int lno;
+};
+
+struct CompareInfo {
+    std::string filepath;
+    int compare_id;
+    unsigned int lno;
+    std::string predicate;
+    bool is_fp;
+};
+
+// Address-taken functions, the possible targets of cs_N calls within the
+// module. LogPointer logs their fn_N id instead of the ASLR dependent address.
+struct FunctionInfo {
+    Function *function;
+    int function_id;
+    std::string name;
+    std::string filepath;
+    unsigned int lno;
+};
+
+// A function counted by -skeleton-count-instructions; its index in the module's
+// counter array is its position in ModuleProbes::counted.
+struct CountedFunctionInfo {
+    std::string name;
+    std::string filepath;
+    unsigned int lno;
+    uint64_t static_instructions;
+};
+
+// Everything one run of the pass records about the module it instruments.
+// Kept per run rather than in globals, so tables neither grow nor leak
+// between modules when one process compiles many of them.
+struct ModuleProbes {
+    std::vector<BranchInfo> branches;
+    std::vector<CallSiteInfo> callsites;
+    std::vector<CompareInfo> compares;
+    std::vector<FunctionInfo> functions;
+    std::vector<CountedFunctionInfo> counted;
+    // Where the registration ctor keeps the offsets liblogger gives this
+    // module's br_N, cs_N and cmp_N ids, see GetIdBase.
+    GlobalVariable *branch_base = nullptr;
+    GlobalVariable *callsite_base = nullptr;
+    GlobalVariable *compare_base = nullptr;
+};
+
+// One line of a BRANCH_PROFILE file, see WriteProfile() in logger.c.
+struct EdgeProfile {
+    std::string filepath;
+    unsigned int src_lno;
+    unsigned int dest_lno;
+    uint64_t count;
+};
+
+struct TargetProfile {
+    std::string filepath;
+    unsigned int lno;
+    std::string target;
+    uint64_t count;
+};
+
+// Ids are numbered per module, so a program of several modules has a
+// br_1 and a cs_1 in each of their files. Entries are keyed by (file, id).
+struct BranchProfile {
+    std::map<std::pair<std::string, int>, EdgeProfile> edges;
+    std::map<std::pair<std::string, int>, std::vector<TargetProfile>> targets;
+    // (file, src, dest) of every edge, nullptr where several edges share it.
+    std::map<std::tuple<std::string, unsigned int, unsigned int>, const EdgeProfile*> locations;
+};
+
+// The runtime entry points are looked up once per module, not per function.
+FunctionCallee CreateBranchFunction(Module &M) {
+    LLVMContext &func_context = M.getContext();
     std::vector<Type*> parameters = {
         Type::getInt32Ty(func_context),
     };
-    
+
     FunctionType *func_type = FunctionType::get(Type::getVoidTy(func_context), parameters, false);
 
-    FunctionCallee func_callee = F.getParent()->getOrInsertFunction("LogBranch", func_type);
+    FunctionCallee func_callee = M.getOrInsertFunction("LogBranch", func_type);
 
     return func_callee;
 }
 
-FunctionCallee CreatePointerFunction(Function &F) {
-    LLVMContext &func_context = F.getContext();
+FunctionCallee CreatePointerFunction(Module &M) {
+    LLVMContext &func_context = M.getContext();
     std::vector<Type*> ParamTypes = {
         Type::getInt8PtrTy(func_context),
+        Type::getInt32Ty(func_context),
     };
 
     // Define the function type
     FunctionType *func_type = FunctionType::get(Type::getVoidTy(func_context), ParamTypes, false);
 
-    // Check if the function exists within the module that F belongs to, and if not, insert it
-    FunctionCallee func_callee = F.getParent()->getOrInsertFunction("LogPointer", func_type);
-    
+    // Check if the function exists within the module, and if not, insert it
+    FunctionCallee func_callee = M.getOrInsertFunction("LogPointer", func_type);
+
     return func_callee;
 }
 
+// Every module numbers its ids from 1, so liblogger hands each module an
+// offset into one range for the whole program from the registration ctor.
+// The ctor stores it in this global, created on the first probe that needs it.
+GlobalVariable *GetIdBase(Module &M, GlobalVariable *&base, const char *name) {
+    if (!base) {
+        Type *int32_type = Type::getInt32Ty(M.getContext());
+        base = new GlobalVariable(M, int32_type, false, GlobalValue::PrivateLinkage,
+                                  ConstantInt::get(int32_type, 0), name);
+    }
+    return base;
+}
+
+// The id a probe passes to liblogger: its own id plus the module's offset.
+Value *CreateProbeId(IRBuilder<> &Builder, GlobalVariable *base, int id) {
+    return Builder.CreateAdd(Builder.CreateLoad(Builder.getInt32Ty(), base), Builder.getInt32(id));
+}
+
+// -skeleton-cold-stubs: the logger call, moved out of line into one stub per
+// module and entry point that every probe calls with its id. The stub uses
+// preserve_mostcc, so the probed block keeps no spills around the call, only
+// the id (and the pointer) and the call itself. It is placed with cold code
+// but not marked cold, which would make every probed block look unlikely to
+// the optimizer.
+Function *GetProbeStub(Module &M, FunctionCallee logger, GlobalVariable *base, bool pass_pointer) {
+    std::string name = pass_pointer ? "skeleton.stub.LogPointer" : "skeleton.stub.LogBranch";
+    if (Function *stub = M.getFunction(name))
+        return stub;
+
+    LLVMContext &context = M.getContext();
+    std::vector<Type*> parameters;
+    if (pass_pointer)
+        parameters.push_back(Type::getInt8PtrTy(context));
+    parameters.push_back(Type::getInt32Ty(context));
+
+    Function *stub = Function::Create(FunctionType::get(Type::getVoidTy(context), parameters, false),
+                                      GlobalValue::InternalLinkage, name, M);
+    stub->setCallingConv(CallingConv::PreserveMost);
+    stub->addFnAttr(Attribute::NoInline);
+    stub->addFnAttr(Attribute::OptimizeForSize);
+    stub->addFnAttr(Attribute::MinSize);
+    if (Triple(M.getTargetTriple()).isOSBinFormatELF())
+        stub->setSection(".text.unlikely.skeleton_stubs");
+
+    IRBuilder<> Builder(BasicBlock::Create(context, "entry", stub));
+    std::vector<Value*> arguments;
+    if (pass_pointer)
+        arguments.push_back(stub->getArg(0));
+    Value *id = stub->getArg(parameters.size() - 1);
+    arguments.push_back(Builder.CreateAdd(Builder.CreateLoad(Builder.getInt32Ty(), base), id));
+    Builder.CreateCall(logger, arguments);
+    Builder.CreateRetVoid();
+    return stub;
+}
+
+FunctionCallee CreateCompareFunction(Module &M, bool is_fp) {
+    LLVMContext &func_context = M.getContext();
+    Type *operand_type = is_fp ? Type::getDoubleTy(func_context) : Type::getInt64Ty(func_context);
+    return M.getOrInsertFunction(is_fp ? "LogCompareFP" : "LogCompare", Type::getVoidTy(func_context),
+                                 Type::getInt32Ty(func_context), operand_type, operand_type);
+}
+
+bool ReadBranchProfile(const std::string &path, BranchProfile &profile) {
+    std::ifstream file(path);
+    if (!file)
+        return false;
+
+    std::string line;
+    std::vector<std::string> fields;
+    int id;
+    unsigned int line_number = 0, malformed = 0;
+    while (std::getline(file, line)) {
+        line_number++;
+        if (ParseProfileLine(line, "br", id, fields) && fields.size() == 4) {
+            EdgeProfile edge{fields[0], 0, 0, 0};
+            if (ParseProfileNumber(fields[1], edge.src_lno) && ParseProfileNumber(fields[2], edge.dest_lno) &&
+                ParseProfileNumber(fields[3], edge.count)) {
+                profile.edges[{fields[0], id}] = edge;
+                continue;
+            }
+        } else if (ParseProfileLine(line, "cs", id, fields) && fields.size() == 4) {
+            TargetProfile target{fields[0], 0, fields[2], 0};
+            if (ParseProfileNumber(fields[1], target.lno) && ParseProfileNumber(fields[3], target.count)) {
+                profile.targets[{fields[0], id}].push_back(target);
+                continue;
+            }
+        } else if (line.compare(0, 3, "br_") != 0 && line.compare(0, 3, "cs_") != 0) {
+            continue;
+        }
+        // A truncated or edited profile loses the line, not the compile
+        if (!malformed++)
+            errs() << "skeleton: " << path << ":" << line_number << ": malformed profile line skipped\n";
+    }
+    if (malformed > 1)
+        errs() << "skeleton: " << path << ": " << malformed << " malformed profile lines skipped\n";
+
+    for (const auto &entry : profile.edges) {
+        const EdgeProfile &edge = entry.second;
+        auto inserted = profile.locations.insert({{edge.filepath, edge.src_lno, edge.dest_lno}, &edge});
+        if (!inserted.second)
+            inserted.first->second = nullptr;
+    }
+    return true;
+}
+
+// Visits every conditional branch edge that gets a br_N id, in id order.
+// Instrumentation and profile use must agree on this numbering.
+// A branch can only be a terminator, so only those are looked at.
+template <typename Callback>
+void ForEachBranchEdge(Function &F, int &branch_id_counter, Callback callback) {
+    for(auto &B:F) {
+        auto *branch_instruction = dyn_cast_or_null<BranchInst>(B.getTerminator());
+
+        if(!branch_instruction || !branch_instruction->isConditional())
+            continue;
+
+        DILocation *source_location = branch_instruction->getDebugLoc();
+
+        if(!source_location)
+            continue;
+
+        for (unsigned int ii = 0; ii < branch_instruction->getNumSuccessors(); ++ii) {
+
+            BasicBlock *successor = branch_instruction->getSuccessor(ii);
+
+            if(successor && !successor->empty()) {
+
+                DILocation *successor_location = successor->front().getDebugLoc();
+
+                if(successor_location) {
+                    BranchInfo info = {source_location->getFilename().str(), branch_id_counter,
+                                       source_location->getLine(), successor_location->getLine()};
+                    callback(branch_instruction, ii, info);
+                    branch_id_counter++;
+                }
+            }
+        }
+    }
+}
+
+// The block the probe of edge `ii` goes into. A successor that is also
+// entered from elsewhere, like the join block of an if without else, gets a
+// block of its own on the edge, so br_N counts the edge and not every entry
+// into the successor. The split happens after the edge got its id and its
+// dest line, so the numbering matches the unsplit module -skeleton-profile-use sees.
+BasicBlock *GetEdgeBlock(BranchInst *branch_instruction, unsigned int ii) {
+    if (BasicBlock *edge_block = SplitCriticalEdge(branch_instruction, ii))
+        return edge_block;
+    return branch_instruction->getSuccessor(ii);
+}
+
+// Same as ForEachBranchEdge for indirect calls, which get cs_N ids.
+template <typename Callback>
+void ForEachIndirectCall(Function &F, int &callsite_id_counter, Callback callback) {
+    for(auto &B:F) {
+        for(auto & I:B) {
+
+            auto *pointer_instruction = dyn_cast<CallInst>(&I);
+
+            if(!pointer_instruction || pointer_instruction->getCalledFunction() || pointer_instruction->isInlineAsm())
+                continue;
+
+            CallSiteInfo info = {"", callsite_id_counter, 0};
+            if (DILocation *call_location = pointer_instruction->getDebugLoc()) {
+                info.filepath = call_location->getFilename().str();
+                info.lno = call_location->getLine();
+            }
+            callback(pointer_instruction, info);
+            callsite_id_counter++;
+        }
+    }
+}
+
+// Conditional branches decided directly by a scalar icmp/fcmp get cmp_N ids.
+template <typename Callback>
+void ForEachCompareBranch(Function &F, int &compare_id_counter, Callback callback) {
+    for(auto &B:F) {
+        auto *branch_instruction = dyn_cast_or_null<BranchInst>(B.getTerminator());
+
+        if(!branch_instruction || !branch_instruction->isConditional())
+            continue;
+
+        auto *compare_instruction = dyn_cast<CmpInst>(branch_instruction->getCondition());
+        DILocation *source_location = branch_instruction->getDebugLoc();
+
+        if(!compare_instruction || !source_location)
+            continue;
+
+        Type *operand_type = compare_instruction->getOperand(0)->getType();
+        bool supported = operand_type->isFloatingPointTy() || operand_type->isPointerTy() ||
+                         (operand_type->isIntegerTy() && operand_type->getIntegerBitWidth() <= 64);
+        if(!supported)
+            continue;
+
+        CompareInfo info = {source_location->getFilename().str(), compare_id_counter, source_location->getLine(),
+                            (isa<FCmpInst>(compare_instruction) ? "fcmp " : "icmp ") +
+                                CmpInst::getPredicateName(compare_instruction->getPredicate()).str(),
+                            operand_type->isFloatingPointTy()};
+        callback(branch_instruction, compare_instruction, info);
+        compare_id_counter++;
+    }
+}
+
+// Instructions of a block that end up as code. PHIs, debug info and lifetime
+// markers are free; with a TTI each instruction costs its code size instead of 1.
+uint64_t CountBlockInstructions(BasicBlock &B, const TargetTransformInfo *TTI) {
+    uint64_t count = 0;
+    for (Instruction &I : B) {
+        if (isa<PHINode>(I) || isa<DbgInfoIntrinsic>(I) || I.isLifetimeStartOrEnd())
+            continue;
+        if (!TTI) {
+            count++;
+            continue;
+        }
+        InstructionCost cost = TTI->getInstructionCost(&I, TargetTransformInfo::TCK_CodeSize);
+        count += cost.isValid() ? *cost.getValue() : 1;
+    }
+    return count;
+}
+
+void CollectAddressTakenFunctions(Module &M, ModuleProbes &probes) {
+    int function_id_counter = 1;
+    for (auto &F : M.functions()) {
+        if (F.isIntrinsic() || !F.hasAddressTaken(nullptr, false, true, true))
+            continue;
+
+        FunctionInfo info = {&F, function_id_counter++, F.getName().str(), "", 0};
+        if (DISubprogram *subprogram = F.getSubprogram()) {
+            info.filepath = subprogram->getFilename().str();
+            info.lno = subprogram->getLine();
+        }
+        probes.functions.push_back(info);
+    }
+}
+
+// Widens a compare operand to the i64/double the runtime takes, keeping the
+// signedness the predicate compares with.
+Value *CreateCompareOperand(IRBuilder<> &Builder, CmpInst *compare_instruction, Value *operand) {
+    Type *operand_type = operand->getType();
+    if (operand_type->isFloatingPointTy())
+        return Builder.CreateFPCast(operand, Builder.getDoubleTy());
+    if (operand_type->isPointerTy())
+        return Builder.CreatePtrToInt(operand, Builder.getInt64Ty());
+    if (compare_instruction->isSigned())
+        return Builder.CreateSExt(operand, Builder.getInt64Ty());
+    return Builder.CreateZExt(operand, Builder.getInt64Ty());
+}
+
+Constant *GetFileNameConstant(Module &M, std::map<std::string, Constant*> &cache, const std::string &name) {
+    auto it = cache.find(name);
+    if (it != cache.end())
+        return it->second;
+
+    LLVMContext &context = M.getContext();
+    Constant *data = ConstantDataArray::getString(context, name);
+    auto *global = new GlobalVariable(M, data->getType(), true, GlobalValue::PrivateLinkage, data, "skeleton.file");
+    global->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    Constant *pointer = ConstantExpr::getPointerCast(global, Type::getInt8PtrTy(context));
+    cache[name] = pointer;
+    return pointer;
+}
+
+// Embeds the br_N/cs_N source locations in the module and registers them with
+// liblogger from a constructor, so the runtime can write a self-describing
+// profile without needing branch_info.txt at run time. In coverage mode the
+// bitmap is registered together with the br_N table it is indexed by, and
+// patchable builds also register the skeleton_sleds section of their object.
+// Instruction counters are registered next to the functions they belong to.
+// InstructionCountPass runs later on the same module and adds its call to
+// the ctor SkeletonPass emitted, if there is one.
+void EmitRegistrationCtor(Module &M, const ModuleProbes &probes, GlobalVariable *coverage_bitmap,
+                          Function *sled_trampoline, GlobalVariable *instruction_counters) {
+    LLVMContext &context = M.getContext();
+    Type *int32_type = Type::getInt32Ty(context);
+    Type *ptr_type = Type::getInt8PtrTy(context);
+    std::map<std::string, Constant*> file_names;
+
+    StructType *branch_record_type = StructType::get(context, {int32_type, ptr_type, int32_type, int32_type});
+    std::vector<Constant*> branch_records;
+    for (const auto &branch : probes.branches) {
+        branch_records.push_back(ConstantStruct::get(branch_record_type, {
+            ConstantInt::get(int32_type, branch.branch_id),
+            GetFileNameConstant(M, file_names, branch.filepath),
+            ConstantInt::get(int32_type, branch.src_lno),
+            ConstantInt::get(int32_type, branch.dest_lno)}));
+    }
+
+    StructType *callsite_record_type = StructType::get(context, {int32_type, ptr_type, int32_type});
+    std::vector<Constant*> callsite_records;
+    for (const auto &callsite : probes.callsites) {
+        callsite_records.push_back(ConstantStruct::get(callsite_record_type, {
+            ConstantInt::get(int32_type, callsite.callsite_id),
+            GetFileNameConstant(M, file_names, callsite.filepath),
+            ConstantInt::get(int32_type, callsite.lno)}));
+    }
+
+    StructType *compare_record_type = StructType::get(context, {int32_type, ptr_type, int32_type, ptr_type, int32_type});
+    std::vector<Constant*> compare_records;
+    for (const auto &compare : probes.compares) {
+        compare_records.push_back(ConstantStruct::get(compare_record_type, {
+            ConstantInt::get(int32_type, compare.compare_id),
+            GetFileNameConstant(M, file_names, compare.filepath),
+            ConstantInt::get(int32_type, compare.lno),
+            GetFileNameConstant(M, file_names, compare.predicate),
+            ConstantInt::get(int32_type, compare.is_fp)}));
+    }
+
+    StructType *function_record_type = StructType::get(context, {int32_type, ptr_type, ptr_type, ptr_type, int32_type});
+    std::vector<Constant*> function_records;
+    for (const auto &function : probes.functions) {
+        function_records.push_back(ConstantStruct::get(function_record_type, {
+            ConstantInt::get(int32_type, function.function_id),
+            ConstantExpr::getPointerCast(function.function, ptr_type),
+            GetFileNameConstant(M, file_names, function.name),
+            GetFileNameConstant(M, file_names, function.filepath),
+            ConstantInt::get(int32_type, function.lno)}));
+    }
+
+    Type *int64_type = Type::getInt64Ty(context);
+    StructType *counted_record_type = StructType::get(context, {ptr_type, ptr_type, int32_type, int64_type});
+    std::vector<Constant*> counted_records;
+    for (const auto &function : probes.counted) {
+        counted_records.push_back(ConstantStruct::get(counted_record_type, {
+            GetFileNameConstant(M, file_names, function.name),
+            GetFileNameConstant(M, file_names, function.filepath),
+            ConstantInt::get(int32_type, function.lno),
+            ConstantInt::get(int64_type, function.static_instructions)}));
+    }
+
+    // Empty tables are passed as null with a count of 0.
+    auto create_table = [&](StructType *record_type, std::vector<Constant*> &records, const char *name) -> Constant* {
+        if (records.empty())
+            return ConstantPointerNull::get(cast<PointerType>(ptr_type));
+        ArrayType *table_type = ArrayType::get(record_type, records.size());
+        auto *table = new GlobalVariable(M, table_type, true, GlobalValue::PrivateLinkage,
+                                         ConstantArray::get(table_type, records), name);
+        return ConstantExpr::getPointerCast(table, ptr_type);
+    };
+
+    IRBuilder<> Builder(context);
+    Function *ctor = M.getFunction("skeleton.module_ctor");
+    if (ctor) {
+        for (auto &B : *ctor) {
+            if (isa<ReturnInst>(B.getTerminator()))
+                Builder.SetInsertPoint(B.getTerminator());
+        }
+    } else {
+        ctor = Function::Create(FunctionType::get(Type::getVoidTy(context), false),
+                                GlobalValue::InternalLinkage, "skeleton.module_ctor", M);
+        Builder.SetInsertPoint(ReturnInst::Create(context, BasicBlock::Create(context, "entry", ctor)));
+        appendToGlobalCtors(M, ctor, 0);
+    }
+
+    if (coverage_bitmap) {
+        FunctionType *register_type = FunctionType::get(Type::getVoidTy(context), {ptr_type, int32_type, ptr_type}, false);
+        FunctionCallee register_coverage = M.getOrInsertFunction("LogRegisterCoverage", register_type);
+        Builder.CreateCall(register_coverage, {create_table(branch_record_type, branch_records, "skeleton.branches"),
+                                               ConstantInt::get(int32_type, branch_records.size()),
+                                               ConstantExpr::getPointerCast(coverage_bitmap, ptr_type)});
+    } else if (!branch_records.empty() || !callsite_records.empty() || !function_records.empty()) {
+        FunctionType *register_type = FunctionType::get(Type::getVoidTy(context), {ptr_type, int32_type}, false);
+        FunctionType *register_ids_type = FunctionType::get(int32_type, {ptr_type, int32_type}, false);
+        FunctionCallee register_branches = M.getOrInsertFunction("LogRegisterBranches", register_ids_type);
+        FunctionCallee register_callsites = M.getOrInsertFunction("LogRegisterCallSites", register_ids_type);
+        FunctionCallee register_functions = M.getOrInsertFunction("LogRegisterFunctions", register_type);
+        Value *branch_base = Builder.CreateCall(register_branches, {
+            create_table(branch_record_type, branch_records, "skeleton.branches"),
+            ConstantInt::get(int32_type, branch_records.size())});
+        if (probes.branch_base)
+            Builder.CreateStore(branch_base, probes.branch_base);
+        Value *callsite_base = Builder.CreateCall(register_callsites, {
+            create_table(callsite_record_type, callsite_records, "skeleton.callsites"),
+            ConstantInt::get(int32_type, callsite_records.size())});
+        if (probes.callsite_base)
+            Builder.CreateStore(callsite_base, probes.callsite_base);
+        Builder.CreateCall(register_functions, {create_table(function_record_type, function_records, "skeleton.functions"),
+                                                ConstantInt::get(int32_type, function_records.size())});
+    }
+
+    if (!compare_records.empty()) {
+        FunctionType *register_type = FunctionType::get(int32_type, {ptr_type, int32_type}, false);
+        FunctionCallee register_compares = M.getOrInsertFunction("LogRegisterCompares", register_type);
+        Value *compare_base = Builder.CreateCall(register_compares, {
+            create_table(compare_record_type, compare_records, "skeleton.compares"),
+            ConstantInt::get(int32_type, compare_records.size())});
+        if (probes.compare_base)
+            Builder.CreateStore(compare_base, probes.compare_base);
+    }
+
+    if (sled_trampoline) {
+        // Defined by the linker for the whole object the module ends up in.
+        auto section_bound = [&](const char *name) {
+            auto *bound = new GlobalVariable(M, Type::getInt8Ty(context), false, GlobalValue::ExternalWeakLinkage,
+                                             nullptr, name);
+            bound->setVisibility(GlobalValue::HiddenVisibility);
+            return bound;
+        };
+        FunctionType *register_type = FunctionType::get(Type::getVoidTy(context), {ptr_type, ptr_type, ptr_type}, false);
+        FunctionCallee register_sleds = M.getOrInsertFunction("LogRegisterSleds", register_type);
+        Builder.CreateCall(register_sleds, {section_bound("__start_skeleton_sleds"), section_bound("__stop_skeleton_sleds"),
+                                            ConstantExpr::getPointerCast(sled_trampoline, ptr_type)});
+    }
+
+    if (instruction_counters) {
+        FunctionType *register_type = FunctionType::get(Type::getVoidTy(context), {ptr_type, int32_type, ptr_type}, false);
+        FunctionCallee register_counts = M.getOrInsertFunction("LogRegisterInstructionCounts", register_type);
+        Builder.CreateCall(register_counts, {create_table(counted_record_type, counted_records, "skeleton.counted"),
+                                             ConstantInt::get(int32_type, counted_records.size()),
+                                             ConstantExpr::getPointerCast(instruction_counters, ptr_type)});
+    }
+}
+
+// Kinds of sled records, see struct SledRecord in logger.c.
+enum SledKind { SLED_BRANCH = 0, SLED_POINTER = 1 };
+
+// A patchable probe: an 8 byte aligned 8 byte nop, recorded in the
+// skeleton_sleds section. liblogger swaps it with one atomic store for
+// "call skeleton_sled_trampoline; nop" while tracing is on. Pointer probes
+// pin the called value to %r11, where the trampoline picks it up. The record
+// also points at the module's id base, see GetIdBase.
+void CreateSled(IRBuilder<> &Builder, SledKind kind, int id, GlobalVariable *base, Value *called_value) {
+    std::vector<Type*> types;
+    std::vector<Value*> operands;
+    std::string constraints;
+    if (kind == SLED_POINTER) {
+        types.push_back(called_value->getType());
+        operands.push_back(called_value);
+        constraints = "{r11},";
+    }
+    std::string base_operand = "${" + std::to_string(operands.size()) + ":c}";
+    types.push_back(base->getType());
+    operands.push_back(base);
+    constraints += "i";
+
+    std::string text =
+        ".p2align 3\n"
+        "1:\n"
+        ".byte 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00\n"
+        ".pushsection skeleton_sleds,\"aw\",@progbits\n"
+        ".p2align 3\n"
+        ".quad 1b\n"
+        ".long " + std::to_string(kind) + ", " + std::to_string(id) + "\n"
+        ".quad " + base_operand + "\n"
+        ".popsection";
+
+    FunctionType *asm_type = FunctionType::get(Builder.getVoidTy(), types, false);
+    Builder.CreateCall(InlineAsm::get(asm_type, text, constraints, true), operands);
+}
+
+// Sleds can sit anywhere in a function, so the trampoline saves every caller
+// saved register and the flags, and xsaves the x87, SSE and AVX state, upper
+// ymm/zmm halves included, into an area of LogSledSaveSize bytes (set by
+// liblogger from cpuid) before calling into liblogger. One copy per linked
+// object (linkonce_odr hidden) keeps the call within rel32 range.
+Function *GetSledTrampoline(Module &M) {
+    if (Function *trampoline = M.getFunction("skeleton_sled_trampoline"))
+        return trampoline;
+
+    LLVMContext &context = M.getContext();
+    Function *trampoline = Function::Create(FunctionType::get(Type::getVoidTy(context), false),
+                                            GlobalValue::LinkOnceODRLinkage, "skeleton_sled_trampoline", M);
+    trampoline->setVisibility(GlobalValue::HiddenVisibility);
+    trampoline->addFnAttr(Attribute::Naked);
+    trampoline->addFnAttr(Attribute::NoInline);
+    trampoline->addFnAttr(Attribute::NoUnwind);
+
+    // xrstor faults unless the xsave header past the legacy area is zero
+    std::string text =
+        "pushfq\n"
+        "pushq %rax\n pushq %rcx\n pushq %rdx\n pushq %rsi\n pushq %rdi\n"
+        "pushq %r8\n pushq %r9\n pushq %r10\n pushq %r11\n pushq %rbx\n"
+        "movq %rsp, %rbx\n"
+        "movq LogSledSaveSize@GOTPCREL(%rip), %rax\n"
+        "movl (%rax), %eax\n"
+        "subq %rax, %rsp\n"
+        "andq $$-64, %rsp\n";
+    for (int i = 0; i < 8; i++)
+        text += "movq $$0, " + std::to_string(512 + 8 * i) + "(%rsp)\n";
+    text +=
+        "movl $$-1, %eax\n"
+        "movl $$-1, %edx\n"
+        "xsave64 (%rsp)\n"
+        "cld\n"
+        "movq 88(%rbx), %rdi\n"
+        "movq %r11, %rsi\n"
+        "call LogSledHit@PLT\n"
+        "movl $$-1, %eax\n"
+        "movl $$-1, %edx\n"
+        "xrstor64 (%rsp)\n"
+        "movq %rbx, %rsp\n"
+        "popq %rbx\n popq %r11\n popq %r10\n popq %r9\n popq %r8\n"
+        "popq %rdi\n popq %rsi\n popq %rdx\n popq %rcx\n popq %rax\n"
+        "popfq\n"
+        "ret";
+
+    IRBuilder<> Builder(BasicBlock::Create(context, "entry", trampoline));
+    Builder.CreateCall(InlineAsm::get(FunctionType::get(Type::getVoidTy(context), false), text, "", true));
+    Builder.CreateUnreachable();
+    return trampoline;
+}
+
+// Finds the profile entry for an edge, by file and id if its lines still
+// match and otherwise by a unique (file, src, dest) match.
+const EdgeProfile *LookupEdge(const BranchProfile &profile, const BranchInfo &info) {
+    auto same_location = [&](const EdgeProfile &edge) {
+        return edge.src_lno == info.src_lno && edge.dest_lno == info.dest_lno;
+    };
+
+    auto it = profile.edges.find({info.filepath, info.branch_id});
+    if (it != profile.edges.end() && same_location(it->second))
+        return &it->second;
+
+    auto location = profile.locations.find({info.filepath, info.src_lno, info.dest_lno});
+    return location != profile.locations.end() ? location->second : nullptr;
+}
+
+const std::vector<TargetProfile> *LookupTargets(const BranchProfile &profile, const CallSiteInfo &info) {
+    auto it = profile.targets.find({info.filepath, info.callsite_id});
+    if (it == profile.targets.end() || it->second.empty())
+        return nullptr;
+    if (it->second.front().lno != info.lno)
+        return nullptr;
+    return &it->second;
+}
+
+// Decides which functions, files and edges get probes. Filtered edges still
+// consume their br_N id so ids stay comparable between differently filtered builds.
+class InstrumentationFilter {
+public:
+    InstrumentationFilter() {
+        AddPatterns(IncludeFunctions, include_functions);
+        AddPatterns(ExcludeFunctions, exclude_functions);
+        AddPatterns(IncludeFiles, include_files);
+        AddPatterns(ExcludeFiles, exclude_files);
+
+        if (!PruneProfile.empty() && !ReadBranchProfile(PruneProfile, prune_profile))
+            errs() << "skeleton: cannot read profile '" << PruneProfile << "'\n";
+    }
+
+    bool ShouldInstrument(const Function &F) const {
+        // The source level name is tried too, so C++ functions can be given unmangled.
+        StringRef source_name = F.getSubprogram() ? F.getSubprogram()->getName() : StringRef();
+        if (!include_functions.empty() && !Matches(include_functions, F.getName()) &&
+            !Matches(include_functions, source_name))
+            return false;
+        return !Matches(exclude_functions, F.getName()) && !Matches(exclude_functions, source_name);
+    }
+
+    bool ShouldInstrument(const std::string &filepath) const {
+        if (!include_files.empty() && !Matches(include_files, filepath))
+            return false;
+        return !Matches(exclude_files, filepath);
+    }
+
+    bool ShouldInstrument(const BranchInfo &info) {
+        if (!ShouldInstrument(info.filepath))
+            return false;
+        if (prune_profile.edges.empty())
+            return true;
+
+        // Edges the profile has not seen are kept, they may be new code.
+        const EdgeProfile *edge = LookupEdge(prune_profile, info);
+        if (!edge)
+            return true;
+        if ((HotThreshold && edge->count > HotThreshold) || (ColdThreshold && edge->count < ColdThreshold)) {
+            pruned_edges++;
+            return false;
+        }
+        return true;
+    }
+
+    unsigned int pruned_edges = 0;
+
+private:
+    static void AddPatterns(const cl::list<std::string> &option, std::vector<GlobPattern> &patterns) {
+        for (const std::string &text : option) {
+            Expected<GlobPattern> pattern = GlobPattern::create(text);
+            if (!pattern) {
+                errs() << "skeleton: ignoring pattern '" << text << "': " << toString(pattern.takeError()) << "\n";
+                continue;
+            }
+            patterns.push_back(std::move(*pattern));
+        }
+    }
+
+    static bool Matches(const std::vector<GlobPattern> &patterns, StringRef text) {
+        if (text.empty())
+            return false;
+        for (const GlobPattern &pattern : patterns) {
+            if (pattern.match(text))
+                return true;
+        }
+        return false;
+    }
+
+    std::vector<GlobPattern> include_functions, exclude_functions;
+    std::vector<GlobPattern> include_files, exclude_files;
+    BranchProfile prune_profile;
+};
+
 
 struct SkeletonPass : public PassInfoMixin<SkeletonPass> {
-    PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
 
-        int branch_id_counter = 1;
-        std::ofstream file("branch_info.txt", std::ios::out | std::ios::trunc);
-        for (auto &F : M.functions()) {
+        if (!ProfileUse.empty())
+            return ApplyProfile(M);
 
-            LLVMContext &func_context = F.getContext();
-            FunctionCallee branch_func_callee = CreateBranchFunction(F);
-            FunctionCallee pointer_func_callee = CreatePointerFunction(F);
+        InstrumentationFilter filter;
+        ModuleProbes probes;
+        std::vector<std::pair<BasicBlock*, int>> coverage_probes;
+        bool any_sleds = false;
 
-            for(auto &B:F) {
-                for(auto & I:B) {
-                    
-                    auto *branch_instruction = dyn_cast<BranchInst>(&I);
+        // Before any probe or table below takes an address itself.
+        CollectAddressTakenFunctions(M, probes);
 
-                    if(branch_instruction && branch_instruction->isConditional()) {
+        bool patchable = Patchable && !Coverage && !CountInstructions;
+        if (patchable && Triple(M.getTargetTriple()).getArch() != Triple::x86_64) {
+            errs() << "skeleton: -skeleton-patchable needs an x86-64 target, using logger calls\n";
+            patchable = false;
+        }
 
-                        DILocation *source_location = branch_instruction->getDebugLoc(); //Maybe using I.getDebugLoc()
+        int branch_id_counter = 1;
+        int callsite_id_counter = 1;
+        int compare_id_counter = 1;
+        // Declared up front so a probe never has to search the module's symbol table.
+        FunctionCallee branch_func_callee, pointer_func_callee, compare_func_callee, compare_fp_func_callee;
+        if (!Coverage && !patchable && !CountInstructions) {
+            branch_func_callee = CreateBranchFunction(M);
+            pointer_func_callee = CreatePointerFunction(M);
+        }
+        if (ValueProfile) {
+            compare_func_callee = CreateCompareFunction(M, false);
+            compare_fp_func_callee = CreateCompareFunction(M, true);
+        }
 
-                        if(source_location) {
+        for (auto &F : M.functions()) {
 
-                            std::string source_file_name = source_location->getFilename().str();
+            // Also skips the stubs and constructors the pass adds itself.
+            if (F.isDeclaration() || F.getName().startswith("skeleton."))
+                continue;
 
-                            unsigned int source_line_number = source_location->getLine();
+            LLVMContext &func_context = F.getContext();
+            bool instrument_function = filter.ShouldInstrument(F);
+            bool has_sleds = false;
 
-                            for (unsigned int ii = 0; ii < branch_instruction->getNumSuccessors(); ++ii) {
-                                
-                                BasicBlock *successor = branch_instruction->getSuccessor(ii);
+            // The value probe goes right before the branch, after the compare.
+            // Without -skeleton-value-profile nothing is recorded, so the walk is skipped.
+            if (ValueProfile) {
+                ForEachCompareBranch(F, compare_id_counter, [&](BranchInst *branch_instruction, CmpInst *compare_instruction, const CompareInfo &info) {
+                    if (!instrument_function || !filter.ShouldInstrument(info.filepath))
+                        return;
 
-                                if(successor && !successor->empty()) {
+                    probes.compares.push_back(info);
 
-                                    DILocation *successor_location = successor->front().getDebugLoc();
+                    IRBuilder<> Builder(branch_instruction);
+                    Value *lhs = CreateCompareOperand(Builder, compare_instruction, compare_instruction->getOperand(0));
+                    Value *rhs = CreateCompareOperand(Builder, compare_instruction, compare_instruction->getOperand(1));
+                    Value *id = CreateProbeId(Builder, GetIdBase(M, probes.compare_base, "skeleton.compare_base"),
+                                              info.compare_id);
+                    Builder.CreateCall(info.is_fp ? compare_fp_func_callee : compare_func_callee, {id, lhs, rhs});
+                });
+            }
 
-                                    if(successor_location) {
-                                        unsigned int target_line_number = successor_location->getLine();
+            ForEachBranchEdge(F, branch_id_counter, [&](BranchInst *branch_instruction, unsigned int ii, const BranchInfo &info) {
+                // Instruction counting replaces the logger calls, not the bitmap.
+                if ((CountInstructions && !Coverage) || !instrument_function || !filter.ShouldInstrument(info))
+                    return;
 
-                                        branchInfos.push_back({source_file_name, branch_id_counter, source_line_number, target_line_number});
+                probes.branches.push_back(info);
+                BasicBlock *edge_block = GetEdgeBlock(branch_instruction, ii);
 
-                                        IRBuilder<> Builder(func_context);
+                if (Coverage) {
+                    coverage_probes.push_back({edge_block, info.branch_id});
+                    return;
+                }
 
-                                        Builder.SetInsertPoint(&(successor->front()));
+                IRBuilder<> Builder(func_context);
 
-                                        Builder.CreateCall(branch_func_callee, {ConstantInt::get(Type::getInt32Ty(func_context), branch_id_counter)});
+                if (patchable) {
+                    Builder.SetInsertPoint(&*edge_block->getFirstInsertionPt());
+                    CreateSled(Builder, SLED_BRANCH, info.branch_id, GetIdBase(M, probes.branch_base, "skeleton.branch_base"),
+                               nullptr);
+                    has_sleds = true;
+                    return;
+                }
 
-                                        branch_id_counter++;
-                                    }
+                Builder.SetInsertPoint(&*edge_block->getFirstInsertionPt());
 
-                                }
-                            }
+                GlobalVariable *branch_base = GetIdBase(M, probes.branch_base, "skeleton.branch_base");
+                if (ColdStubs) {
+                    Function *stub = GetProbeStub(M, branch_func_callee, branch_base, false);
+                    Builder.CreateCall(stub, {Builder.getInt32(info.branch_id)})->setCallingConv(CallingConv::PreserveMost);
+                    return;
+                }
 
-                        }
+                Builder.CreateCall(branch_func_callee, {CreateProbeId(Builder, branch_base, info.branch_id)});
+            });
 
-                    }
+            ForEachIndirectCall(F, callsite_id_counter, [&](CallInst *pointer_instruction, const CallSiteInfo &info) {
+                if (Coverage || CountInstructions || !instrument_function || !filter.ShouldInstrument(info.filepath))
+                    return;
 
-                    auto *pointer_instruction = dyn_cast<CallInst>(&I);
-                    
-                    if( pointer_instruction){
-                        
-                        if(!pointer_instruction->getCalledFunction()){
-                            
-                            IRBuilder<> Builder(pointer_instruction);
+                probes.callsites.push_back(info);
 
-                            Value *called_value = pointer_instruction->getCalledOperand();
-                            
-                            // if (called_value) {
+                IRBuilder<> Builder(pointer_instruction);
 
-                            //     errs() << "*funcptr_" << called_value << "\n";
-                            // }
+                Value *called_value = Builder.CreatePointerCast(pointer_instruction->getCalledOperand(), Type::getInt8PtrTy(func_context));
+                GlobalVariable *callsite_base = GetIdBase(M, probes.callsite_base, "skeleton.callsite_base");
 
-                            Builder.CreateCall(pointer_func_callee, called_value);
-                        }
-                        
-                    }
+                if (patchable) {
+                    CreateSled(Builder, SLED_POINTER, info.callsite_id, callsite_base, called_value);
+                    has_sleds = true;
+                    return;
                 }
+
+                if (ColdStubs) {
+                    Function *stub = GetProbeStub(M, pointer_func_callee, callsite_base, true);
+                    Builder.CreateCall(stub, {called_value, Builder.getInt32(info.callsite_id)})
+                        ->setCallingConv(CallingConv::PreserveMost);
+                    return;
+                }
+
+                Builder.CreateCall(pointer_func_callee, {called_value, CreateProbeId(Builder, callsite_base, info.callsite_id)});
+            });
+
+            if (has_sleds) {
+                // A patched sled pushes a return address, which would clobber
+                // data a leaf function keeps below %rsp.
+                F.addFnAttr(Attribute::NoRedZone);
+                any_sleds = true;
             }
-            
         }
 
-        for (const auto &branch : branchInfos) {
-            file << "br_" << branch.branch_id << ": " << branch.filepath << ", " 
+        std::error_code error;
+        raw_fd_ostream file("branch_info.txt", error);
+        for (const auto &branch : probes.branches) {
+            file << "br_" << branch.branch_id << ": " << branch.filepath << ", "
                 << branch.src_lno << ", " << branch.dest_lno << "\n";
         }
+        for (const auto &callsite : probes.callsites) {
+            file << "cs_" << callsite.callsite_id << ": " << callsite.filepath << ", " << callsite.lno << "\n";
+        }
+        for (const auto &function : probes.functions) {
+            file << "fn_" << function.function_id << ": " << function.name << ", " << function.filepath << ", "
+                << function.lno << "\n";
+        }
+        for (const auto &compare : probes.compares) {
+            file << "cmp_" << compare.compare_id << ": " << compare.filepath << ", " << compare.lno << ", "
+                << compare.predicate << "\n";
+        }
         file.close();
-        return PreservedAnalyses::all();
+
+        if (filter.pruned_edges)
+            errs() << "skeleton: pruned " << filter.pruned_edges << " edges using '" << PruneProfile << "'\n";
+
+        Function *sled_trampoline = any_sleds ? GetSledTrampoline(M) : nullptr;
+
+        GlobalVariable *coverage_bitmap = nullptr;
+        if (Coverage && !coverage_probes.empty()) {
+            // Indexed by br_N. The probe is a plain store of 1, so a taken
+            // edge costs no load, no read-modify-write and no call.
+            Type *int8_type = Type::getInt8Ty(M.getContext());
+            ArrayType *bitmap_type = ArrayType::get(int8_type, branch_id_counter);
+            coverage_bitmap = new GlobalVariable(M, bitmap_type, false, GlobalValue::PrivateLinkage,
+                                                 ConstantAggregateZero::get(bitmap_type), "skeleton.coverage");
+            for (const auto &probe : coverage_probes) {
+                IRBuilder<> Builder(&*probe.first->getFirstInsertionPt());
+                Builder.CreateStore(ConstantInt::get(int8_type, 1),
+                                    Builder.CreateConstInBoundsGEP2_32(bitmap_type, coverage_bitmap, 0, probe.second));
+            }
+        }
+
+        if (coverage_bitmap || sled_trampoline || !probes.compares.empty() ||
+            (!Coverage && (!probes.branches.empty() || !probes.callsites.empty())))
+            EmitRegistrationCtor(M, probes, coverage_bitmap, sled_trampoline, nullptr);
+
+        return PreservedAnalyses::none();
     };
+
+    // Second phase: no instrumentation, only !prof metadata from the profile.
+    PreservedAnalyses ApplyProfile(Module &M) {
+        BranchProfile profile;
+        if (!ReadBranchProfile(ProfileUse, profile)) {
+            errs() << "skeleton: cannot read profile '" << ProfileUse << "'\n";
+            return PreservedAnalyses::all();
+        }
+
+        MDBuilder md_builder(M.getContext());
+        int branch_id_counter = 1;
+        int callsite_id_counter = 1;
+        unsigned int matched_edges = 0, total_edges = 0, annotated_calls = 0;
+
+        for (auto &F : M.functions()) {
+
+            if (F.isDeclaration())
+                continue;
+
+            // Weights are only known for a branch when both of its edges matched.
+            std::map<BranchInst*, std::vector<const EdgeProfile*>> branch_edges;
+            ForEachBranchEdge(F, branch_id_counter, [&](BranchInst *branch_instruction, unsigned int ii, const BranchInfo &info) {
+                auto &edges = branch_edges[branch_instruction];
+                edges.resize(branch_instruction->getNumSuccessors(), nullptr);
+                edges[ii] = LookupEdge(profile, info);
+                total_edges++;
+                matched_edges += edges[ii] != nullptr;
+            });
+
+            for (auto &entry : branch_edges) {
+                std::vector<uint32_t> weights;
+                for (const EdgeProfile *edge : entry.second) {
+                    if (!edge)
+                        break;
+                    // br_N counts the edge itself, see GetEdgeBlock. Clamp
+                    // the way clang does for its own branch weights.
+                    weights.push_back((uint32_t)std::min<uint64_t>(edge->count, UINT32_MAX - 1) + 1);
+                }
+                if (weights.size() == entry.second.size())
+                    entry.first->setMetadata(LLVMContext::MD_prof, md_builder.createBranchWeights(weights));
+            }
+
+            ForEachIndirectCall(F, callsite_id_counter, [&](CallInst *pointer_instruction, const CallSiteInfo &info) {
+                const std::vector<TargetProfile> *targets = LookupTargets(profile, info);
+                if (!targets)
+                    return;
+
+                std::vector<InstrProfValueData> value_data;
+                uint64_t total = 0;
+                for (const auto &target : *targets) {
+                    total += target.count;
+                    if (target.target.compare(0, 2, "0x") == 0)
+                        continue;
+                    Function *callee = M.getFunction(target.target);
+                    std::string pgo_name = callee ? getPGOFuncName(*callee) : target.target;
+                    value_data.push_back({IndexedInstrProf::ComputeHash(pgo_name), target.count});
+                }
+                if (value_data.empty())
+                    return;
+
+                std::sort(value_data.begin(), value_data.end(), [](const InstrProfValueData &a, const InstrProfValueData &b) {
+                    return a.Count > b.Count;
+                });
+                annotateValueSite(M, *pointer_instruction, value_data, total, IPVK_IndirectCallTarget, value_data.size());
+                annotated_calls++;
+            });
+        }
+
+        errs() << "skeleton: matched " << matched_edges << " of " << total_edges
+               << " edges and " << annotated_calls << " indirect calls from '" << ProfileUse << "'\n";
+        return PreservedAnalyses::none();
+    }
+};
+
+// -skeleton-count-instructions runs after the optimizer, so the counted blocks
+// are the ones that get compiled rather than the unoptimized IR SkeletonPass sees.
+struct InstructionCountPass : public PassInfoMixin<InstructionCountPass> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
+        InstrumentationFilter filter;
+        ModuleProbes probes;
+        FunctionAnalysisManager &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+        // (block, index into probes.counted, instructions in the block)
+        std::vector<std::tuple<BasicBlock*, int, uint64_t>> count_probes;
+
+        for (auto &F : M.functions()) {
+
+            // Also skips the stubs and constructors the pass adds itself.
+            if (F.isDeclaration() || F.getName().startswith("skeleton."))
+                continue;
+
+            DISubprogram *subprogram = F.getSubprogram();
+            std::string filepath = subprogram ? subprogram->getFilename().str() : "";
+            if (!filter.ShouldInstrument(F) || !filter.ShouldInstrument(filepath))
+                continue;
+
+            const TargetTransformInfo *TTI = CountMachineInstructions ? &FAM.getResult<TargetIRAnalysis>(F) : nullptr;
+            CountedFunctionInfo info = {F.getName().str(), filepath, subprogram ? subprogram->getLine() : 0, 0};
+            for (auto &B : F) {
+                uint64_t count = CountBlockInstructions(B, TTI);
+                if (count)
+                    count_probes.push_back({&B, (int)probes.counted.size(), count});
+                info.static_instructions += count;
+            }
+            probes.counted.push_back(info);
+        }
+
+        if (count_probes.empty())
+            return PreservedAnalyses::all();
+
+        // One i64 per counted function. The probe is a plain load, add and
+        // store, so concurrent threads can lose counts but never slow down.
+        Type *int64_type = Type::getInt64Ty(M.getContext());
+        ArrayType *counters_type = ArrayType::get(int64_type, probes.counted.size());
+        auto *instruction_counters = new GlobalVariable(M, counters_type, false, GlobalValue::PrivateLinkage,
+                                                        ConstantAggregateZero::get(counters_type), "skeleton.instructions");
+        for (const auto &probe : count_probes) {
+            IRBuilder<> Builder(&*std::get<0>(probe)->getFirstInsertionPt());
+            Value *counter = Builder.CreateConstInBoundsGEP2_32(counters_type, instruction_counters, 0, std::get<1>(probe));
+            Value *count = Builder.CreateAdd(Builder.CreateLoad(int64_type, counter), Builder.getInt64(std::get<2>(probe)));
+            Builder.CreateStore(count, counter);
+        }
+
+        EmitRegistrationCtor(M, probes, nullptr, nullptr, instruction_counters);
+        return PreservedAnalyses::none();
+    }
 };
 
 }
@@ -151,7 +1129,16 @@ llvmGetPassPluginInfo() {
             PB.registerPipelineStartEPCallback(
                 [](ModulePassManager &MPM, OptimizationLevel Level) {
                     MPM.addPass(SkeletonPass());
+                    // The regular -O2 pipeline only promotes indirect calls
+                    // when clang itself is doing PGO, so schedule it here.
+                    if (!ProfileUse.empty() && Level != OptimizationLevel::O0)
+                        MPM.addPass(PGOIndirectCallPromotion());
+                });
+            PB.registerOptimizerLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel) {
+                    if (CountInstructions && ProfileUse.empty())
+                        MPM.addPass(InstructionCountPass());
                 });
         }
     };
-}
\ No newline at end of file
+}
@@ -0,0 +1,342 @@
+#include "Trace.h"
+
+#include <atomic>
+#include <cerrno>
+#include <fstream>
+#include <map>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::~MappedFile() {
+    if (map_)
+        munmap(map_, size_);
+}
+
+bool MappedFile::Open(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return false;
+    }
+    size_ = st.st_size;
+    if (size_ > 0) {
+        map_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map_ == MAP_FAILED) {
+            int saved = errno;
+            map_ = nullptr;
+            size_ = 0;
+            close(fd);
+            errno = saved;
+            return false;
+        }
+        // Chunks are read front to back, one per thread
+        madvise(map_, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char *>(map_);
+    }
+    close(fd);
+    return true;
+}
+
+template <typename T>
+static T &Slot(std::vector<T> &table, int id) {
+    if ((size_t)id >= table.size())
+        table.resize(id + 1);
+    return table[id];
+}
+
+bool ReadTraceMetadata(const std::string &path, TraceMetadata &metadata) {
+    std::ifstream file(path);
+    if (!file)
+        return false;
+
+    std::string line;
+    std::vector<std::string> fields;
+    int id;
+    while (std::getline(file, line)) {
+        // Lines with a bad number are skipped, like lines of another kind
+        if (ParseProfileLine(line, "br", id, fields) && fields.size() >= 3) {
+            BranchInfo branch{fields[0]};
+            if (ParseProfileNumber(fields[1], branch.src_lno) && ParseProfileNumber(fields[2], branch.dest_lno))
+                Slot(metadata.branches, id) = branch;
+        } else if (ParseProfileLine(line, "cs", id, fields) && fields.size() >= 2) {
+            CallSiteInfo callsite{fields[0]};
+            if (ParseProfileNumber(fields[1], callsite.lno))
+                Slot(metadata.callsites, id) = callsite;
+        } else if (ParseProfileLine(line, "fn", id, fields) && fields.size() >= 3) {
+            FunctionInfo function{fields[0], fields[1]};
+            if (ParseProfileNumber(fields[2], function.lno))
+                Slot(metadata.functions, id) = function;
+        }
+    }
+    return true;
+}
+
+bool TraceReader::Open(const std::string &path, std::string &error) {
+    path_ = path;
+    if (!file_.Open(path)) {
+        error = path + ": " + std::strerror(errno);
+        return false;
+    }
+
+    format_ = TraceFormat::Text;
+    if (file_.size() >= 8 && Word(0) == FoobarTraceMagic) {
+        if (Word(1) != FoobarTraceVersion && Word(1) != 2) {
+            error = path + ": foobar trace version " + std::to_string(Word(1)) + ", expected " +
+                    std::to_string(FoobarTraceVersion);
+            return false;
+        }
+        format_ = TraceFormat::Foobar;
+        chunked_ = Word(1) == FoobarTraceVersion;
+        if (chunked_ && !ReadIndex())
+            RebuildIndex();
+    }
+    return true;
+}
+
+// The last four words are the offset of the index, the number of chunks
+// and the magic word, which also starts the index.
+bool TraceReader::ReadIndex() {
+    size_t size = file_.size();
+    if (size < 8 + 16 || Word(size / 4 - 1) != FoobarIndexMagic || size % 4)
+        return false;
+
+    uint64_t offset;
+    std::memcpy(&offset, file_.data() + size - 16, 8);
+    size_t chunks = Word(size / 4 - 2);
+    if (offset % 4 || offset + 8 + chunks * sizeof(TraceIndexEntry) + 16 != size ||
+        Word(offset / 4) != FoobarIndexMagic || Word(offset / 4 + 1) != chunks)
+        return false;
+
+    index_.resize(chunks);
+    std::memcpy(index_.data(), file_.data() + offset + 8, chunks * sizeof(TraceIndexEntry));
+    return true;
+}
+
+// Walks the chunk headers, up to the first one that is cut off.
+void TraceReader::RebuildIndex() {
+    index_.clear();
+    uint64_t events = 0;
+    for (size_t offset = 8; offset + sizeof(TraceChunkHeader) <= file_.size();) {
+        TraceChunkHeader header = HeaderAt(offset);
+        size_t end = offset + sizeof(TraceChunkHeader) + (size_t)header.words * 4;
+        if (header.magic != FoobarChunkMagic || end > file_.size())
+            break;
+        index_.push_back({offset, events, header.first_time});
+        events += header.events;
+        offset = end;
+    }
+}
+
+TraceChunkHeader TraceReader::HeaderAt(size_t offset) const {
+    TraceChunkHeader header;
+    std::memcpy(&header, file_.data() + offset, sizeof(header));
+    return header;
+}
+
+TraceChunkHeader TraceReader::Header(size_t chunk) const {
+    return HeaderAt(index_[chunk].offset);
+}
+
+TraceChunk TraceReader::Chunk(size_t chunk) const {
+    const TraceIndexEntry &entry = index_[chunk];
+    return {entry.offset, entry.offset + sizeof(TraceChunkHeader) + (size_t)Word(entry.offset / 4 + 1) * 4,
+            entry.first_event};
+}
+
+size_t TraceReader::FindEvent(uint64_t event) const {
+    auto after = std::upper_bound(index_.begin(), index_.end(), event,
+                                  [](uint64_t event, const TraceIndexEntry &entry) { return event < entry.first_event; });
+    if (after == index_.begin())
+        return index_.size();
+    size_t chunk = after - index_.begin() - 1;
+    return event < index_[chunk].first_event + Word(index_[chunk].offset / 4 + 2) ? chunk : index_.size();
+}
+
+// A chunk may hold events up to the start of the next one
+size_t TraceReader::FindTimeFrom(uint64_t time) const {
+    auto at = std::lower_bound(index_.begin(), index_.end(), time,
+                               [](const TraceIndexEntry &entry, uint64_t time) { return entry.first_time < time; });
+    return at == index_.begin() ? 0 : at - index_.begin() - 1;
+}
+
+size_t TraceReader::FindTimeTo(uint64_t time) const {
+    auto after = std::upper_bound(index_.begin(), index_.end(), time,
+                                  [](uint64_t time, const TraceIndexEntry &entry) { return time < entry.first_time; });
+    return after - index_.begin();
+}
+
+std::string TraceReader::DefaultMetadataPath() const {
+    if (format_ == TraceFormat::Foobar)
+        return path_ + ".info";
+    size_t slash = path_.rfind('/');
+    return (slash == std::string::npos ? std::string() : path_.substr(0, slash + 1)) + "branch_info.txt";
+}
+
+std::vector<TraceChunk> TraceReader::Split(size_t chunk_bytes) const {
+    std::vector<TraceChunk> chunks;
+    size_t size = file_.size(), begin = 0;
+
+    // Chunked traces are split at chunk boundaries
+    if (chunked_) {
+        for (size_t chunk = 0; chunk < index_.size(); chunk++) {
+            TraceChunk next = Chunk(chunk);
+            if (!chunks.empty() && next.begin - chunks.back().begin < chunk_bytes)
+                chunks.back().end = next.end;
+            else
+                chunks.push_back(next);
+        }
+        return chunks;
+    }
+
+    if (format_ == TraceFormat::Foobar) {
+        size &= ~(size_t)3;
+        begin = 8;
+        chunk_bytes = (chunk_bytes + 3) & ~(size_t)3;
+    }
+    if (chunk_bytes == 0)
+        chunk_bytes = 4;
+
+    while (begin < size) {
+        size_t end = size - begin > chunk_bytes ? begin + chunk_bytes : size;
+        // Text chunks end after a newline, so every chunk starts a line
+        if (format_ == TraceFormat::Text && end < size) {
+            const void *eol = std::memchr(file_.data() + end, '\n', size - end);
+            end = eol ? static_cast<const char *>(eol) - file_.data() + 1 : size;
+        }
+        chunks.push_back({begin, end});
+        begin = end;
+    }
+    return chunks;
+}
+
+void EdgeCounts::Merge(const EdgeCounts &other) {
+    if (other.branches.size() > branches.size())
+        branches.resize(other.branches.size());
+    for (size_t id = 0; id < other.branches.size(); id++)
+        branches[id] += other.branches[id];
+    for (auto &call : other.calls)
+        calls[call.first] += call.second;
+    events += other.events;
+}
+
+EdgeCounts CountTrace(const TraceReader &reader, const std::vector<TraceChunk> &chunks, unsigned int threads) {
+    std::vector<EdgeCounts> counts(threads ? threads : 1);
+    ParallelFor(chunks.size(), threads, [&](size_t index, unsigned int worker) {
+        EdgeCounts &local = counts[worker];
+        reader.Decode(chunks[index], [&](const TraceEvent &event) { local.Add(event); });
+    });
+    for (size_t t = 1; t < counts.size(); t++)
+        counts[0].Merge(counts[t]);
+    return std::move(counts[0]);
+}
+
+bool IsProfile(const std::string &path) {
+    std::ifstream file(path);
+    std::string line;
+    std::vector<std::string> fields;
+    int id;
+    while (std::getline(file, line)) {
+        if (ParseProfileLine(line, "br", id, fields) || ParseProfileLine(line, "cs", id, fields))
+            return fields.size() == 4;
+        // Trace lines have no colon
+        if (line.compare(0, 3, "br_") == 0 || line.compare(0, 9, "*funcptr_") == 0)
+            return false;
+    }
+    return false;
+}
+
+bool ReadProfile(const std::string &path, Profile &profile) {
+    std::ifstream file(path);
+    if (!file)
+        return false;
+
+    std::string line;
+    std::vector<std::string> fields;
+    int id;
+    while (std::getline(file, line)) {
+        if (ParseProfileLine(line, "br", id, fields) && fields.size() == 4) {
+            ProfileEdge edge{(uint32_t)id, fields[0], 0, 0, 0};
+            if (ParseProfileNumber(fields[1], edge.src_lno) && ParseProfileNumber(fields[2], edge.dest_lno) &&
+                ParseProfileNumber(fields[3], edge.count))
+                profile.edges.push_back(edge);
+        } else if (ParseProfileLine(line, "cs", id, fields) && fields.size() == 4) {
+            ProfileTarget target{(uint32_t)id, fields[0], 0, fields[2], 0};
+            if (ParseProfileNumber(fields[1], target.lno) && ParseProfileNumber(fields[3], target.count))
+                profile.targets.push_back(target);
+        }
+    }
+    return true;
+}
+
+void WriteProfile(FILE *out, const Profile &profile) {
+    for (auto &edge : profile.edges)
+        std::fprintf(out, "br_%u: %s, %u, %u, %llu\n", edge.id, edge.filepath.c_str(), edge.src_lno, edge.dest_lno,
+                     (unsigned long long)edge.count);
+    for (auto &target : profile.targets)
+        std::fprintf(out, "cs_%u: %s, %u, %s, %llu\n", target.site, target.filepath.c_str(), target.lno,
+                     target.target.c_str(), (unsigned long long)target.count);
+}
+
+Profile MakeProfile(const EdgeCounts &counts, const TraceMetadata &metadata) {
+    Profile profile;
+    size_t branches = std::max(counts.branches.size(), metadata.branches.size());
+    for (size_t id = 0; id < branches; id++) {
+        uint64_t count = id < counts.branches.size() ? counts.branches[id] : 0;
+        bool known = id < metadata.branches.size() && !metadata.branches[id].filepath.empty();
+        if (known)
+            profile.edges.push_back({(uint32_t)id, metadata.branches[id].filepath, metadata.branches[id].src_lno,
+                                     metadata.branches[id].dest_lno, count});
+        else if (count)
+            profile.edges.push_back({(uint32_t)id, "???", 0, 0, count});
+    }
+
+    std::map<uint64_t, uint64_t> calls(counts.calls.begin(), counts.calls.end());
+    for (auto &call : calls) {
+        uint32_t site = call.first >> 32, target = (uint32_t)call.first;
+        ProfileTarget entry{site, "???", 0, "???", call.second};
+        if (site < metadata.callsites.size() && !metadata.callsites[site].filepath.empty()) {
+            entry.filepath = metadata.callsites[site].filepath;
+            entry.lno = metadata.callsites[site].lno;
+        }
+        if (target < metadata.functions.size() && !metadata.functions[target].name.empty())
+            entry.target = metadata.functions[target].name;
+        profile.targets.push_back(entry);
+    }
+    return profile;
+}
+
+unsigned int DefaultThreads() {
+    unsigned int threads = std::thread::hardware_concurrency();
+    return threads ? threads : 1;
+}
+
+void ParallelFor(size_t count, unsigned int threads, const std::function<void(size_t, unsigned int)> &work) {
+    if (threads > count)
+        threads = count;
+    if (threads <= 1) {
+        for (size_t i = 0; i < count; i++)
+            work(i, 0);
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            for (size_t i = next++; i < count; i = next++)
+                work(i, t);
+        });
+    }
+    for (auto &worker : workers)
+        worker.join();
+}
@@ -0,0 +1,315 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Shared by the offline trace tools: memory mapped input, the branch
+ * metadata of branch_info.txt and foobar's <trace>.info, and decoding of
+ * the traces liblogger prints (text) and foobar --branch-trace writes
+ * (binary), split into chunks that decode independently.
+ */
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ProfileLine.h"
+
+// Magic words of a foobar --branch-trace file, see fb_main.c. Version 2
+// traces have no chunks, version 3 is written in chunks with an index.
+constexpr uint32_t FoobarTraceMagic = 0x52544246;
+constexpr uint32_t FoobarTraceVersion = 3;
+constexpr uint32_t FoobarChunkMagic = 0x4b434246;
+constexpr uint32_t FoobarIndexMagic = 0x58494246;
+constexpr uint32_t FoobarSummaryBits = 2048;
+
+// The header in front of every chunk of a version 3 trace.
+struct TraceChunkHeader {
+    uint32_t magic;
+    uint32_t words;
+    uint32_t events;
+    uint32_t reserved;
+    uint64_t first_event;
+    uint64_t first_time;
+    uint64_t last_time;
+    uint32_t summary[FoobarSummaryBits / 32];
+
+    // False if br_N or cs_N with this id is certainly not in the chunk.
+    bool MayContain(uint32_t id) const {
+        return summary[id % FoobarSummaryBits / 32] >> (id % 32) & 1;
+    }
+};
+static_assert(sizeof(TraceChunkHeader) == 296, "TraceChunkHeader must match FB_CHUNK_WORDS");
+
+// An entry of the index at the end of a version 3 trace.
+struct TraceIndexEntry {
+    uint64_t offset;
+    uint64_t first_event;
+    uint64_t first_time;
+};
+
+// A read-only mapping of a whole file.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile();
+
+    // False with errno set if the file cannot be mapped.
+    bool Open(const std::string &path);
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    void *map_ = nullptr;
+    const char *data_ = "";
+    size_t size_ = 0;
+};
+
+struct BranchInfo {
+    std::string filepath;
+    unsigned int src_lno = 0;
+    unsigned int dest_lno = 0;
+};
+
+struct CallSiteInfo {
+    std::string filepath;
+    unsigned int lno = 0;
+};
+
+struct FunctionInfo {
+    std::string name;
+    std::string filepath;
+    unsigned int lno = 0;
+};
+
+// The br_N, cs_N and fn_N lines of a metadata file, indexed by id. Ids
+// without a line have an entry with an empty file path.
+struct TraceMetadata {
+    std::vector<BranchInfo> branches;
+    std::vector<CallSiteInfo> callsites;
+    std::vector<FunctionInfo> functions;
+};
+
+bool ReadTraceMetadata(const std::string &path, TraceMetadata &metadata);
+
+enum class EventKind : uint8_t { Branch, Pointer };
+
+// br_<id>, or a call from cs_<site> through a pointer to fn_<id>. Text
+// traces do not record the site, it is 0 there. Targets that are not
+// registered functions are fn_0.
+struct TraceEvent {
+    EventKind kind;
+    uint32_t id;
+    uint32_t site;
+};
+
+enum class TraceFormat { Text, Foobar };
+
+// A byte range of the trace that decodes on its own. first_event is the
+// number of events before it, only known in chunked traces.
+struct TraceChunk {
+    size_t begin;
+    size_t end;
+    uint64_t first_event = 0;
+};
+
+class TraceReader {
+public:
+    bool Open(const std::string &path, std::string &error);
+    TraceFormat format() const { return format_; }
+    size_t size() const { return file_.size(); }
+
+    // <trace>.info for foobar traces, branch_info.txt next to text traces.
+    std::string DefaultMetadataPath() const;
+
+    // Chunks of about chunk_bytes, in trace order.
+    std::vector<TraceChunk> Split(size_t chunk_bytes) const;
+
+    // The chunks of a version 3 trace. The index is read from the end of
+    // the file, or, if the program did not finish, rebuilt from the chunk
+    // headers. Empty for other traces.
+    bool chunked() const { return chunked_; }
+    const std::vector<TraceIndexEntry> &index() const { return index_; }
+    TraceChunkHeader Header(size_t chunk) const;
+    TraceChunk Chunk(size_t chunk) const;
+
+    // The chunk that has the event with this number, or index().size().
+    size_t FindEvent(uint64_t event) const;
+    // The first chunk that may have events at or after the millisecond
+    // timer `time`, and the first chunk that starts after it.
+    size_t FindTimeFrom(uint64_t time) const;
+    size_t FindTimeTo(uint64_t time) const;
+
+    // Calls callback(const TraceEvent &) for every event of the chunk.
+    template <typename Callback>
+    void Decode(const TraceChunk &chunk, Callback &&callback) const {
+        if (format_ == TraceFormat::Foobar)
+            DecodeFoobar(chunk, callback);
+        else
+            DecodeText(chunk, callback);
+    }
+
+private:
+    uint32_t Word(size_t index) const {
+        uint32_t word;
+        std::memcpy(&word, file_.data() + index * 4, 4);
+        return word;
+    }
+
+    template <typename Callback>
+    void DecodeFoobar(const TraceChunk &chunk, Callback &callback) const {
+        if (!chunked_) {
+            DecodeWords(chunk.begin / 4, chunk.end / 4, file_.size() / 4, callback);
+            return;
+        }
+        for (size_t offset = chunk.begin; offset < chunk.end;) {
+            size_t words = Word(offset / 4 + 1);
+            size_t begin = offset / 4 + sizeof(TraceChunkHeader) / 4;
+            DecodeWords(begin, begin + words, begin + words, callback);
+            offset += sizeof(TraceChunkHeader) + words * 4;
+        }
+    }
+
+    // Every word carries its kind in the low two bits: 0 br_N, 1 cs_N,
+    // 2 the fn_N target of the cs_N before it.
+    template <typename Callback>
+    void DecodeWords(size_t index, size_t end, size_t words, Callback &callback) const {
+        // A target at the start belongs to the call in the chunk before
+        while (index < end && (Word(index) & 3) == 2)
+            index++;
+        for (; index < end; index++) {
+            uint32_t word = Word(index);
+            if ((word & 3) == 0) {
+                callback(TraceEvent{EventKind::Branch, word >> 2, 0});
+            } else if ((word & 3) == 1) {
+                uint32_t target = 0;
+                if (index + 1 < words && (Word(index + 1) & 3) == 2)
+                    target = Word(++index) >> 2;
+                callback(TraceEvent{EventKind::Pointer, target, word >> 2});
+            }
+        }
+    }
+
+    // Lines "br_N" and "*funcptr_N" or "*funcptr_0x..."; the program's own
+    // output in between is skipped.
+    template <typename Callback>
+    void DecodeText(const TraceChunk &chunk, Callback &callback) const {
+        const char *p = file_.data() + chunk.begin, *end = file_.data() + chunk.end;
+
+        while (p < end) {
+            const char *eol = static_cast<const char *>(std::memchr(p, '\n', end - p));
+            if (!eol)
+                eol = end;
+            if (eol - p > 3 && std::memcmp(p, "br_", 3) == 0) {
+                uint32_t id;
+                if (ParseNumber(p + 3, eol, id))
+                    callback(TraceEvent{EventKind::Branch, id, 0});
+            } else if (eol - p > 9 && std::memcmp(p, "*funcptr_", 9) == 0) {
+                uint32_t id;
+                if (!ParseNumber(p + 9, eol, id))
+                    id = 0;
+                callback(TraceEvent{EventKind::Pointer, id, 0});
+            }
+            p = eol + 1;
+        }
+    }
+
+    static bool ParseNumber(const char *p, const char *end, uint32_t &value) {
+        if (end > p && end[-1] == '\r')
+            end--;
+        if (p == end)
+            return false;
+        value = 0;
+        for (; p < end; p++) {
+            if (*p < '0' || *p > '9')
+                return false;
+            value = value * 10 + (*p - '0');
+        }
+        return true;
+    }
+
+    bool ReadIndex();
+    void RebuildIndex();
+    TraceChunkHeader HeaderAt(size_t offset) const;
+
+    MappedFile file_;
+    TraceFormat format_ = TraceFormat::Text;
+    bool chunked_ = false;
+    std::vector<TraceIndexEntry> index_;
+    std::string path_;
+};
+
+// The executions of every br_N by id, and of every call keyed by
+// cs_<site> << 32 | fn_<target>.
+struct EdgeCounts {
+    std::vector<uint64_t> branches;
+    std::unordered_map<uint64_t, uint64_t> calls;
+    uint64_t events = 0;
+
+    void Add(const TraceEvent &event) {
+        events++;
+        if (event.kind == EventKind::Branch) {
+            if (event.id >= branches.size())
+                branches.resize(event.id + 1);
+            branches[event.id]++;
+        } else {
+            calls[(uint64_t)event.site << 32 | event.id]++;
+        }
+    }
+    void Merge(const EdgeCounts &other);
+};
+
+// Counts the events of the chunks on `threads` threads.
+EdgeCounts CountTrace(const TraceReader &reader, const std::vector<TraceChunk> &chunks, unsigned int threads);
+
+// The profile liblogger writes with BRANCH_PROFILE, which is
+// branch_info.txt with the counts appended:
+//   br_N: file, src, dest, count
+//   cs_N: file, line, target, count
+// The target of a call is a function name, or an address if it has none.
+struct ProfileEdge {
+    uint32_t id;
+    std::string filepath;
+    unsigned int src_lno;
+    unsigned int dest_lno;
+    uint64_t count;
+};
+
+struct ProfileTarget {
+    uint32_t site;
+    std::string filepath;
+    unsigned int lno;
+    std::string target;
+    uint64_t count;
+};
+
+struct Profile {
+    std::vector<ProfileEdge> edges;
+    std::vector<ProfileTarget> targets;
+};
+
+// True if the file has br_N or cs_N lines with counts, not a trace.
+bool IsProfile(const std::string &path);
+bool ReadProfile(const std::string &path, Profile &profile);
+void WriteProfile(FILE *out, const Profile &profile);
+
+// The profile of a trace. Like liblogger, it lists every br_N of the
+// metadata, also the ones that never ran; ids the metadata does not know
+// get "???" as their location.
+Profile MakeProfile(const EdgeCounts &counts, const TraceMetadata &metadata);
+
+// The number of hardware threads, at least 1.
+unsigned int DefaultThreads();
+
+// Runs work(i, worker) once for every i in [0, count) on up to `threads`
+// threads, in increasing order of i. worker is the index of the calling
+// thread, below `threads`, for per-thread state.
+void ParallelFor(size_t count, unsigned int threads, const std::function<void(size_t, unsigned int)> &work);
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ * hot_paths: the sequences of edges that dominate a trace.
+ *
+ *   hot_paths [--length=<k>] [--top=<n>] [--max-cycle=<n>] [--info=<file>]
+ *             [--threads=<n>] <trace>
+ *
+ * Counts every run of k consecutive events (br_N edges and calls through
+ * pointers), and every cycle: the events between two consecutive runs of
+ * the same event, which is one iteration of a loop. A cycle is counted at
+ * its smallest event, so the rotations of a loop body count once. The
+ * trace is decoded in chunks on all cores, and each thread counts into
+ * hash tables sharded by the hash of the sequence; the shards are then
+ * merged in parallel. Sequences are kept as 64-bit hashes, and a second
+ * pass over the trace picks up the events of the top ones.
+ */
+#include "Trace.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <unordered_map>
+
+struct Options {
+    std::string trace;
+    std::string info;
+    size_t length = 4;
+    size_t top = 20;
+    size_t max_cycle = 64;
+    unsigned int threads = DefaultThreads();
+};
+
+static void Usage() {
+    std::fprintf(stderr, "usage: hot_paths [--length=<k>] [--top=<n>] [--max-cycle=<n>] [--info=<file>]\n"
+                         "                 [--threads=<n>] <trace>\n");
+    std::exit(2);
+}
+
+static bool ParseOptions(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 9, "--length=") == 0 && std::atoi(arg.c_str() + 9) > 0) {
+            options.length = std::atoi(arg.c_str() + 9);
+        } else if (arg.compare(0, 6, "--top=") == 0) {
+            options.top = std::strtoul(arg.c_str() + 6, nullptr, 10);
+        } else if (arg.compare(0, 12, "--max-cycle=") == 0) {
+            options.max_cycle = std::strtoul(arg.c_str() + 12, nullptr, 10);
+        } else if (arg.compare(0, 7, "--info=") == 0) {
+            options.info = arg.substr(7);
+        } else if (arg.compare(0, 10, "--threads=") == 0 && std::atoi(arg.c_str() + 10) > 0) {
+            options.threads = std::atoi(arg.c_str() + 10);
+        } else if (arg[0] != '-' && options.trace.empty()) {
+            options.trace = arg;
+        } else {
+            return false;
+        }
+    }
+    return !options.trace.empty();
+}
+
+// An event as a number: br_N is N, a call has the top bit set and its
+// site and target below.
+constexpr uint64_t CallBit = 1ull << 63;
+
+static uint64_t EventKey(const TraceEvent &event) {
+    if (event.kind == EventKind::Branch)
+        return event.id;
+    return CallBit | (uint64_t)event.site << 32 | event.id;
+}
+
+// A polynomial hash over mixed events, so the hash of any window follows
+// from two prefix hashes: H(i, j] = H[j] - H[i] * P^(j - i).
+constexpr uint64_t HashBase = 0x100000001b3ull;
+
+static uint64_t Mix(uint64_t key) {
+    key += 0x9e3779b97f4a7c15ull;
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ull;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebull;
+    return key ^ (key >> 31);
+}
+
+static uint64_t HashEvents(const uint64_t *events, size_t count) {
+    uint64_t hash = 0;
+    for (size_t i = 0; i < count; i++)
+        hash = hash * HashBase + Mix(events[i]);
+    return hash;
+}
+
+// Counts by hash, split into shards by the top bits of the hash, so that
+// the shards of all threads can be merged in parallel.
+constexpr size_t ShardBits = 6;
+constexpr size_t Shards = 1 << ShardBits;
+
+struct ShardedCounts {
+    std::vector<std::unordered_map<uint64_t, uint64_t>> shards{Shards};
+
+    void Add(uint64_t hash) { shards[hash >> (64 - ShardBits)][hash]++; }
+};
+
+// The first and last events of a chunk, enough of them to count the
+// windows and cycles that span chunks when the chunks are joined.
+struct ChunkEnds {
+    std::vector<uint64_t> head;
+    std::vector<uint64_t> tail;
+    size_t events = 0;
+};
+
+class Miner {
+public:
+    Miner(const TraceReader &reader, const Options &options) : reader_(reader), options_(options) {
+        powers_.push_back(1);
+        for (size_t i = 1; i <= std::max(options.length, options.max_cycle); i++)
+            powers_.push_back(powers_.back() * HashBase);
+    }
+
+    // Calls window(hash, events) for every run of `length` events that
+    // lies in the chunk, and cycle(hash, events, count) for every cycle.
+    template <typename Window, typename Cycle>
+    void Scan(const TraceChunk &chunk, ChunkEnds &ends, Window &&window, Cycle &&cycle) const {
+        std::vector<uint64_t> events;
+        reader_.Decode(chunk, [&](const TraceEvent &event) { events.push_back(EventKey(event)); });
+
+        size_t length = options_.length;
+        std::vector<uint64_t> prefix(events.size() + 1, 0);
+        std::unordered_map<uint64_t, size_t> last_seen;
+        for (size_t i = 0; i < events.size(); i++) {
+            prefix[i + 1] = prefix[i] * HashBase + Mix(events[i]);
+            if (i + 1 >= length)
+                window(prefix[i + 1] - prefix[i + 1 - length] * powers_[length], &events[i + 1 - length]);
+            if (!options_.max_cycle)
+                continue;
+
+            // The cycle (previous, i] is counted if events[i] is its smallest event
+            auto seen = last_seen.insert({events[i], i});
+            if (seen.second)
+                continue;
+            size_t previous = seen.first->second, count = i - previous;
+            seen.first->second = i;
+            if (count > options_.max_cycle)
+                continue;
+            bool smallest = true;
+            for (size_t j = previous + 1; j < i && smallest; j++)
+                smallest = events[j] > events[i];
+            if (smallest)
+                cycle(prefix[i + 1] - prefix[previous + 1] * powers_[count], &events[previous + 1], count);
+        }
+
+        size_t ends_length = std::min(EndsLength(), events.size());
+        ends.head.assign(events.begin(), events.begin() + ends_length);
+        ends.tail.assign(events.end() - ends_length, events.end());
+        ends.events = events.size();
+    }
+
+    // Calls window and cycle for every window and cycle that spans chunks.
+    // The carry holds the last events before each chunk, which may come
+    // from several chunks if they are short.
+    template <typename Window, typename Cycle>
+    void Stitch(const std::vector<ChunkEnds> &ends, Window &&window, Cycle &&cycle) const {
+        size_t length = options_.length, keep = EndsLength();
+        std::vector<uint64_t> carry, joined;
+        std::unordered_map<uint64_t, size_t> last_seen;
+        for (auto &chunk : ends) {
+            joined = carry;
+            joined.insert(joined.end(), chunk.head.begin(), chunk.head.end());
+            size_t start = carry.size() > length - 1 ? carry.size() - (length - 1) : 0;
+            for (; start < carry.size() && start + length <= joined.size(); start++)
+                window(HashEvents(&joined[start], length), &joined[start]);
+
+            // A cycle spans chunks if it ends at the first occurrence of its
+            // event in the chunk and starts in the carry
+            last_seen.clear();
+            for (size_t i = 0; i < joined.size() && options_.max_cycle; i++) {
+                auto seen = last_seen.insert({joined[i], i});
+                size_t previous = seen.first->second, count = i - previous;
+                seen.first->second = i;
+                if (i < carry.size() || seen.second || previous >= carry.size() || count > options_.max_cycle)
+                    continue;
+                bool smallest = true;
+                for (size_t j = previous + 1; j < i && smallest; j++)
+                    smallest = joined[j] > joined[i];
+                if (smallest)
+                    cycle(HashEvents(&joined[previous + 1], count), &joined[previous + 1], count);
+            }
+
+            if (chunk.events >= keep) {
+                carry = chunk.tail;
+            } else {
+                size_t kept = std::min(joined.size(), keep);
+                carry.assign(joined.end() - kept, joined.end());
+            }
+        }
+    }
+
+private:
+    // Events kept at each end of a chunk
+    size_t EndsLength() const { return std::max(options_.length - 1, options_.max_cycle); }
+
+    const TraceReader &reader_;
+    const Options &options_;
+    std::vector<uint64_t> powers_;
+};
+
+// The hashes of the `top` largest counts, largest first.
+static std::vector<std::pair<uint64_t, uint64_t>> TopCounts(std::vector<ShardedCounts> &counts, size_t top,
+                                                            unsigned int threads) {
+    std::vector<std::vector<std::pair<uint64_t, uint64_t>>> best(Shards);
+    auto larger = [](const std::pair<uint64_t, uint64_t> &x, const std::pair<uint64_t, uint64_t> &y) {
+        return x.second > y.second || (x.second == y.second && x.first < y.first);
+    };
+
+    ParallelFor(Shards, threads, [&](size_t shard, unsigned int) {
+        auto &total = counts[0].shards[shard];
+        for (size_t t = 1; t < counts.size(); t++) {
+            for (auto &entry : counts[t].shards[shard])
+                total[entry.first] += entry.second;
+            counts[t].shards[shard].clear();
+        }
+        best[shard].assign(total.begin(), total.end());
+        size_t keep = std::min(top, best[shard].size());
+        std::partial_sort(best[shard].begin(), best[shard].begin() + keep, best[shard].end(), larger);
+        best[shard].resize(keep);
+    });
+
+    std::vector<std::pair<uint64_t, uint64_t>> all;
+    for (auto &shard : best)
+        all.insert(all.end(), shard.begin(), shard.end());
+    std::sort(all.begin(), all.end(), larger);
+    if (all.size() > top)
+        all.resize(top);
+    return all;
+}
+
+static std::string Describe(const TraceMetadata &metadata, uint64_t key) {
+    char text[64];
+    if (!(key & CallBit)) {
+        uint32_t id = key;
+        std::snprintf(text, sizeof(text), "br_%u", id);
+        if (id >= metadata.branches.size() || metadata.branches[id].filepath.empty())
+            return std::string(text) + "  ???";
+        const BranchInfo &branch = metadata.branches[id];
+        return std::string(text) + "  " + branch.filepath + ":" + std::to_string(branch.src_lno) + " -> " +
+               std::to_string(branch.dest_lno);
+    }
+
+    uint32_t site = (key & ~CallBit) >> 32, target = (uint32_t)key;
+    std::string name = target < metadata.functions.size() && !metadata.functions[target].name.empty()
+                           ? metadata.functions[target].name
+                           : "???";
+    if (site == 0)
+        return "*funcptr_" + std::to_string(target) + "  -> *" + name;
+    std::snprintf(text, sizeof(text), "cs_%u", site);
+    if (site >= metadata.callsites.size() || metadata.callsites[site].filepath.empty())
+        return std::string(text) + "  ??? -> *" + name;
+    return std::string(text) + "  " + metadata.callsites[site].filepath + ":" +
+           std::to_string(metadata.callsites[site].lno) + " -> *" + name;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+        Usage();
+
+    TraceReader reader;
+    std::string error;
+    if (!reader.Open(options.trace, error)) {
+        std::fprintf(stderr, "hot_paths: %s\n", error.c_str());
+        return 1;
+    }
+    TraceMetadata metadata;
+    std::string info = options.info.empty() ? reader.DefaultMetadataPath() : options.info;
+    if (!ReadTraceMetadata(info, metadata)) {
+        std::fprintf(stderr, "hot_paths: cannot read %s, pass --info=<file>\n", info.c_str());
+        return 1;
+    }
+
+    Miner miner(reader, options);
+    std::vector<TraceChunk> chunks = reader.Split(1 << 20);
+    std::vector<ChunkEnds> ends(chunks.size());
+
+    // First pass: count every window and cycle by hash
+    std::vector<ShardedCounts> windows(options.threads), cycles(options.threads);
+    ParallelFor(chunks.size(), options.threads, [&](size_t index, unsigned int worker) {
+        miner.Scan(
+            chunks[index], ends[index], [&](uint64_t hash, const uint64_t *) { windows[worker].Add(hash); },
+            [&](uint64_t hash, const uint64_t *, size_t) { cycles[worker].Add(hash); });
+    });
+    miner.Stitch(
+        ends, [&](uint64_t hash, const uint64_t *) { windows[0].Add(hash); },
+        [&](uint64_t hash, const uint64_t *, size_t) { cycles[0].Add(hash); });
+
+    uint64_t events = 0;
+    for (auto &chunk : ends)
+        events += chunk.events;
+    auto top_windows = TopCounts(windows, options.top, options.threads);
+    auto top_cycles = TopCounts(cycles, options.top, options.threads);
+    windows.clear();
+    cycles.clear();
+
+    // Second pass: the events of the top sequences
+    std::unordered_map<uint64_t, std::vector<uint64_t>> window_events, cycle_events;
+    for (auto &entry : top_windows)
+        window_events[entry.first];
+    for (auto &entry : top_cycles)
+        cycle_events[entry.first];
+    std::mutex mutex;
+    auto keep = [&](std::unordered_map<uint64_t, std::vector<uint64_t>> &found, uint64_t hash, const uint64_t *first,
+                    size_t count) {
+        auto it = found.find(hash);
+        if (it == found.end())
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (it->second.empty())
+            it->second.assign(first, first + count);
+    };
+    ParallelFor(chunks.size(), options.threads, [&](size_t index, unsigned int) {
+        ChunkEnds unused;
+        miner.Scan(
+            chunks[index], unused,
+            [&](uint64_t hash, const uint64_t *first) { keep(window_events, hash, first, options.length); },
+            [&](uint64_t hash, const uint64_t *first, size_t count) { keep(cycle_events, hash, first, count); });
+    });
+    miner.Stitch(
+        ends, [&](uint64_t hash, const uint64_t *first) { keep(window_events, hash, first, options.length); },
+        [&](uint64_t hash, const uint64_t *first, size_t count) { keep(cycle_events, hash, first, count); });
+
+    uint64_t total_windows = events >= options.length ? events - options.length + 1 : 0;
+    std::printf("%" PRIu64 " events\n\n", events);
+    std::printf("hottest paths of %zu events, by share of all %zu-event windows:\n", options.length, options.length);
+    for (auto &entry : top_windows) {
+        std::printf("%14" PRIu64 " %6.2f%%\n", entry.second, total_windows ? 100.0 * entry.second / total_windows : 0);
+        for (uint64_t key : window_events[entry.first])
+            std::printf("%24s%s\n", "", Describe(metadata, key).c_str());
+    }
+
+    if (options.max_cycle) {
+        std::printf("\nhottest cycles of up to %zu events, by share of all events:\n", options.max_cycle);
+        for (auto &entry : top_cycles) {
+            const std::vector<uint64_t> &cycle = cycle_events[entry.first];
+            std::printf("%14" PRIu64 " %6.2f%%  %zu events\n", entry.second,
+                        events ? 100.0 * entry.second * cycle.size() / events : 0, cycle.size());
+            for (uint64_t key : cycle)
+                std::printf("%24s%s\n", "", Describe(metadata, key).c_str());
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * profile_merge: merges the profiles of many runs into one.
+ *
+ *   profile_merge [--weighted-input=<weight>,<file>] [--max-count=<n>]
+ *                 [--threads=<n>] [-o <file>] <file>...
+ *
+ * The inputs are profiles in the format liblogger writes with
+ * BRANCH_PROFILE or BRANCH_COVERAGE, or traces, which are counted first.
+ * They are read in parallel, each count is multiplied by the weight of
+ * its input, and the tables are merged pairwise in a tree across threads.
+ * Counts saturate at --max-count, so a merged coverage profile stays 0/1
+ * with --max-count=1. The output has the same format, so it feeds
+ * -skeleton-profile-use and -skeleton-prune-profile like a single run.
+ */
+#include "Trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <tuple>
+#include <unordered_map>
+
+struct Input {
+    std::string path;
+    uint64_t weight = 1;
+};
+
+struct Options {
+    std::vector<Input> inputs;
+    std::string output;
+    uint64_t max_count = std::numeric_limits<uint64_t>::max();
+    unsigned int threads = DefaultThreads();
+};
+
+static void Usage() {
+    std::fprintf(stderr, "usage: profile_merge [--weighted-input=<weight>,<file>] [--max-count=<n>]\n"
+                         "                     [--threads=<n>] [-o <file>] <file>...\n");
+    std::exit(2);
+}
+
+static bool ParseOptions(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 17, "--weighted-input=") == 0) {
+            size_t comma = arg.find(',');
+            char *end;
+            uint64_t weight = std::strtoull(arg.c_str() + 17, &end, 10);
+            if (comma == std::string::npos || end != arg.c_str() + comma || comma + 1 == arg.size())
+                return false;
+            options.inputs.push_back({arg.substr(comma + 1), weight});
+        } else if (arg.compare(0, 12, "--max-count=") == 0 && std::strtoull(arg.c_str() + 12, nullptr, 10) > 0) {
+            options.max_count = std::strtoull(arg.c_str() + 12, nullptr, 10);
+        } else if (arg.compare(0, 10, "--threads=") == 0 && std::atoi(arg.c_str() + 10) > 0) {
+            options.threads = std::atoi(arg.c_str() + 10);
+        } else if (arg == "-o" && i + 1 < argc) {
+            options.output = argv[++i];
+        } else if (arg[0] != '-') {
+            options.inputs.push_back({arg, 1});
+        } else {
+            return false;
+        }
+    }
+    return !options.inputs.empty();
+}
+
+static uint64_t SaturatingAdd(uint64_t a, uint64_t b, uint64_t max) {
+    return a >= max || b >= max - a ? max : a + b;
+}
+
+static uint64_t SaturatingScale(uint64_t count, uint64_t weight, uint64_t max) {
+    return weight && count > max / weight ? max : std::min(count * weight, max);
+}
+
+// The counts of one or more profiles. Entries are keyed by their whole
+// line, so an id only merges with the same id at the same location.
+class MergedProfile {
+public:
+    void Add(const Profile &profile, uint64_t weight, uint64_t max) {
+        for (auto &edge : profile.edges) {
+            std::string key = "br_" + std::to_string(edge.id) + ": " + edge.filepath + ", " +
+                              std::to_string(edge.src_lno) + ", " + std::to_string(edge.dest_lno);
+            AddEdge(key, edge, SaturatingScale(edge.count, weight, max), max);
+        }
+        for (auto &target : profile.targets) {
+            std::string key = "cs_" + std::to_string(target.site) + ": " + target.filepath + ", " +
+                              std::to_string(target.lno) + ", " + target.target;
+            AddTarget(key, target, SaturatingScale(target.count, weight, max), max);
+        }
+    }
+
+    void Merge(const MergedProfile &other, uint64_t max) {
+        for (auto &entry : other.edge_index_)
+            AddEdge(entry.first, other.profile_.edges[entry.second], other.profile_.edges[entry.second].count, max);
+        for (auto &entry : other.target_index_)
+            AddTarget(entry.first, other.profile_.targets[entry.second], other.profile_.targets[entry.second].count,
+                      max);
+    }
+
+    // In id order within each file. Every module numbers its ids from 1, so
+    // the same id in two files is two different edges.
+    Profile Sorted() const {
+        Profile sorted = profile_;
+        std::sort(sorted.edges.begin(), sorted.edges.end(), [](const ProfileEdge &x, const ProfileEdge &y) {
+            return std::tie(x.filepath, x.id, x.src_lno, x.dest_lno) < std::tie(y.filepath, y.id, y.src_lno, y.dest_lno);
+        });
+        std::sort(sorted.targets.begin(), sorted.targets.end(), [](const ProfileTarget &x, const ProfileTarget &y) {
+            return std::tie(x.filepath, x.site, x.lno, y.count, x.target) <
+                   std::tie(y.filepath, y.site, y.lno, x.count, y.target);
+        });
+        return sorted;
+    }
+
+private:
+    void AddEdge(const std::string &key, const ProfileEdge &edge, uint64_t count, uint64_t max) {
+        auto inserted = edge_index_.insert({key, profile_.edges.size()});
+        if (inserted.second) {
+            profile_.edges.push_back(edge);
+            profile_.edges.back().count = count;
+        } else {
+            uint64_t &total = profile_.edges[inserted.first->second].count;
+            total = SaturatingAdd(total, count, max);
+        }
+    }
+
+    void AddTarget(const std::string &key, const ProfileTarget &target, uint64_t count, uint64_t max) {
+        auto inserted = target_index_.insert({key, profile_.targets.size()});
+        if (inserted.second) {
+            profile_.targets.push_back(target);
+            profile_.targets.back().count = count;
+        } else {
+            uint64_t &total = profile_.targets[inserted.first->second].count;
+            total = SaturatingAdd(total, count, max);
+        }
+    }
+
+    Profile profile_;
+    std::unordered_map<std::string, size_t> edge_index_;
+    std::unordered_map<std::string, size_t> target_index_;
+};
+
+static bool ReadInput(const Input &input, Profile &profile, std::string &error) {
+    if (IsProfile(input.path)) {
+        if (!ReadProfile(input.path, profile))
+            error = "cannot read " + input.path;
+        return error.empty();
+    }
+
+    // Traces are counted on one thread, the inputs already run in parallel
+    TraceReader reader;
+    TraceMetadata metadata;
+    if (!reader.Open(input.path, error))
+        return false;
+    if (!ReadTraceMetadata(reader.DefaultMetadataPath(), metadata)) {
+        error = "cannot read " + reader.DefaultMetadataPath();
+        return false;
+    }
+    profile = MakeProfile(CountTrace(reader, reader.Split(4 << 20), 1), metadata);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+        Usage();
+
+    size_t count = options.inputs.size();
+    std::vector<MergedProfile> merged(count);
+    std::vector<std::string> errors(count);
+    ParallelFor(count, options.threads, [&](size_t index, unsigned int) {
+        Profile profile;
+        if (ReadInput(options.inputs[index], profile, errors[index]))
+            merged[index].Add(profile, options.inputs[index].weight, options.max_count);
+    });
+    for (auto &error : errors) {
+        if (!error.empty()) {
+            std::fprintf(stderr, "profile_merge: %s\n", error.c_str());
+            return 1;
+        }
+    }
+
+    // Tree reduction: each level merges pairs of tables in parallel
+    for (size_t step = 1; step < count; step *= 2) {
+        size_t pairs = (count - step + 2 * step - 1) / (2 * step);
+        ParallelFor(pairs, options.threads, [&](size_t pair, unsigned int) {
+            size_t index = pair * 2 * step;
+            merged[index].Merge(merged[index + step], options.max_count);
+            merged[index + step] = MergedProfile();
+        });
+    }
+
+    Profile profile = merged[0].Sorted();
+    size_t conflicts = 0;
+    for (size_t i = 1; i < profile.edges.size(); i++)
+        conflicts += profile.edges[i].id == profile.edges[i - 1].id &&
+                     profile.edges[i].filepath == profile.edges[i - 1].filepath;
+    if (conflicts)
+        std::fprintf(stderr, "profile_merge: %zu br_N ids have different locations, the inputs come from different builds\n",
+                     conflicts);
+
+    FILE *out = stdout;
+    if (!options.output.empty() && !(out = std::fopen(options.output.c_str(), "w"))) {
+        std::fprintf(stderr, "profile_merge: cannot write %s\n", options.output.c_str());
+        return 1;
+    }
+    WriteProfile(out, profile);
+    if (std::fflush(out) != 0 || (out != stdout && std::fclose(out) != 0)) {
+        std::fprintf(stderr, "profile_merge: error writing the output\n");
+        return 1;
+    }
+    return 0;
+}
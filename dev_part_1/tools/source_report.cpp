@@ -0,0 +1,522 @@
+/*
+ * source_report: edge counts next to the source, like gcov.
+ *
+ *   source_report [--format=text|html] [--info=<file>] [--source-dir=<dir>]
+ *                 [--hot=<fraction>] [--threads=<n>] [-o <file>] <input>
+ *
+ * The input is a profile (BRANCH_PROFILE, trace_decode --format=counts,
+ * profile_merge) or a trace, which is counted first. Every line gets the
+ * executions the edges tell about it, every branch the share of each of
+ * its edges, every indirect call its targets. The report starts with the
+ * hottest lines, the hot and the cold regions. Files are read and
+ * formatted in parallel; text is one gcov-style listing per file, html a
+ * single page with no outside references.
+ */
+#include "Trace.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdarg>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+
+enum class ReportFormat { Text, Html };
+
+struct Options {
+    std::string input;
+    std::string info;
+    std::string source_dir;
+    std::string output;
+    ReportFormat format = ReportFormat::Text;
+    double hot = 0.1;
+    unsigned int threads = DefaultThreads();
+};
+
+static void Usage() {
+    std::fprintf(stderr, "usage: source_report [--format=text|html] [--info=<file>] [--source-dir=<dir>]\n"
+                         "                     [--hot=<fraction>] [--threads=<n>] [-o <file>] <input>\n");
+    std::exit(2);
+}
+
+static bool ParseOptions(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--format=text") {
+            options.format = ReportFormat::Text;
+        } else if (arg == "--format=html") {
+            options.format = ReportFormat::Html;
+        } else if (arg.compare(0, 7, "--info=") == 0) {
+            options.info = arg.substr(7);
+        } else if (arg.compare(0, 13, "--source-dir=") == 0) {
+            options.source_dir = arg.substr(13);
+        } else if (arg.compare(0, 6, "--hot=") == 0 && std::atof(arg.c_str() + 6) > 0) {
+            options.hot = std::atof(arg.c_str() + 6);
+        } else if (arg.compare(0, 10, "--threads=") == 0 && std::atoi(arg.c_str() + 10) > 0) {
+            options.threads = std::atoi(arg.c_str() + 10);
+        } else if (arg == "-o" && i + 1 < argc) {
+            options.output = argv[++i];
+        } else if (arg[0] != '-' && options.input.empty()) {
+            options.input = arg;
+        } else {
+            return false;
+        }
+    }
+    return !options.input.empty();
+}
+
+/*--- Counts per line ---------------------------------------------------*/
+
+struct Edge {
+    uint32_t id;
+    unsigned int dest_lno;
+    uint64_t count;
+};
+
+// A conditional branch: the pass numbers the edges of one branch with
+// consecutive ids, foobar gives an exit and its fall through the same.
+struct Branch {
+    unsigned int src_lno;
+    std::vector<Edge> edges;
+
+    uint64_t Executions() const {
+        uint64_t total = 0;
+        for (auto &edge : edges)
+            total += edge.count;
+        return total;
+    }
+};
+
+struct Line {
+    uint64_t count = 0;
+    std::vector<size_t> branches;
+    std::vector<const ProfileTarget *> calls;
+};
+
+struct SourceFile {
+    std::string path;
+    std::vector<Branch> branches;
+    // Only lines that edges tell about; the others have no count
+    std::map<unsigned int, Line> lines;
+    std::vector<std::string> source;
+    bool found = false;
+    std::string report;
+};
+
+// Lines with a branch ran as often as their busiest branch, lines an
+// edge goes to at least as often as the edges into them, call sites as
+// often as their targets were called.
+static std::vector<SourceFile> CollectFiles(const Profile &profile) {
+    std::vector<SourceFile> files;
+    std::unordered_map<std::string, size_t> file_index;
+    auto file = [&](const std::string &path) -> SourceFile & {
+        auto inserted = file_index.insert({path, files.size()});
+        if (inserted.second) {
+            files.emplace_back();
+            files.back().path = path;
+        }
+        return files[inserted.first->second];
+    };
+
+    std::vector<const ProfileEdge *> edges;
+    for (auto &edge : profile.edges) {
+        if (edge.filepath != "???")
+            edges.push_back(&edge);
+    }
+    // Each module numbers its edges from 1, so the two edges of a branch are
+    // next to each other only within their file
+    std::sort(edges.begin(), edges.end(), [](const ProfileEdge *x, const ProfileEdge *y) {
+        return std::tie(x->filepath, x->id) < std::tie(y->filepath, y->id);
+    });
+
+    const ProfileEdge *previous = nullptr;
+    for (const ProfileEdge *edge : edges) {
+        SourceFile &source = file(edge->filepath);
+        bool same_branch = previous && previous->id + 1 == edge->id && previous->filepath == edge->filepath &&
+                           previous->src_lno == edge->src_lno && source.branches.back().edges.size() < 2;
+        if (!same_branch) {
+            source.branches.push_back({edge->src_lno, {}});
+            source.lines[edge->src_lno].branches.push_back(source.branches.size() - 1);
+        }
+        source.branches.back().edges.push_back({edge->id, edge->dest_lno, edge->count});
+        previous = edge;
+    }
+
+    for (auto &source : files) {
+        std::map<unsigned int, uint64_t> incoming;
+        for (auto &branch : source.branches) {
+            Line &line = source.lines[branch.src_lno];
+            line.count = std::max(line.count, branch.Executions());
+            for (auto &edge : branch.edges)
+                incoming[edge.dest_lno] += edge.count;
+        }
+        for (auto &entry : incoming) {
+            Line &line = source.lines[entry.first];
+            line.count = std::max(line.count, entry.second);
+        }
+    }
+
+    std::map<std::pair<std::string, unsigned int>, uint64_t> calls;
+    for (auto &target : profile.targets) {
+        if (target.filepath == "???")
+            continue;
+        file(target.filepath).lines[target.lno].calls.push_back(&target);
+        calls[{target.filepath, target.lno}] += target.count;
+    }
+    for (auto &entry : calls) {
+        Line &line = file(entry.first.first).lines[entry.first.second];
+        line.count = std::max(line.count, entry.second);
+    }
+    return files;
+}
+
+static void ReadSource(SourceFile &file, const std::string &source_dir) {
+    std::vector<std::string> candidates = {file.path};
+    if (!source_dir.empty()) {
+        candidates.push_back(source_dir + "/" + file.path);
+        size_t slash = file.path.rfind('/');
+        candidates.push_back(source_dir + "/" + (slash == std::string::npos ? file.path : file.path.substr(slash + 1)));
+    }
+    for (auto &path : candidates) {
+        std::ifstream in(path);
+        if (!in)
+            continue;
+        std::string line;
+        while (std::getline(in, line))
+            file.source.push_back(line);
+        file.found = true;
+        return;
+    }
+}
+
+/*--- Regions -----------------------------------------------------------*/
+
+// Lines with a count in a row, with only lines without a count between.
+struct Region {
+    const SourceFile *file;
+    unsigned int first;
+    unsigned int last;
+    uint64_t count;
+};
+
+// Runs of lines whose count is at least `threshold`, hot, or is 0, cold.
+static std::vector<Region> FindRegions(const std::vector<SourceFile> &files, bool hot, uint64_t threshold) {
+    std::vector<Region> regions;
+    for (auto &file : files) {
+        bool open = false;
+        for (auto &entry : file.lines) {
+            bool in = hot ? entry.second.count >= threshold : entry.second.count == 0;
+            if (in && open) {
+                regions.back().last = entry.first;
+                regions.back().count = std::max(regions.back().count, entry.second.count);
+            } else if (in) {
+                regions.push_back({&file, entry.first, entry.first, entry.second.count});
+            }
+            open = in;
+        }
+    }
+    if (hot) {
+        std::sort(regions.begin(), regions.end(), [](const Region &x, const Region &y) { return x.count > y.count; });
+    } else {
+        std::sort(regions.begin(), regions.end(),
+                  [](const Region &x, const Region &y) { return x.last - x.first > y.last - y.first; });
+    }
+    return regions;
+}
+
+/*--- Text --------------------------------------------------------------*/
+
+static void Append(std::string &out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void Append(std::string &out, const char *format, ...) {
+    char buffer[512];
+    va_list args;
+    va_start(args, format);
+    int length = std::vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (length >= (int)sizeof(buffer)) {
+        std::vector<char> large(length + 1);
+        va_start(args, format);
+        std::vsnprintf(large.data(), large.size(), format, args);
+        va_end(args);
+        out.append(large.data(), length);
+    } else if (length > 0) {
+        out.append(buffer, length);
+    }
+}
+
+static double Percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * part / whole : 0;
+}
+
+static void AppendLineNotes(std::string &out, const SourceFile &file, const Line &line, bool html) {
+    for (size_t index : line.branches) {
+        const Branch &branch = file.branches[index];
+        uint64_t executions = branch.Executions();
+        for (auto &edge : branch.edges) {
+            if (html)
+                Append(out, "<div class=\"note\">br_%u %.0f%% (%" PRIu64 ") &rarr; line %u</div>", edge.id,
+                       Percent(edge.count, executions), edge.count, edge.dest_lno);
+            else if (executions)
+                Append(out, "branch br_%-6u taken %3.0f%% (%" PRIu64 ") -> line %u\n", edge.id,
+                       Percent(edge.count, executions), edge.count, edge.dest_lno);
+            else
+                Append(out, "branch br_%-6u never executed -> line %u\n", edge.id, edge.dest_lno);
+        }
+    }
+    for (const ProfileTarget *call : line.calls) {
+        if (html)
+            Append(out, "<div class=\"note\">cs_%u &rarr; *", call->site);
+        else
+            Append(out, "call   cs_%-6u -> *", call->site);
+        out += call->target;
+        Append(out, html ? " %.0f%% (%" PRIu64 ")</div>" : " %.0f%% (%" PRIu64 ")\n",
+               Percent(call->count, line.count), call->count);
+    }
+}
+
+static void FormatText(SourceFile &file) {
+    std::string &out = file.report;
+    Append(out, "        -:    0:Source:%s\n", file.path.c_str());
+    if (!file.found)
+        Append(out, "        -:    0:Source is not available, only lines with counts are listed\n");
+
+    auto entry = file.lines.begin();
+    unsigned int last = file.found ? file.source.size() : file.lines.empty() ? 0 : file.lines.rbegin()->first;
+    for (unsigned int lno = 1; lno <= last; lno++) {
+        const Line *line = entry != file.lines.end() && entry->first == lno ? &(entry++)->second : nullptr;
+        if (!file.found && !line)
+            continue;
+        const char *text = file.found ? file.source[lno - 1].c_str() : "";
+        if (!line)
+            Append(out, "        -:%5u:%s\n", lno, text);
+        else if (line->count == 0)
+            Append(out, "    #####:%5u:%s\n", lno, text);
+        else
+            Append(out, "%9" PRIu64 ":%5u:%s\n", line->count, lno, text);
+        if (line)
+            AppendLineNotes(out, file, *line, false);
+    }
+    out += "\n";
+}
+
+/*--- HTML --------------------------------------------------------------*/
+
+static std::string Escape(const std::string &text) {
+    std::string escaped;
+    escaped.reserve(text.size());
+    for (char c : text) {
+        if (c == '<')
+            escaped += "&lt;";
+        else if (c == '>')
+            escaped += "&gt;";
+        else if (c == '&')
+            escaped += "&amp;";
+        else if (c == '"')
+            escaped += "&quot;";
+        else
+            escaped += c;
+    }
+    return escaped;
+}
+
+// Red on a log scale, so that a count 1000 times smaller is still visible.
+static void AppendHeat(std::string &out, uint64_t count, uint64_t max) {
+    if (count == 0) {
+        out += " class=\"cold\"";
+        return;
+    }
+    double heat = max > 1 ? std::log((double)count + 1) / std::log((double)max + 1) : 1;
+    Append(out, " style=\"background:hsl(0,100%%,%.0f%%)\"", 97 - 42 * heat);
+}
+
+static void FormatHtml(SourceFile &file, size_t index, uint64_t max) {
+    std::string &out = file.report;
+    Append(out, "<h2 id=\"f%zu\">", index);
+    out += Escape(file.path) + "</h2>\n";
+    if (!file.found)
+        out += "<p>Source is not available, only lines with counts are listed.</p>\n";
+    out += "<table>\n";
+
+    auto entry = file.lines.begin();
+    unsigned int last = file.found ? file.source.size() : file.lines.empty() ? 0 : file.lines.rbegin()->first;
+    for (unsigned int lno = 1; lno <= last; lno++) {
+        const Line *line = entry != file.lines.end() && entry->first == lno ? &(entry++)->second : nullptr;
+        if (!file.found && !line)
+            continue;
+        Append(out, "<tr id=\"f%zu-%u\"", index, lno);
+        if (line)
+            AppendHeat(out, line->count, max);
+        out += "><td class=\"count\">";
+        if (line)
+            Append(out, "%" PRIu64, line->count);
+        Append(out, "</td><td class=\"lno\">%u</td><td><pre>", lno);
+        if (file.found)
+            out += Escape(file.source[lno - 1]);
+        out += "</pre>";
+        if (line)
+            AppendLineNotes(out, file, *line, true);
+        out += "</td></tr>\n";
+    }
+    out += "</table>\n";
+}
+
+static const char *HtmlStyle = "body { font-family: sans-serif; margin: 1em; }\n"
+                               "table { border-collapse: collapse; font-size: 13px; }\n"
+                               "td { padding: 0 6px; vertical-align: top; }\n"
+                               "td.count { text-align: right; color: #333; }\n"
+                               "td.lno { text-align: right; color: #888; }\n"
+                               "pre { margin: 0; font-family: monospace; }\n"
+                               "tr.cold { background: #dde8ff; }\n"
+                               "div.note { font-family: monospace; font-size: 11px; color: #555; }\n";
+
+/*--- Summary -----------------------------------------------------------*/
+
+static std::string RegionName(const Region &region, bool html, size_t file_index) {
+    std::string name = region.file->path + ":" + std::to_string(region.first);
+    if (region.last != region.first)
+        name += "-" + std::to_string(region.last);
+    if (!html)
+        return name;
+    return "<a href=\"#f" + std::to_string(file_index) + "-" + std::to_string(region.first) + "\">" + Escape(name) +
+           "</a>";
+}
+
+static std::string Summary(const std::vector<SourceFile> &files, uint64_t max, double hot, bool html) {
+    std::string out;
+    std::unordered_map<const SourceFile *, size_t> index;
+    for (size_t i = 0; i < files.size(); i++)
+        index[&files[i]] = i;
+
+    size_t lines = 0, branches = 0, never_taken = 0, never_run = 0;
+    std::vector<std::pair<uint64_t, Region>> hottest;
+    for (auto &file : files) {
+        lines += file.lines.size();
+        for (auto &entry : file.lines)
+            hottest.push_back({entry.second.count, {&file, entry.first, entry.first, entry.second.count}});
+        for (auto &branch : file.branches) {
+            branches++;
+            if (branch.Executions() == 0)
+                never_run++;
+            for (auto &edge : branch.edges)
+                never_taken += branch.Executions() && !edge.count;
+        }
+    }
+    size_t top = std::min<size_t>(10, hottest.size());
+    std::partial_sort(hottest.begin(), hottest.begin() + top, hottest.end(),
+                      [](const std::pair<uint64_t, Region> &x, const std::pair<uint64_t, Region> &y) {
+                          return x.first > y.first;
+                      });
+
+    const char *heading = html ? "<h3>%s</h3>\n<pre>" : "%s\n";
+    const char *end = html ? "</pre>\n" : "\n";
+    Append(out, heading, "Summary");
+    Append(out, "%zu files, %zu lines with counts, %zu branches\n", files.size(), lines, branches);
+    Append(out, "%zu branches never ran, %zu edges of branches that ran were never taken\n", never_run, never_taken);
+    out += end;
+
+    Append(out, heading, "Hottest lines");
+    for (size_t i = 0; i < top; i++)
+        Append(out, "%14" PRIu64 "  %s\n", hottest[i].first,
+               RegionName(hottest[i].second, html, index[hottest[i].second.file]).c_str());
+    out += end;
+
+    uint64_t threshold = std::max<uint64_t>(1, (uint64_t)std::ceil(max * hot));
+    std::vector<Region> hot_regions = FindRegions(files, true, threshold);
+    Append(out, heading, "Hot regions");
+    Append(out, "lines run at least %" PRIu64 " times, %.0f%% of the hottest line\n", threshold, hot * 100);
+    for (size_t i = 0; i < hot_regions.size() && i < 10; i++)
+        Append(out, "%14" PRIu64 "  %s\n", hot_regions[i].count,
+               RegionName(hot_regions[i], html, index[hot_regions[i].file]).c_str());
+    out += end;
+
+    std::vector<Region> cold_regions = FindRegions(files, false, 0);
+    Append(out, heading, "Cold regions");
+    out += "lines with counts that never ran, largest first\n";
+    for (size_t i = 0; i < cold_regions.size() && i < 10; i++)
+        Append(out, "%14u  %s\n", cold_regions[i].last - cold_regions[i].first + 1,
+               RegionName(cold_regions[i], html, index[cold_regions[i].file]).c_str());
+    out += end;
+    return out;
+}
+
+static bool ReadInput(const Options &options, Profile &profile) {
+    if (IsProfile(options.input)) {
+        if (ReadProfile(options.input, profile))
+            return true;
+        std::fprintf(stderr, "source_report: cannot read %s\n", options.input.c_str());
+        return false;
+    }
+
+    TraceReader reader;
+    TraceMetadata metadata;
+    std::string error;
+    if (!reader.Open(options.input, error)) {
+        std::fprintf(stderr, "source_report: %s\n", error.c_str());
+        return false;
+    }
+    std::string info = options.info.empty() ? reader.DefaultMetadataPath() : options.info;
+    if (!ReadTraceMetadata(info, metadata)) {
+        std::fprintf(stderr, "source_report: cannot read %s, pass --info=<file>\n", info.c_str());
+        return false;
+    }
+    profile = MakeProfile(CountTrace(reader, reader.Split(4 << 20), options.threads), metadata);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+        Usage();
+
+    Profile profile;
+    if (!ReadInput(options, profile))
+        return 1;
+
+    std::vector<SourceFile> files = CollectFiles(profile);
+    std::sort(files.begin(), files.end(), [](const SourceFile &x, const SourceFile &y) { return x.path < y.path; });
+    uint64_t max = 0;
+    for (auto &file : files) {
+        for (auto &entry : file.lines)
+            max = std::max(max, entry.second.count);
+    }
+
+    bool html = options.format == ReportFormat::Html;
+    ParallelFor(files.size(), options.threads, [&](size_t index, unsigned int) {
+        ReadSource(files[index], options.source_dir);
+        if (html)
+            FormatHtml(files[index], index, max);
+        else
+            FormatText(files[index]);
+    });
+
+    FILE *out = stdout;
+    if (!options.output.empty() && !(out = std::fopen(options.output.c_str(), "w"))) {
+        std::fprintf(stderr, "source_report: cannot write %s\n", options.output.c_str());
+        return 1;
+    }
+    if (html) {
+        std::fprintf(out, "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>%s</title>\n<style>\n%s</style></head>\n"
+                          "<body>\n<h1>%s</h1>\n",
+                     Escape(options.input).c_str(), HtmlStyle, Escape(options.input).c_str());
+        std::fputs("<ul>\n", out);
+        for (size_t i = 0; i < files.size(); i++)
+            std::fprintf(out, "<li><a href=\"#f%zu\">%s</a></li>\n", i, Escape(files[i].path).c_str());
+        std::fputs("</ul>\n", out);
+    }
+    std::string summary = Summary(files, max, options.hot, html);
+    std::fwrite(summary.data(), 1, summary.size(), out);
+    for (auto &file : files)
+        std::fwrite(file.report.data(), 1, file.report.size(), out);
+    if (html)
+        std::fputs("</body></html>\n", out);
+
+    if (std::fflush(out) != 0 || (out != stdout && std::fclose(out) != 0)) {
+        std::fprintf(stderr, "source_report: error writing the output\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,361 @@
+/*
+ * trace_decode: joins a branch trace with its metadata.
+ *
+ *   trace_decode [--info=<file>] [--format=text|counts|csv] [--threads=<n>]
+ *                [--chunk-size=<KB>] [--stats] [-o <file>]
+ *                [--from-event=<n>] [--max-events=<n>] [--from-ms=<t>]
+ *                [--to-ms=<t>] [--branch=<id>] [--index] <trace>
+ *
+ * The trace is the br_N and *funcptr_N output of a program built with the
+ * pass, or a foobar --branch-trace file. It is mapped and cut into chunks
+ * that are decoded on all cores. text prints every event with its source
+ * location, counts prints the per-edge totals in the format of liblogger's
+ * profile, csv prints one row per event.
+ *
+ * In chunked foobar traces the selection options find their chunks in the
+ * index by binary search, and only those chunks are read.
+ */
+#include "Trace.h"
+
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <mutex>
+
+enum class OutputFormat { Text, Counts, Csv };
+
+struct Options {
+    std::string trace;
+    std::string info;
+    std::string output;
+    OutputFormat format = OutputFormat::Text;
+    unsigned int threads = DefaultThreads();
+    size_t chunk_bytes = 1 << 20;
+    bool stats = false;
+
+    // Selection of a chunked trace
+    uint64_t from_event = 0;
+    uint64_t max_events = std::numeric_limits<uint64_t>::max();
+    uint64_t from_ms = 0;
+    uint64_t to_ms = std::numeric_limits<uint64_t>::max();
+    int64_t branch = -1;
+    bool list_index = false;
+
+    bool Selects() const {
+        return from_event || max_events != std::numeric_limits<uint64_t>::max() || from_ms ||
+               to_ms != std::numeric_limits<uint64_t>::max() || branch >= 0;
+    }
+};
+
+static void Usage() {
+    std::fprintf(stderr,
+                 "usage: trace_decode [--info=<file>] [--format=text|counts|csv] [--threads=<n>]\n"
+                 "                    [--chunk-size=<KB>] [--stats] [-o <file>]\n"
+                 "                    [--from-event=<n>] [--max-events=<n>] [--from-ms=<t>]\n"
+                 "                    [--to-ms=<t>] [--branch=<id>] [--index] <trace>\n");
+    std::exit(2);
+}
+
+// The value of "--<name>=<number>" in arg, false if arg is another option.
+static bool NumberOption(const std::string &arg, const char *name, uint64_t &value) {
+    size_t length = std::strlen(name);
+    if (arg.compare(0, 2, "--") != 0 || arg.compare(2, length, name) != 0 || arg.size() <= length + 3 ||
+        arg[length + 2] != '=')
+        return false;
+    char *end;
+    value = std::strtoull(arg.c_str() + length + 3, &end, 10);
+    return *end == '\0';
+}
+
+static bool ParseOptions(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        uint64_t value;
+        if (NumberOption(arg, "from-event", options.from_event) || NumberOption(arg, "from-ms", options.from_ms) ||
+            NumberOption(arg, "to-ms", options.to_ms)) {
+        } else if (NumberOption(arg, "max-events", value) && value > 0) {
+            options.max_events = value;
+        } else if (NumberOption(arg, "branch", value)) {
+            options.branch = value;
+        } else if (arg == "--index") {
+            options.list_index = true;
+        } else if (arg.compare(0, 7, "--info=") == 0) {
+            options.info = arg.substr(7);
+        } else if (arg == "--format=text") {
+            options.format = OutputFormat::Text;
+        } else if (arg == "--format=counts") {
+            options.format = OutputFormat::Counts;
+        } else if (arg == "--format=csv") {
+            options.format = OutputFormat::Csv;
+        } else if (arg.compare(0, 10, "--threads=") == 0 && std::atoi(arg.c_str() + 10) > 0) {
+            options.threads = std::atoi(arg.c_str() + 10);
+        } else if (arg.compare(0, 13, "--chunk-size=") == 0 && std::atol(arg.c_str() + 13) > 0) {
+            options.chunk_bytes = std::atol(arg.c_str() + 13) * 1024;
+        } else if (arg == "--stats") {
+            options.stats = true;
+        } else if (arg == "-o" && i + 1 < argc) {
+            options.output = argv[++i];
+        } else if (arg[0] != '-' && options.trace.empty()) {
+            options.trace = arg;
+        } else {
+            return false;
+        }
+    }
+    return !options.trace.empty();
+}
+
+static void AppendNumber(std::string &out, uint64_t value) {
+    char buffer[24];
+    out.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value).ptr);
+}
+
+static std::string CsvField(const std::string &field) {
+    if (field.find_first_of(",\"\n") == std::string::npos)
+        return field;
+    std::string quoted = "\"";
+    for (char c : field) {
+        if (c == '"')
+            quoted += '"';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+// The output of every id is formatted once up front, so decoding a chunk
+// only appends strings. Ids the metadata does not know print as "???".
+class Formatter {
+public:
+    Formatter(const TraceMetadata &metadata, OutputFormat format) : metadata_(metadata), format_(format) {
+        for (size_t id = 0; id < metadata.branches.size(); id++)
+            branch_lines_.push_back(BranchLine(id));
+        for (size_t id = 0; id < metadata.functions.size(); id++)
+            function_names_.push_back(FunctionName(id));
+        for (size_t id = 0; id < metadata.callsites.size(); id++)
+            site_prefixes_.push_back(SitePrefix(id));
+    }
+
+    void Append(const TraceEvent &event, std::string &out) const {
+        if (event.kind == EventKind::Branch) {
+            if (event.id < branch_lines_.size())
+                out += branch_lines_[event.id];
+            else
+                out += BranchLine(event.id);
+            return;
+        }
+
+        const std::string &name =
+            event.id < function_names_.size() ? function_names_[event.id] : Unknown();
+        if (format_ == OutputFormat::Csv) {
+            out += "fn,";
+            AppendNumber(out, event.id);
+            out += ',';
+        } else if (event.site == 0) {
+            out += "*funcptr_";
+            AppendNumber(out, event.id);
+            out += ": ";
+        }
+        if (event.site < site_prefixes_.size())
+            out += site_prefixes_[event.site];
+        else
+            out += SitePrefix(event.site);
+        out += name;
+    }
+
+private:
+    std::string BranchLine(uint32_t id) const {
+        const BranchInfo *branch = id < metadata_.branches.size() ? &metadata_.branches[id] : nullptr;
+        bool known = branch && !branch->filepath.empty();
+        if (format_ == OutputFormat::Csv) {
+            if (!known)
+                return "br," + std::to_string(id) + ",???,0,0,,\n";
+            return "br," + std::to_string(id) + "," + CsvField(branch->filepath) + "," +
+                   std::to_string(branch->src_lno) + "," + std::to_string(branch->dest_lno) + ",,\n";
+        }
+        if (!known)
+            return "br_" + std::to_string(id) + ": ???, 0, 0\n";
+        return "br_" + std::to_string(id) + ": " + branch->filepath + ", " + std::to_string(branch->src_lno) + ", " +
+               std::to_string(branch->dest_lno) + "\n";
+    }
+
+    std::string FunctionName(uint32_t id) const {
+        const FunctionInfo &function = metadata_.functions[id];
+        if (function.name.empty())
+            return Unknown();
+        return (format_ == OutputFormat::Csv ? CsvField(function.name) : function.name) + "\n";
+    }
+
+    // What comes between the fn_N and the name: the call site in text
+    // traces, "file,line,,site," in csv.
+    std::string SitePrefix(uint32_t site) const {
+        const CallSiteInfo *callsite = site < metadata_.callsites.size() ? &metadata_.callsites[site] : nullptr;
+        bool known = callsite && !callsite->filepath.empty();
+        if (format_ == OutputFormat::Csv) {
+            if (site == 0)
+                return ",,,,";
+            if (!known)
+                return "???,0,," + std::to_string(site) + ",";
+            return CsvField(callsite->filepath) + "," + std::to_string(callsite->lno) + ",," +
+                   std::to_string(site) + ",";
+        }
+        if (site == 0)
+            return "";
+        if (!known)
+            return "cs_" + std::to_string(site) + ": ???, 0, ";
+        return "cs_" + std::to_string(site) + ": " + callsite->filepath + ", " + std::to_string(callsite->lno) + ", ";
+    }
+
+    static const std::string &Unknown() {
+        static const std::string unknown = "???\n";
+        return unknown;
+    }
+
+    const TraceMetadata &metadata_;
+    OutputFormat format_;
+    std::vector<std::string> branch_lines_;
+    std::vector<std::string> function_names_;
+    std::vector<std::string> site_prefixes_;
+};
+
+// The chunks of a chunked trace that can have selected events. Event
+// numbers and times are found in the index by binary search, and chunks
+// whose summary does not have --branch are skipped.
+static std::vector<TraceChunk> SelectChunks(const TraceReader &reader, const Options &options) {
+    size_t first = reader.FindTimeFrom(options.from_ms), last = reader.FindTimeTo(options.to_ms);
+    if (options.from_event)
+        first = std::max(first, reader.FindEvent(options.from_event));
+    if (options.max_events != std::numeric_limits<uint64_t>::max()) {
+        uint64_t last_event = options.from_event + options.max_events - 1;
+        if (last_event >= options.from_event && reader.FindEvent(last_event) < last)
+            last = reader.FindEvent(last_event) + 1;
+    }
+
+    std::vector<TraceChunk> chunks;
+    for (size_t chunk = first; chunk < last; chunk++) {
+        if (options.branch < 0 || reader.Header(chunk).MayContain(options.branch))
+            chunks.push_back(reader.Chunk(chunk));
+    }
+    return chunks;
+}
+
+static void PrintIndex(const TraceReader &reader, FILE *out) {
+    std::fprintf(out, "%8s %14s %14s %8s %12s %12s\n", "chunk", "offset", "first event", "events", "first ms",
+                 "last ms");
+    for (size_t chunk = 0; chunk < reader.index().size(); chunk++) {
+        TraceChunkHeader header = reader.Header(chunk);
+        std::fprintf(out, "%8zu %14llu %14llu %8u %12llu %12llu\n", chunk,
+                     (unsigned long long)reader.index()[chunk].offset, (unsigned long long)header.first_event,
+                     header.events, (unsigned long long)header.first_time, (unsigned long long)header.last_time);
+    }
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+        Usage();
+
+    auto start = std::chrono::steady_clock::now();
+    TraceReader reader;
+    std::string error;
+    if (!reader.Open(options.trace, error)) {
+        std::fprintf(stderr, "trace_decode: %s\n", error.c_str());
+        return 1;
+    }
+    if ((options.Selects() || options.list_index) && !reader.chunked()) {
+        std::fprintf(stderr, "trace_decode: selecting events needs a chunked foobar trace\n");
+        return 1;
+    }
+    if (options.list_index) {
+        PrintIndex(reader, stdout);
+        return 0;
+    }
+
+    TraceMetadata metadata;
+    std::string info = options.info.empty() ? reader.DefaultMetadataPath() : options.info;
+    if (!ReadTraceMetadata(info, metadata)) {
+        std::fprintf(stderr, "trace_decode: cannot read %s, pass --info=<file>\n", info.c_str());
+        return 1;
+    }
+
+    FILE *out = stdout;
+    if (!options.output.empty() && !(out = std::fopen(options.output.c_str(), "w"))) {
+        std::fprintf(stderr, "trace_decode: cannot write %s\n", options.output.c_str());
+        return 1;
+    }
+
+    Formatter formatter(metadata, options.format);
+    if (options.format == OutputFormat::Csv)
+        std::fputs("kind,id,file,src_line,dest_line,callsite,function\n", out);
+    std::vector<TraceChunk> chunks =
+        options.Selects() ? SelectChunks(reader, options) : reader.Split(options.chunk_bytes);
+    bool selects_events = options.from_event || options.max_events != std::numeric_limits<uint64_t>::max() ||
+                          options.branch >= 0;
+    std::vector<EdgeCounts> counts(options.threads);
+    // The output of a chunk. Each thread keeps its buffer, so it grows to
+    // the largest chunk's output once instead of being sized per chunk.
+    std::vector<std::string> buffers(options.threads);
+
+    // Chunks are handed out in order, so a thread waits for at most the
+    // chunks the other threads are still decoding before it may write.
+    std::mutex mutex;
+    std::condition_variable written;
+    size_t next_write = 0;
+    bool failed = false;
+
+    // Events are numbered from the start of their chunk
+    auto selected = [&](uint64_t number, const TraceEvent &event) {
+        return number >= options.from_event && number - options.from_event < options.max_events &&
+               (options.branch < 0 || (event.kind == EventKind::Branch && event.id == options.branch));
+    };
+
+    ParallelFor(chunks.size(), options.threads, [&](size_t index, unsigned int worker) {
+        EdgeCounts &local = counts[worker];
+        uint64_t number = chunks[index].first_event;
+        if (options.format == OutputFormat::Counts) {
+            reader.Decode(chunks[index], [&](const TraceEvent &event) {
+                if (!selects_events || selected(number++, event))
+                    local.Add(event);
+            });
+            return;
+        }
+
+        std::string &text = buffers[worker];
+        text.clear();
+        reader.Decode(chunks[index], [&](const TraceEvent &event) {
+            if (selects_events && !selected(number++, event))
+                return;
+            local.events++;
+            formatter.Append(event, text);
+        });
+
+        std::unique_lock<std::mutex> lock(mutex);
+        written.wait(lock, [&] { return next_write == index; });
+        if (std::fwrite(text.data(), 1, text.size(), out) != text.size())
+            failed = true;
+        next_write++;
+        written.notify_all();
+    });
+
+    for (size_t t = 1; t < counts.size(); t++)
+        counts[0].Merge(counts[t]);
+    uint64_t events = counts[0].events;
+    if (options.format == OutputFormat::Counts)
+        WriteProfile(out, MakeProfile(counts[0], metadata));
+
+    if (std::fflush(out) != 0 || failed || (out != stdout && std::fclose(out) != 0)) {
+        std::fprintf(stderr, "trace_decode: error writing the output\n");
+        return 1;
+    }
+
+    if (options.stats) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double bytes = 0;
+        for (auto &chunk : chunks)
+            bytes += chunk.end - chunk.begin;
+        std::fprintf(stderr, "%llu events, %.1f MB in %.3f s, %.1f MB/s on %u threads\n",
+                     (unsigned long long)events, bytes / 1e6, seconds, bytes / 1e6 / seconds, options.threads);
+    }
+    return 0;
+}
@@ -0,0 +1,491 @@
+/*
+ * trace_diff: compares the edge counts of two runs.
+ *
+ *   trace_diff [--match=edge|location|id] [--top=<n>] [--min-count=<n>] [--normalize]
+ *              [--divergence=<n>] [--info-a=<file>] [--info-b=<file>]
+ *              [--threads=<n>] <a> <b>
+ *
+ * Each input is a profile (liblogger's BRANCH_PROFILE or trace_decode
+ * --format=counts) or a trace, which is counted on all cores. Edges are
+ * matched by file, lines and id, by source location alone, so runs of
+ * different builds compare, or by id alone. The edges that changed most
+ * are ranked by absolute and by relative change. With --divergence and two
+ * traces, the event sequences are also compared in order, and the first
+ * places where they differ are printed. Traces are read chunk by chunk, so
+ * memory does not grow with their size.
+ */
+#include "Trace.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <unordered_map>
+
+// What edges are matched by, see EdgeKey.
+enum class EdgeMatch { Edge, Location, Id };
+
+struct Options {
+    std::string inputs[2];
+    std::string infos[2];
+    EdgeMatch match = EdgeMatch::Edge;
+    size_t top = 20;
+    uint64_t min_count = 100;
+    bool normalize = false;
+    size_t divergences = 0;
+    unsigned int threads = DefaultThreads();
+};
+
+static void Usage() {
+    std::fprintf(stderr,
+                 "usage: trace_diff [--match=edge|location|id] [--top=<n>] [--min-count=<n>] [--normalize]\n"
+                 "                  [--divergence=<n>] [--info-a=<file>] [--info-b=<file>]\n"
+                 "                  [--threads=<n>] <a> <b>\n");
+    std::exit(2);
+}
+
+static bool ParseOptions(int argc, char **argv, Options &options) {
+    int inputs = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--match=edge") {
+            options.match = EdgeMatch::Edge;
+        } else if (arg == "--match=location") {
+            options.match = EdgeMatch::Location;
+        } else if (arg == "--match=id") {
+            options.match = EdgeMatch::Id;
+        } else if (arg.compare(0, 6, "--top=") == 0) {
+            options.top = std::strtoul(arg.c_str() + 6, nullptr, 10);
+        } else if (arg.compare(0, 12, "--min-count=") == 0) {
+            options.min_count = std::strtoull(arg.c_str() + 12, nullptr, 10);
+        } else if (arg == "--normalize") {
+            options.normalize = true;
+        } else if (arg == "--divergence") {
+            options.divergences = 1;
+        } else if (arg.compare(0, 13, "--divergence=") == 0) {
+            options.divergences = std::strtoul(arg.c_str() + 13, nullptr, 10);
+        } else if (arg.compare(0, 9, "--info-a=") == 0) {
+            options.infos[0] = arg.substr(9);
+        } else if (arg.compare(0, 9, "--info-b=") == 0) {
+            options.infos[1] = arg.substr(9);
+        } else if (arg.compare(0, 10, "--threads=") == 0 && std::atoi(arg.c_str() + 10) > 0) {
+            options.threads = std::atoi(arg.c_str() + 10);
+        } else if (arg[0] != '-' && inputs < 2) {
+            options.inputs[inputs++] = arg;
+        } else {
+            return false;
+        }
+    }
+    return inputs == 2;
+}
+
+static std::string Basename(const std::string &path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+// What an edge is matched by: "path:src -> dest br_N" and
+// "path:line cs_N -> target" by default, so two edges between the same
+// lines stay apart. By location, "file:src -> dest" and "file:line ->
+// target" with files compared by name, so builds in different directories
+// still match. By id, "br_N" and "cs_N -> target".
+static std::string EdgeKey(EdgeMatch match, uint32_t id, const std::string &filepath, unsigned int src_lno,
+                           unsigned int dest_lno) {
+    if (match == EdgeMatch::Id)
+        return "br_" + std::to_string(id);
+    std::string lines = ":" + std::to_string(src_lno) + " -> " + std::to_string(dest_lno);
+    if (match == EdgeMatch::Location)
+        return Basename(filepath) + lines;
+    return filepath + lines + " br_" + std::to_string(id);
+}
+
+static std::string SiteKey(EdgeMatch match, uint32_t site, const std::string &filepath, unsigned int lno) {
+    if (match == EdgeMatch::Id)
+        return "cs_" + std::to_string(site);
+    if (match == EdgeMatch::Location)
+        return Basename(filepath) + ":" + std::to_string(lno);
+    return filepath + ":" + std::to_string(lno) + " cs_" + std::to_string(site);
+}
+
+// One input, read as a profile, or as a trace with its metadata.
+struct Input {
+    std::string path;
+    bool is_trace = false;
+    TraceReader reader;
+    TraceMetadata metadata;
+    Profile profile;
+};
+
+static bool OpenInput(const std::string &path, const std::string &info, unsigned int threads, Input &input) {
+    input.path = path;
+    if (IsProfile(path)) {
+        if (!ReadProfile(path, input.profile)) {
+            std::fprintf(stderr, "trace_diff: cannot read %s\n", path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    std::string error;
+    if (!input.reader.Open(path, error)) {
+        std::fprintf(stderr, "trace_diff: %s\n", error.c_str());
+        return false;
+    }
+    std::string info_path = info.empty() ? input.reader.DefaultMetadataPath() : info;
+    if (!ReadTraceMetadata(info_path, input.metadata)) {
+        std::fprintf(stderr, "trace_diff: cannot read %s, pass --info-a/--info-b\n", info_path.c_str());
+        return false;
+    }
+    input.is_trace = true;
+    input.profile = MakeProfile(CountTrace(input.reader, input.reader.Split(4 << 20), threads), input.metadata);
+    return true;
+}
+
+/*--- Edge counts -------------------------------------------------------*/
+
+struct Change {
+    std::string key;
+    double counts[2] = {0, 0};
+
+    double Delta() const { return counts[1] - counts[0]; }
+    // Symmetric, so halving and doubling rank the same
+    double LogRatio() const { return std::fabs(std::log((counts[1] + 1) / (counts[0] + 1))); }
+};
+
+static void PrintChange(const Change &change) {
+    char relative[16];
+    if (change.counts[0] == 0)
+        std::snprintf(relative, sizeof(relative), "new");
+    else if (change.counts[1] == 0)
+        std::snprintf(relative, sizeof(relative), "gone");
+    else
+        std::snprintf(relative, sizeof(relative), "%+.0f%%", change.Delta() / change.counts[0] * 100);
+    std::printf("%14.0f %14.0f %+14.0f %9s  %s\n", change.counts[0], change.counts[1], change.Delta(), relative,
+                change.key.c_str());
+}
+
+static void DiffCounts(const Options &options, Input (&inputs)[2]) {
+    std::unordered_map<std::string, size_t> index;
+    std::vector<Change> changes;
+    double totals[2] = {0, 0};
+    size_t edges[2] = {0, 0};
+
+    auto add = [&](int side, std::string key, uint64_t count) {
+        auto inserted = index.insert({key, changes.size()});
+        if (inserted.second) {
+            changes.emplace_back();
+            changes.back().key = std::move(key);
+        }
+        Change &change = changes[inserted.first->second];
+        if (change.counts[side] == 0 && count)
+            edges[side]++;
+        change.counts[side] += count;
+        totals[side] += count;
+    };
+    for (int side = 0; side < 2; side++) {
+        for (auto &edge : inputs[side].profile.edges)
+            add(side, EdgeKey(options.match, edge.id, edge.filepath, edge.src_lno, edge.dest_lno), edge.count);
+        for (auto &target : inputs[side].profile.targets)
+            add(side, SiteKey(options.match, target.site, target.filepath, target.lno) + " -> *" + target.target,
+                target.count);
+    }
+
+    // Scales b to the length of a, for runs on inputs of different size
+    if (options.normalize && totals[1] > 0) {
+        double scale = totals[0] / totals[1];
+        for (auto &change : changes)
+            change.counts[1] *= scale;
+    }
+
+    size_t only[2] = {0, 0};
+    for (auto &change : changes) {
+        for (int side = 0; side < 2; side++)
+            only[side] += change.counts[side] > 0 && change.counts[1 - side] == 0;
+    }
+    std::printf("%-24s %14s %14s\n", "", "a", "b");
+    std::printf("%-24s %14.0f %14.0f\n", "executions", totals[0], totals[1]);
+    std::printf("%-24s %14zu %14zu\n", "edges that ran", edges[0], edges[1]);
+    std::printf("%-24s %14zu %14zu\n", "only on this side", only[0], only[1]);
+
+    std::vector<const Change *> ranked;
+    for (auto &change : changes) {
+        if (change.Delta() != 0)
+            ranked.push_back(&change);
+    }
+    size_t top = std::min(options.top, ranked.size());
+    std::partial_sort(ranked.begin(), ranked.begin() + top, ranked.end(), [](const Change *x, const Change *y) {
+        double dx = std::fabs(x->Delta()), dy = std::fabs(y->Delta());
+        return dx > dy || (dx == dy && x->key < y->key);
+    });
+    std::printf("\nlargest changes:\n%14s %14s %14s %9s  %s\n", "a", "b", "delta", "change", "edge");
+    for (size_t i = 0; i < top; i++)
+        PrintChange(*ranked[i]);
+
+    // Rarely run edges change by large factors by chance, they are left out
+    ranked.erase(std::remove_if(ranked.begin(), ranked.end(),
+                                [&](const Change *change) {
+                                    return std::max(change->counts[0], change->counts[1]) < options.min_count;
+                                }),
+                 ranked.end());
+    top = std::min(options.top, ranked.size());
+    std::partial_sort(ranked.begin(), ranked.begin() + top, ranked.end(), [](const Change *x, const Change *y) {
+        return x->LogRatio() > y->LogRatio() || (x->LogRatio() == y->LogRatio() && x->key < y->key);
+    });
+    std::printf("\nlargest relative changes, edges run at least %" PRIu64 " times:\n%14s %14s %14s %9s  %s\n",
+                options.min_count, "a", "b", "delta", "change", "edge");
+    for (size_t i = 0; i < top; i++)
+        PrintChange(*ranked[i]);
+}
+
+/*--- Divergence --------------------------------------------------------*/
+
+// Gives every matched edge and call target a number, shared by both
+// traces, so events compare as integers.
+class KeyTable {
+public:
+    uint32_t Intern(const std::string &key) {
+        auto inserted = numbers_.insert({key, (uint32_t)names_.size()});
+        if (inserted.second)
+            names_.push_back(key);
+        return inserted.first->second;
+    }
+    const std::string &Name(uint32_t number) const { return names_[number]; }
+
+private:
+    std::unordered_map<std::string, uint32_t> numbers_;
+    std::vector<std::string> names_;
+};
+
+// An event as a number: the key of its br_N, or, with the top bit set, the
+// keys of its call site and target.
+constexpr uint64_t CallBit = 1ull << 63;
+
+// The keys of every id of one trace's metadata.
+struct TraceKeys {
+    std::vector<uint32_t> branches;
+    std::vector<uint32_t> sites;
+    std::vector<uint32_t> functions;
+    uint32_t unknown_branch;
+    uint32_t unknown_site;
+    uint32_t unknown_function;
+    // Text traces do not record call sites, calls then match by target
+    bool use_sites;
+
+    uint64_t Key(const TraceEvent &event) const {
+        if (event.kind == EventKind::Branch)
+            return event.id < branches.size() ? branches[event.id] : unknown_branch;
+        uint64_t site = !use_sites ? unknown_site : event.site < sites.size() ? sites[event.site] : unknown_site;
+        uint64_t function = event.id < functions.size() ? functions[event.id] : unknown_function;
+        return CallBit | site << 32 | function;
+    }
+};
+
+static TraceKeys MakeKeys(const TraceMetadata &metadata, EdgeMatch match, bool use_sites, KeyTable &table) {
+    TraceKeys keys;
+    keys.unknown_branch = table.Intern("???");
+    keys.unknown_site = table.Intern("???:0");
+    keys.unknown_function = table.Intern("???");
+    keys.use_sites = use_sites;
+
+    // Ids without a metadata line are left as unknown
+    for (size_t id = 0; id < metadata.branches.size(); id++) {
+        const BranchInfo &branch = metadata.branches[id];
+        keys.branches.push_back(branch.filepath.empty() ? keys.unknown_branch
+                                                        : table.Intern(EdgeKey(match, id, branch.filepath,
+                                                                               branch.src_lno, branch.dest_lno)));
+    }
+    for (size_t id = 0; id < metadata.callsites.size(); id++) {
+        const CallSiteInfo &callsite = metadata.callsites[id];
+        keys.sites.push_back(callsite.filepath.empty() ? keys.unknown_site
+                                                       : table.Intern(SiteKey(match, id, callsite.filepath,
+                                                                              callsite.lno)));
+    }
+    for (size_t id = 0; id < metadata.functions.size(); id++) {
+        const std::string &name = metadata.functions[id].name;
+        keys.functions.push_back(name.empty() ? keys.unknown_function
+                                              : table.Intern(match == EdgeMatch::Id ? "fn_" + std::to_string(id) : name));
+    }
+    return keys;
+}
+
+static std::string Describe(const KeyTable &table, uint64_t key) {
+    if (!(key & CallBit))
+        return table.Name(key);
+    return table.Name((key & ~CallBit) >> 32) + " -> *" + table.Name((uint32_t)key);
+}
+
+// The events of a trace as keys, decoded a few chunks at a time on all
+// cores. Only the events from the last Drop() on are kept.
+class EventStream {
+public:
+    EventStream(const TraceReader &reader, const TraceKeys &keys, unsigned int threads)
+        : reader_(reader), keys_(keys), threads_(threads), chunks_(reader.Split(1 << 20)) {}
+
+    // Decodes until event `end` is buffered or the trace ends.
+    void Fill(uint64_t end) {
+        while (base_ + events_.size() < end && next_chunk_ < chunks_.size()) {
+            size_t count = std::min<size_t>(threads_, chunks_.size() - next_chunk_);
+            std::vector<std::vector<uint64_t>> decoded(count);
+            ParallelFor(count, threads_, [&](size_t index, unsigned int) {
+                reader_.Decode(chunks_[next_chunk_ + index],
+                               [&](const TraceEvent &event) { decoded[index].push_back(keys_.Key(event)); });
+            });
+            for (auto &events : decoded)
+                events_.insert(events_.end(), events.begin(), events.end());
+            next_chunk_ += count;
+        }
+    }
+
+    // The number of events decoded so far, which is all of them once
+    // Fill() stops short.
+    uint64_t End() const { return base_ + events_.size(); }
+    uint64_t At(uint64_t event) const { return events_[event - base_]; }
+
+    void Drop(uint64_t before) {
+        if (before > base_ && before - base_ > events_.size() / 2) {
+            events_.erase(events_.begin(), events_.begin() + (before - base_));
+            base_ = before;
+        }
+    }
+
+private:
+    const TraceReader &reader_;
+    const TraceKeys &keys_;
+    unsigned int threads_;
+    std::vector<TraceChunk> chunks_;
+    size_t next_chunk_ = 0;
+    std::vector<uint64_t> events_;
+    uint64_t base_ = 0;
+};
+
+// After a divergence the traces are realigned at the nearest point where
+// both have the same Anchor events in a row, looking at most Window events
+// ahead in each.
+constexpr size_t Anchor = 8;
+constexpr size_t Window = 4096;
+constexpr size_t Context = 3;
+
+static uint64_t HashEvents(const EventStream &stream, uint64_t first) {
+    uint64_t hash = 0;
+    for (size_t i = 0; i < Anchor; i++)
+        hash = (hash ^ stream.At(first + i)) * 0x100000001b3ull;
+    return hash;
+}
+
+static bool SameEvents(const EventStream &a, uint64_t ia, const EventStream &b, uint64_t ib) {
+    for (size_t i = 0; i < Anchor; i++) {
+        if (a.At(ia + i) != b.At(ib + i))
+            return false;
+    }
+    return true;
+}
+
+// The smallest skips in a and b after which the traces agree again.
+static bool Realign(EventStream &a, uint64_t ia, EventStream &b, uint64_t ib, uint64_t &skip_a, uint64_t &skip_b) {
+    a.Fill(ia + Window + Anchor);
+    b.Fill(ib + Window + Anchor);
+
+    std::unordered_multimap<uint64_t, uint64_t> anchors;
+    for (uint64_t j = ib; j + Anchor <= b.End() && j < ib + Window; j++)
+        anchors.insert({HashEvents(b, j), j});
+
+    bool found = false;
+    for (uint64_t i = ia; i + Anchor <= a.End() && i < ia + Window; i++) {
+        if (found && i - ia >= skip_a + skip_b)
+            break;
+        auto range = anchors.equal_range(HashEvents(a, i));
+        for (auto it = range.first; it != range.second; ++it) {
+            if ((!found || (i - ia) + (it->second - ib) < skip_a + skip_b) && SameEvents(a, i, b, it->second)) {
+                skip_a = i - ia;
+                skip_b = it->second - ib;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+static void PrintEvents(const char *label, const EventStream &stream, uint64_t first, uint64_t end,
+                        const KeyTable &table) {
+    for (uint64_t i = first; i < end && i < stream.End(); i++)
+        std::printf("  %s %12" PRIu64 "  %s\n", label, i, Describe(table, stream.At(i)).c_str());
+}
+
+static void FindDivergences(const Options &options, Input (&inputs)[2]) {
+    KeyTable table;
+    bool use_sites =
+        inputs[0].reader.format() == TraceFormat::Foobar && inputs[1].reader.format() == TraceFormat::Foobar;
+    TraceKeys keys_a = MakeKeys(inputs[0].metadata, options.match, use_sites, table);
+    TraceKeys keys_b = MakeKeys(inputs[1].metadata, options.match, use_sites, table);
+    EventStream a(inputs[0].reader, keys_a, options.threads), b(inputs[1].reader, keys_b, options.threads);
+
+    uint64_t ia = 0, ib = 0;
+    size_t found = 0;
+    std::printf("\n");
+    while (found < options.divergences) {
+        for (;;) {
+            // Only the context before the current event is kept
+            if (ia == a.End() || ib == b.End()) {
+                a.Drop(ia > Context ? ia - Context : 0);
+                b.Drop(ib > Context ? ib - Context : 0);
+                a.Fill(ia + (1 << 20));
+                b.Fill(ib + (1 << 20));
+            }
+            if (ia == a.End() || ib == b.End() || a.At(ia) != b.At(ib))
+                break;
+            ia++;
+            ib++;
+        }
+        if (ia == a.End() && ib == b.End()) {
+            if (found)
+                std::printf("the traces agree from there to the end\n");
+            else
+                std::printf("the traces are the same, %" PRIu64 " events\n", ia);
+            return;
+        }
+
+        found++;
+        std::printf("divergence %zu at event %" PRIu64 " of a and %" PRIu64 " of b:\n", found, ia, ib);
+        PrintEvents(" ", a, ia > Context ? ia - Context : 0, ia, table);
+        if (ia == a.End() || ib == b.End()) {
+            std::printf("  %s ends here\n", ia == a.End() ? "a" : "b");
+            return;
+        }
+
+        uint64_t skip_a, skip_b;
+        if (!Realign(a, ia, b, ib, skip_a, skip_b)) {
+            PrintEvents("a", a, ia, ia + Context, table);
+            PrintEvents("b", b, ib, ib + Context, table);
+            std::printf("  the traces do not realign within %zu events\n", Window);
+            return;
+        }
+        PrintEvents("a", a, ia, ia + std::min<uint64_t>(skip_a, 10), table);
+        PrintEvents("b", b, ib, ib + std::min<uint64_t>(skip_b, 10), table);
+        std::printf("  realigned after %" PRIu64 " events of a and %" PRIu64 " of b\n", skip_a, skip_b);
+        ia += skip_a;
+        ib += skip_b;
+    }
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+        Usage();
+
+    Input inputs[2];
+    for (int side = 0; side < 2; side++) {
+        if (!OpenInput(options.inputs[side], options.infos[side], options.threads, inputs[side]))
+            return 1;
+    }
+
+    DiffCounts(options, inputs);
+    if (options.divergences) {
+        if (!inputs[0].is_trace || !inputs[1].is_trace) {
+            std::fprintf(stderr, "trace_diff: --divergence needs two traces, profiles have no order\n");
+            return 1;
+        }
+        FindDivergences(options, inputs);
+    }
+    return 0;
+}
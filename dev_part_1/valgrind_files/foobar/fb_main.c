@@ -29,10 +29,1926 @@
 #include "pub_tool_basics.h"
 #include "pub_tool_tooliface.h"
 #include "pub_tool_options.h"
+#include "pub_tool_libcprint.h"
+#include "pub_tool_libcbase.h"
+#include "pub_tool_libcfile.h"
+#include "pub_tool_mallocfree.h"
+#include "pub_tool_hashtable.h"
+#include "pub_tool_debuginfo.h"
+#include "pub_tool_clientstate.h"
+#include "pub_tool_libcproc.h"
+#include "pub_tool_vki.h"
+#include "pub_tool_machine.h"
+#include "pub_tool_threadstate.h"
+#include "pub_tool_transtab.h"
+#include "pub_tool_xarray.h"
 
+#include "foobar.h"
 
-static ULong total_instructions = 0;
-static VG_REGPARM(0) void incement_count(void) { total_instructions++; }
+#if defined(VGA_amd64)
+#  include "libvex_guest_amd64.h"
+#  define FB_GUEST_ARG1 offsetof(VexGuestAMD64State, guest_RDI)
+#  define FB_GUEST_ARG2 offsetof(VexGuestAMD64State, guest_RSI)
+#elif defined(VGA_arm64)
+#  include "libvex_guest_arm64.h"
+#  define FB_GUEST_ARG1 offsetof(VexGuestARM64State, guest_X0)
+#  define FB_GUEST_ARG2 offsetof(VexGuestARM64State, guest_X1)
+#  define FB_GUEST_LR   offsetof(VexGuestARM64State, guest_X30)
+#endif
+
+
+/*------------------------------------------------------------*/
+/*--- Command line options                                 ---*/
+/*------------------------------------------------------------*/
+
+/* Wildcard patterns of an option that may be repeated. */
+#define FB_MAX_PATTERNS 16
+typedef struct {
+   const HChar* patterns[FB_MAX_PATTERNS];
+   Int          n;
+} PatternList;
+
+static void add_pattern(PatternList* list, const HChar* arg, const HChar* pattern)
+{
+   if (list->n == FB_MAX_PATTERNS)
+      VG_(fmsg_bad_option)(arg, "At most %d patterns per option.\n", FB_MAX_PATTERNS);
+   list->patterns[list->n++] = pattern;
+}
+
+static Bool match_pattern(const PatternList* list, const HChar* name)
+{
+   Int i;
+
+   for (i = 0; i < list->n; i++) {
+      if (VG_(string_match)(list->patterns[i], name))
+         return True;
+   }
+   return False;
+}
+
+// Functions and source lines listed in the hotspot report
+static Int clo_hotspots = 20;
+// Also write the counts in callgrind format to this file
+static const HChar* clo_callgrind_out_file = NULL;
+// Count instructions between the LogBranch/LogPointer calls of the guest
+static Bool clo_branch_regions = False;
+// Count from the start of the program, or only once switched on
+static Bool clo_collect_atstart = True;
+// Count while in these functions, including what they call
+static PatternList clo_toggle_collect;
+// Only instrument code of these objects and functions, or not of these
+static PatternList clo_include_obj, clo_exclude_obj;
+static PatternList clo_include_fn, clo_exclude_fn;
+// Measure the reuse distance of the cache lines loads and stores touch
+static Bool clo_reuse_distance = False;
+static Int  clo_cache_line     = 64;
+// Track one in so many cache lines and scale their distances
+static Int  clo_reuse_sample   = 1;
+// Fully associative LRU caches of these sizes in bytes, for the hit rates
+#define FB_MAX_CACHES 4
+static ULong clo_cache_sizes[FB_MAX_CACHES] = { 32768, 1048576, 33554432 };
+static Int   clo_n_cache_sizes = 3;
+// Classify the counted instructions and their IR operations
+static Bool clo_instr_mix = False;
+// Write the branches and indirect calls of the guest to this file
+static const HChar* clo_branch_trace = NULL;
+// Write the counts per function every so many instructions or milliseconds
+static Long clo_interval    = 0;
+static Long clo_interval_ms = 0;
+static const HChar* clo_interval_out_file = "foobar.intervals.%p";
+
+/* A list like 32K,1M,32M. */
+static void parse_cache_sizes(const HChar* arg, const HChar* list)
+{
+   HChar* end;
+
+   clo_n_cache_sizes = 0;
+   while (*list) {
+      ULong size = VG_(strtoull10)(list, &end);
+      if (end == list || clo_n_cache_sizes == FB_MAX_CACHES)
+         VG_(fmsg_bad_option)(arg, "Expected up to %d sizes, e.g. 32K,1M,32M.\n", FB_MAX_CACHES);
+      if (*end == 'K' || *end == 'k')
+         size <<= 10, end++;
+      else if (*end == 'M' || *end == 'm')
+         size <<= 20, end++;
+      else if (*end == 'G' || *end == 'g')
+         size <<= 30, end++;
+      clo_cache_sizes[clo_n_cache_sizes++] = size;
+      if (*end == ',')
+         end++;
+      else if (*end)
+         VG_(fmsg_bad_option)(arg, "Expected up to %d sizes, e.g. 32K,1M,32M.\n", FB_MAX_CACHES);
+      list = end;
+   }
+}
+
+static Bool fb_process_cmd_line_option(const HChar* arg)
+{
+   const HChar* tmp_str;
+
+   if VG_BINT_CLO(arg, "--hotspots", clo_hotspots, 0, 1000000) {}
+   else if VG_STR_CLO(arg, "--callgrind-out-file", clo_callgrind_out_file) {}
+   else if VG_BOOL_CLO(arg, "--branch-regions", clo_branch_regions) {}
+   else if VG_BOOL_CLO(arg, "--collect-atstart", clo_collect_atstart) {}
+   else if VG_BOOL_CLO(arg, "--instr-mix", clo_instr_mix) {}
+   else if VG_STR_CLO(arg, "--branch-trace", clo_branch_trace) {}
+   else if VG_BINT_CLO(arg, "--interval", clo_interval, 0, 1000000000000000LL) {}
+   else if VG_BINT_CLO(arg, "--interval-ms", clo_interval_ms, 0, 1000000000LL) {}
+   else if VG_STR_CLO(arg, "--interval-out-file", clo_interval_out_file) {}
+   else if VG_STR_CLO(arg, "--toggle-collect", tmp_str)
+      add_pattern(&clo_toggle_collect, arg, tmp_str);
+   else if VG_STR_CLO(arg, "--include-obj", tmp_str)
+      add_pattern(&clo_include_obj, arg, tmp_str);
+   else if VG_STR_CLO(arg, "--exclude-obj", tmp_str)
+      add_pattern(&clo_exclude_obj, arg, tmp_str);
+   else if VG_STR_CLO(arg, "--include-fn", tmp_str)
+      add_pattern(&clo_include_fn, arg, tmp_str);
+   else if VG_STR_CLO(arg, "--exclude-fn", tmp_str)
+      add_pattern(&clo_exclude_fn, arg, tmp_str);
+   else if VG_BOOL_CLO(arg, "--reuse-distance", clo_reuse_distance) {}
+   else if VG_BINT_CLO(arg, "--cache-line", clo_cache_line, 8, 4096) {}
+   else if VG_BINT_CLO(arg, "--reuse-sample", clo_reuse_sample, 1, 1000000) {}
+   else if VG_STR_CLO(arg, "--cache-sizes", tmp_str)
+      parse_cache_sizes(arg, tmp_str);
+   else
+      return False;
+
+   return True;
+}
+
+static void fb_print_usage(void)
+{
+   VG_(printf)(
+"    --hotspots=<n>                 functions and lines in the hotspot report [20]\n"
+"    --callgrind-out-file=<file>    also write the counts in callgrind format, for\n"
+"                                   callgrind_annotate or kcachegrind [none]\n"
+"    --branch-regions=no|yes        count instructions between the br_N/cs_N\n"
+"                                   events of an instrumented program [no]\n"
+"    --collect-atstart=no|yes       count from program start, otherwise only\n"
+"                                   after FOOBAR_START_COUNTING [yes]\n"
+"    --toggle-collect=<function>    count while in <function> and what it calls;\n"
+"                                   wildcards * and ? allowed, may be repeated.\n"
+"                                   Usually with --collect-atstart=no [none]\n"
+"    --instr-mix=no|yes             report loads, stores, exits, integer, FP and\n"
+"                                   SIMD operations and calls, in total and per\n"
+"                                   function [no]\n"
+"    --branch-trace=<file>          trace conditional branches and indirect calls\n"
+"                                   of code with line info, like the branch-trace\n"
+"                                   pass, to <file> and <file>.info [none]\n"
+"    --interval=<n>                 write the instructions of every function each\n"
+"                                   <n> instructions [0, off]\n"
+"    --interval-ms=<n>              the same each <n> milliseconds [0, off]\n"
+"    --interval-out-file=<file>     file for the intervals [foobar.intervals.%%p]\n"
+"    --include-obj=<pattern>        only count code of objects whose path matches\n"
+"    --exclude-obj=<pattern>        do not count code of objects that match\n"
+"    --include-fn=<pattern>         only count code of functions that match\n"
+"    --exclude-fn=<pattern>         do not count code of functions that match;\n"
+"                                   wildcards * and ? allowed, may be repeated\n"
+"    --reuse-distance=no|yes        report the reuse distance of the cache lines\n"
+"                                   of loads and stores per function and line [no]\n"
+"    --cache-line=<n>               cache line size in bytes [64]\n"
+"    --reuse-sample=<n>             track one in <n> cache lines, faster but\n"
+"                                   approximate [1]\n"
+"    --cache-sizes=<list>           predict hits for these cache sizes\n"
+"                                   [32K,1M,32M]\n"
+   );
+}
+
+static void fb_print_debug_usage(void)
+{
+   VG_(printf)("    (none)\n");
+}
+
+
+/*------------------------------------------------------------*/
+/*--- Superblock counters                                  ---*/
+/*------------------------------------------------------------*/
+
+/* A superblock is split at its side exits (Ist_Exit) into segments. All
+   instructions of a segment run together, so one counter per segment,
+   bumped with inline IR, gives exact counts for every instruction. */
+typedef struct {
+   ULong executions;
+   ULong reported;   // executions at the last --interval
+   UInt  first;      // index into SBInfo.instr_addrs
+   UInt  n_instrs;
+} Segment;
+
+/* Kinds of IR operations counted by --instr-mix. */
+typedef enum {
+   MIX_LOAD,
+   MIX_STORE,
+   MIX_EXIT,     // conditional side exits
+   MIX_INT,
+   MIX_FP,
+   MIX_SIMD,
+   MIX_CALL,
+   FB_N_MIX
+} MixKind;
+
+static const HChar* mix_names[FB_N_MIX] = {
+   "loads", "stores", "exits", "int", "fp", "simd", "calls"
+};
+
+/* Keyed by the guest address of the superblock. A superblock that is
+   translated again, e.g. after its translation was discarded, keeps
+   counting into the same node as long as it has the same instructions. */
+typedef struct _SBInfo {
+   struct _SBInfo* next;
+   Addr            addr;
+   UInt            n_instrs;
+   Addr*           instr_addrs;
+   UInt            n_segments;
+   Segment*        segments;
+   // With --instr-mix, FB_N_MIX operation counts per instruction
+   UShort*         mix;
+   // With --interval, the function of each instruction, once looked up
+   struct _FnTotal** instr_fns;
+   // With --interval, set while it is in interval_sbs
+   UInt            interval_marked;
+   // Index of its object in objects
+   UInt            obj;
+} SBInfo;
+
+static VgHashTable* sb_table = NULL;
+
+#if defined(VG_BIGENDIAN)
+#  define FB_ENDIAN Iend_BE
+#elif defined(VG_LITTLEENDIAN)
+#  define FB_ENDIAN Iend_LE
+#else
+#  error "Unknown endianness"
+#endif
+
+/* Adds n to *counter with inline IR: a load, an add and a store, instead
+   of a call to a helper. */
+static void add_counter_update(IRSB* bb_out, ULong* counter, ULong n)
+{
+   IRTemp  old_count = newIRTemp(bb_out->tyenv, Ity_I64);
+   IRTemp  new_count = newIRTemp(bb_out->tyenv, Ity_I64);
+   IRExpr* address   = mkIRExpr_HWord( (HWord)counter );
+
+   addStmtToIRSB(bb_out, IRStmt_WrTmp(old_count, IRExpr_Load(FB_ENDIAN, Ity_I64, address)));
+   addStmtToIRSB(bb_out, IRStmt_WrTmp(new_count,
+                    IRExpr_Binop(Iop_Add64, IRExpr_RdTmp(old_count),
+                                 IRExpr_Const(IRConst_U64(n)))));
+   addStmtToIRSB(bb_out, IRStmt_Store(FB_ENDIAN, address, IRExpr_RdTmp(new_count)));
+}
+
+/* With --interval, the superblocks that ran since the last interval. Each
+   adds itself the first time it runs in an interval, so an interval only
+   visits the code that ran in it. */
+static XArray* interval_sbs = NULL;
+
+static void mark_interval_sb(SBInfo* sb)
+{
+   if (sb->interval_marked)
+      return;
+   sb->interval_marked = 1;
+   VG_(addToXA)(interval_sbs, &sb);
+}
+
+static VG_REGPARM(1) void fb_mark_interval_sb(SBInfo* sb)
+{
+   mark_interval_sb(sb);
+}
+
+/* Calls fb_mark_interval_sb unless sb is marked already, which costs a
+   load and a compare each time the superblock runs. */
+static void add_interval_mark(IRSB* bb_out, SBInfo* sb)
+{
+   IRTemp marked = newIRTemp(bb_out->tyenv, Ity_I32);
+   IRTemp guard  = newIRTemp(bb_out->tyenv, Ity_I1);
+   IRDirty* dirty = unsafeIRDirty_0_N(
+      1, "fb_mark_interval_sb", VG_(fnptr_to_fnentry)(&fb_mark_interval_sb),
+      mkIRExprVec_1(mkIRExpr_HWord((HWord)sb)));
+
+   addStmtToIRSB(bb_out, IRStmt_WrTmp(marked, IRExpr_Load(FB_ENDIAN, Ity_I32,
+                    mkIRExpr_HWord((HWord)&sb->interval_marked))));
+   addStmtToIRSB(bb_out, IRStmt_WrTmp(guard, IRExpr_Binop(Iop_CmpEQ32, IRExpr_RdTmp(marked),
+                    IRExpr_Const(IRConst_U32(0)))));
+   dirty->guard = IRExpr_RdTmp(guard);
+   addStmtToIRSB(bb_out, IRStmt_Dirty(dirty));
+}
+
+static Bool same_sb_layout(const SBInfo* a, const SBInfo* b)
+{
+   UInt i;
+
+   if (a->n_instrs != b->n_instrs || a->n_segments != b->n_segments)
+      return False;
+   for (i = 0; i < a->n_instrs; i++) {
+      if (a->instr_addrs[i] != b->instr_addrs[i])
+         return False;
+   }
+   for (i = 0; i < a->n_segments; i++) {
+      if (a->segments[i].n_instrs != b->segments[i].n_instrs)
+         return False;
+   }
+   return True;
+}
+
+static MixKind classify_type(IRType type)
+{
+   switch (type) {
+   case Ity_F16: case Ity_F32: case Ity_F64: case Ity_F128:
+   case Ity_D32: case Ity_D64: case Ity_D128:
+      return MIX_FP;
+   case Ity_V128: case Ity_V256:
+      return MIX_SIMD;
+   default:
+      return MIX_INT;
+   }
+}
+
+/* Counts the IR operations of every instruction of bb, by the IMark they
+   follow. The counts are static: multiplied by the executions of the
+   segment at exit, they cost nothing while the program runs. */
+static UShort* classify_instrs(IRSB* bb, UInt n_instrs)
+{
+   UShort* mix = VG_(calloc)("fb.sb.mix", (n_instrs ? n_instrs : 1) * FB_N_MIX, sizeof(UShort));
+   UShort* instr = NULL;
+   Int ii;
+
+   for (ii = 0; ii < bb->stmts_used; ii++) {
+      IRStmt *ir_statement = bb->stmts[ii];
+      if (!ir_statement)
+         continue;
+      if (ir_statement->tag == Ist_IMark) {
+         instr = instr ? instr + FB_N_MIX : mix;
+         continue;
+      }
+      // Statements before the first instruction, if any, are not guest code
+      if (!instr)
+         continue;
+
+      switch (ir_statement->tag) {
+      case Ist_WrTmp: {
+         IRExpr* data = ir_statement->Ist.WrTmp.data;
+         switch (data->tag) {
+         case Iex_Load:
+            instr[MIX_LOAD]++;
+            break;
+         case Iex_Unop: case Iex_Binop: case Iex_Triop: case Iex_Qop:
+            instr[classify_type(typeOfIRTemp(bb->tyenv, ir_statement->Ist.WrTmp.tmp))]++;
+            break;
+         case Iex_CCall: case Iex_ITE:
+            instr[MIX_INT]++;
+            break;
+         default:
+            break;
+         }
+         break;
+      }
+      case Ist_LoadG:
+         instr[MIX_LOAD]++;
+         break;
+      case Ist_Store: case Ist_StoreG:
+         instr[MIX_STORE]++;
+         break;
+      case Ist_CAS:
+         instr[MIX_LOAD]++;
+         instr[MIX_STORE]++;
+         break;
+      case Ist_LLSC:
+         instr[ir_statement->Ist.LLSC.storedata ? MIX_STORE : MIX_LOAD]++;
+         break;
+      case Ist_Dirty: {
+         IREffect effect = ir_statement->Ist.Dirty.details->mFx;
+         if (effect == Ifx_Read || effect == Ifx_Modify)
+            instr[MIX_LOAD]++;
+         if (effect == Ifx_Write || effect == Ifx_Modify)
+            instr[MIX_STORE]++;
+         break;
+      }
+      case Ist_Exit:
+         instr[MIX_EXIT]++;
+         if (ir_statement->Ist.Exit.jk == Ijk_Call)
+            instr[MIX_CALL]++;
+         break;
+      default:
+         break;
+      }
+   }
+   if (instr && bb->jumpkind == Ijk_Call)
+      instr[MIX_CALL]++;
+   return mix;
+}
+
+/* Records the instructions and segments of bb. Segments end at a side
+   exit; an exit before any instruction adds none. */
+static SBInfo* get_sb_info(IRSB* bb, Addr addr)
+{
+   SBInfo* existing = VG_(HT_lookup)(sb_table, addr);
+   SBInfo* sb;
+   Int ii;
+   UInt pending = 0;
+
+   sb = VG_(malloc)("fb.sb.1", sizeof(SBInfo));
+   sb->addr       = addr;
+   sb->n_instrs   = 0;
+   sb->n_segments = 0;
+   for (ii = 0; ii < bb->stmts_used; ii++) {
+      IRStmt *ir_statement = bb->stmts[ii];
+      if (!ir_statement)
+         continue;
+      if (ir_statement->tag == Ist_IMark) {
+         sb->n_instrs++;
+         pending++;
+      }
+      if (ir_statement->tag == Ist_Exit && pending > 0) {
+         sb->n_segments++;
+         pending = 0;
+      }
+   }
+   if (pending > 0)
+      sb->n_segments++;
+
+   sb->instr_addrs = VG_(malloc)("fb.sb.2", (sb->n_instrs ? sb->n_instrs : 1) * sizeof(Addr));
+   sb->segments    = VG_(malloc)("fb.sb.3", (sb->n_segments ? sb->n_segments : 1) * sizeof(Segment));
+   sb->n_instrs    = 0;
+   sb->n_segments  = 0;
+   pending         = 0;
+   for (ii = 0; ii < bb->stmts_used; ii++) {
+      IRStmt *ir_statement = bb->stmts[ii];
+      if (!ir_statement)
+         continue;
+      if (ir_statement->tag == Ist_IMark) {
+         sb->instr_addrs[sb->n_instrs++] = ir_statement->Ist.IMark.addr;
+         pending++;
+      }
+      if (ir_statement->tag == Ist_Exit && pending > 0) {
+         Segment* segment = &sb->segments[sb->n_segments++];
+         segment->executions = 0;
+         segment->reported   = 0;
+         segment->first      = sb->n_instrs - pending;
+         segment->n_instrs   = pending;
+         pending = 0;
+      }
+   }
+   if (pending > 0) {
+      Segment* segment = &sb->segments[sb->n_segments++];
+      segment->executions = 0;
+      segment->reported   = 0;
+      segment->first      = sb->n_instrs - pending;
+      segment->n_instrs   = pending;
+   }
+
+   if (existing && same_sb_layout(existing, sb)) {
+      if (clo_instr_mix && !existing->mix)
+         existing->mix = classify_instrs(bb, existing->n_instrs);
+      VG_(free)(sb->segments);
+      VG_(free)(sb->instr_addrs);
+      VG_(free)(sb);
+      return existing;
+   }
+   // Otherwise a second node with the same key, the old one keeps its counts
+   sb->mix = clo_instr_mix ? classify_instrs(bb, sb->n_instrs) : NULL;
+   sb->instr_fns       = NULL;
+   sb->interval_marked = 0;
+   sb->obj             = 0;
+   VG_(HT_add_node)(sb_table, sb);
+   return sb;
+}
+
+
+/*------------------------------------------------------------*/
+/*--- Object and function filters                          ---*/
+/*------------------------------------------------------------*/
+
+/* Every object code was translated from, e.g. the program, ld.so and
+   libc, in the order they were first seen. */
+typedef struct {
+   const HChar* name;
+   ULong        instructions;
+} ObjInfo;
+
+static XArray* objects  = NULL;
+static UInt    last_obj = 0;
+
+static UInt get_obj(const HChar* name)
+{
+   Word i;
+   ObjInfo obj;
+
+   if (VG_(sizeXA)(objects) > 0 &&
+       VG_(strcmp)(((ObjInfo*)VG_(indexXA)(objects, last_obj))->name, name) == 0)
+      return last_obj;
+   for (i = 0; i < VG_(sizeXA)(objects); i++) {
+      if (VG_(strcmp)(((ObjInfo*)VG_(indexXA)(objects, i))->name, name) == 0)
+         return last_obj = i;
+   }
+   obj.name         = VG_(strdup)("fb.obj", name);
+   obj.instructions = 0;
+   return last_obj = VG_(addToXA)(objects, &obj);
+}
+
+/* Whether the superblock at addr is counted is decided when it is
+   translated, by the object it is in and the function it starts in.
+   Code that is filtered out gets no counters at all and runs at the
+   speed of an uninstrumented Valgrind run. */
+static Bool is_selected(Addr addr, UInt* obj)
+{
+   DiEpoch ep = VG_(current_DiEpoch)();
+   const HChar* name;
+
+   if (!VG_(get_objname)(ep, addr, &name))
+      name = "???";
+   *obj = get_obj(name);
+   if (clo_include_obj.n > 0 && !match_pattern(&clo_include_obj, name))
+      return False;
+   if (match_pattern(&clo_exclude_obj, name))
+      return False;
+   if (clo_include_fn.n == 0 && clo_exclude_fn.n == 0)
+      return True;
+
+   if (!VG_(get_fnname)(ep, addr, &name))
+      name = "???";
+   if (clo_include_fn.n > 0 && !match_pattern(&clo_include_fn, name))
+      return False;
+   return !match_pattern(&clo_exclude_fn, name);
+}
+
+
+/*------------------------------------------------------------*/
+/*--- Per-thread counts                                    ---*/
+/*------------------------------------------------------------*/
+
+/* Valgrind runs one guest thread at a time. The inline adds update a
+   single running count for whichever thread runs, and it is swapped with
+   that thread's own count when another thread starts running. Counting
+   therefore touches no state shared between threads and costs the same
+   for any number of them. */
+typedef struct {
+   Bool  seen;
+   ULong instructions;
+   // Branch regions of the thread
+   UInt  last_event;
+   ULong region_start;
+} ThreadCounts;
+
+// VG_N_THREADS entries, indexed by thread id
+static ThreadCounts* thread_counts = NULL;
+static ULong        running_instructions = 0;
+static ThreadId     running_tid          = VG_INVALID_THREADID;
+
+static void switch_thread(ThreadId tid)
+{
+   if (tid == running_tid)
+      return;
+   if (running_tid != VG_INVALID_THREADID)
+      thread_counts[running_tid].instructions = running_instructions;
+   running_instructions     = thread_counts[tid].instructions;
+   thread_counts[tid].seen  = True;
+   running_tid              = tid;
+}
+
+static void print_threads(void)
+{
+   ULong total = 0, max = 0, min = 0;
+   UInt n = 0;
+   ThreadId tid;
+
+   for (tid = 1; tid < VG_N_THREADS; tid++) {
+      ULong instructions = thread_counts[tid].instructions;
+      if (!thread_counts[tid].seen)
+         continue;
+      if (n == 0 || instructions > max)
+         max = instructions;
+      if (n == 0 || instructions < min)
+         min = instructions;
+      total += instructions;
+      n++;
+   }
+   if (n < 2)
+      return;
+
+   VG_(umsg)("\n");
+   VG_(umsg)("Instructions by thread:\n");
+   for (tid = 1; tid < VG_N_THREADS; tid++) {
+      ULong permille;
+      if (!thread_counts[tid].seen)
+         continue;
+      permille = total ? thread_counts[tid].instructions * 1000 / total : 0;
+      VG_(umsg)("   thread %3u %16llu %3llu.%llu%%\n", tid, thread_counts[tid].instructions,
+                permille / 10, permille % 10);
+   }
+   // With perfect balance every thread runs total / n instructions. No
+   // thread counted anything if collection never started or the filters
+   // matched nothing.
+   if (total == 0)
+      VG_(umsg)("Imbalance: n/a, no instructions were counted\n");
+   else
+      VG_(umsg)("Imbalance: the busiest thread ran %llu.%02llu times the mean, the least busy %llu.%02llu\n",
+                max * n / total, max * n * 100 / total % 100, min * n / total, min * n * 100 / total % 100);
+}
+
+
+/*------------------------------------------------------------*/
+/*--- Branch regions                                       ---*/
+/*------------------------------------------------------------*/
+
+/* A region runs from one br_N/cs_N event of the guest, a call to LogBranch
+   or LogPointer, to the next one. Events are coded as id << 1 | kind;
+   br_0 and cs_0 do not exist, so those codes stand for program start and
+   exit. */
+#define EVENT_BRANCH  0
+#define EVENT_POINTER 1
+#define EVENT_START   0
+#define EVENT_EXIT    1
+/* Entries that register a module's ids rather than log an event */
+#define REGISTER_BRANCHES  2
+#define REGISTER_CALLSITES 3
+
+/* liblogger gives every module a base for its ids in LogRegisterBranches
+   and LogRegisterCallSites (see logger.c), and LogBranch and LogPointer get
+   the base plus the module's id. The same bases are worked out here from
+   the records the modules register, so the report can print the id of the
+   module's branch_info.txt and its file, as the trace does. */
+typedef struct {
+   UInt  base;
+   Int   count;
+   Addr  records;
+} IdTable;
+
+/* struct BranchRecord and struct CallSiteRecord of logger.c: the id is
+   the first int and the file the pointer after it, 24 bytes in all. */
+#define ID_RECORD_SIZE      24
+#define ID_RECORD_FILEPATH  8
+
+static XArray* branch_id_tables   = NULL;
+static XArray* callsite_id_tables = NULL;
+static UInt    branch_ids         = 0;
+static UInt    callsite_ids       = 0;
+
+/* Keyed by the event a region starts at, or by from << 32 | to for the
+   regions between a pair of events. */
+typedef struct _RegionCount {
+   struct _RegionCount* next;
+   UWord                key;
+   ULong                regions;
+   ULong                instructions;
+} RegionCount;
+
+static VgHashTable* event_regions = NULL;
+static VgHashTable* pair_regions  = NULL;
+
+static void add_region(VgHashTable* table, UWord key, ULong instructions)
+{
+   RegionCount* region = VG_(HT_lookup)(table, key);
+
+   if (!region) {
+      region = VG_(malloc)("fb.region", sizeof(RegionCount));
+      region->key          = key;
+      region->regions      = 0;
+      region->instructions = 0;
+      VG_(HT_add_node)(table, region);
+   }
+   region->regions++;
+   region->instructions += instructions;
+}
+
+/* Regions are per thread, events of other threads do not split them. */
+static void end_region(ThreadCounts* thread, ULong instructions_now, UInt event)
+{
+   ULong instructions = instructions_now - thread->region_start;
+
+   add_region(event_regions, thread->last_event, instructions);
+   add_region(pair_regions, (UWord)((ULong)thread->last_event << 32 | event), instructions);
+   thread->last_event   = event;
+   thread->region_start = instructions_now;
+}
+
+/* Called at the entry of LogBranch(id) and LogPointer(fn, id). */
+static VG_REGPARM(2) void fb_log_event(UWord kind, UWord id)
+{
+   end_region(&thread_counts[running_tid], running_instructions, (UInt)id << 1 | (UInt)kind);
+}
+
+/* Called at the entry of LogRegisterBranches/LogRegisterCallSites(records,
+   count). Does what they do to the base, the records are client memory. */
+static VG_REGPARM(3) void fb_register_ids(UWord kind, UWord records, UWord count)
+{
+   XArray* tables = kind == REGISTER_BRANCHES ? branch_id_tables : callsite_id_tables;
+   UInt*   ids    = kind == REGISTER_BRANCHES ? &branch_ids : &callsite_ids;
+   IdTable table;
+   Int i, max_id = 0;
+
+   table.base    = *ids;
+   table.count   = (Int)count;
+   table.records = (Addr)records;
+   for (i = 0; i < table.count; i++) {
+      Int id = *(Int*)(table.records + (Addr)i * ID_RECORD_SIZE);
+      if (id > max_id)
+         max_id = id;
+   }
+   VG_(addToXA)(tables, &table);
+   *ids = table.base + max_id + 1;
+}
+
+/* Is addr the first instruction of LogBranch or LogPointer? */
+static Bool is_event_entry(Addr addr, UWord* kind)
+{
+   const HChar* fn;
+
+   if (!VG_(get_fnname_if_entry)(VG_(current_DiEpoch)(), addr, &fn))
+      return False;
+   if (VG_(strcmp)(fn, "LogBranch") == 0)
+      *kind = EVENT_BRANCH;
+   else if (VG_(strcmp)(fn, "LogPointer") == 0)
+      *kind = EVENT_POINTER;
+   else if (VG_(strcmp)(fn, "LogRegisterBranches") == 0)
+      *kind = REGISTER_BRANCHES;
+   else if (VG_(strcmp)(fn, "LogRegisterCallSites") == 0)
+      *kind = REGISTER_CALLSITES;
+   else
+      return False;
+   return True;
+}
+
+#if defined(FB_GUEST_ARG1)
+/* Passes the id argument, still in its register at the entry, to
+   fb_log_event, or both arguments of a registration to fb_register_ids. */
+static void add_event_call(IRSB* bb_out, UWord kind)
+{
+   Int id_register = kind == EVENT_BRANCH ? FB_GUEST_ARG1 : FB_GUEST_ARG2;
+   IRTemp id = newIRTemp(bb_out->tyenv, Ity_I64);
+   IRTemp records;
+   IRDirty* dirty;
+
+   if (kind == REGISTER_BRANCHES || kind == REGISTER_CALLSITES) {
+      records = newIRTemp(bb_out->tyenv, Ity_I64);
+      dirty = unsafeIRDirty_0_N(
+         3, "fb_register_ids", VG_(fnptr_to_fnentry)(&fb_register_ids),
+         mkIRExprVec_3(mkIRExpr_HWord(kind), IRExpr_RdTmp(records), IRExpr_RdTmp(id)));
+      addStmtToIRSB(bb_out, IRStmt_WrTmp(records, IRExpr_Get(FB_GUEST_ARG1, Ity_I64)));
+      addStmtToIRSB(bb_out, IRStmt_WrTmp(id, IRExpr_Get(FB_GUEST_ARG2, Ity_I64)));
+      addStmtToIRSB(bb_out, IRStmt_Dirty(dirty));
+      return;
+   }
+   dirty = unsafeIRDirty_0_N(
+      2, "fb_log_event", VG_(fnptr_to_fnentry)(&fb_log_event),
+      mkIRExprVec_2(mkIRExpr_HWord(kind), IRExpr_RdTmp(id)));
+   // Helper arguments must be temporaries or constants
+   addStmtToIRSB(bb_out, IRStmt_WrTmp(id, IRExpr_Get(id_register, Ity_I64)));
+   addStmtToIRSB(bb_out, IRStmt_Dirty(dirty));
+}
+#else
+static void add_event_call(IRSB* bb_out, UWord kind)
+{
+   tl_assert(0);
+}
+#endif
+
+/* Prints an event as "br_N file" with the N of the module's branch_info.txt.
+   Tables are added in the order of their bases, the last one at or below
+   the id is the module's. */
+static void format_event(UInt event, HChar* buf, Int size)
+{
+   XArray* tables = (event & 1) == EVENT_BRANCH ? branch_id_tables : callsite_id_tables;
+   const HChar* kind = (event & 1) == EVENT_BRANCH ? "br" : "cs";
+   UInt id = event >> 1;
+   IdTable* table = NULL;
+   Word i;
+   Int j;
+
+   if (event == EVENT_START) {
+      VG_(snprintf)(buf, size, "start");
+      return;
+   }
+   if (event == EVENT_EXIT) {
+      VG_(snprintf)(buf, size, "exit");
+      return;
+   }
+   for (i = 0; i < VG_(sizeXA)(tables); i++) {
+      IdTable* candidate = VG_(indexXA)(tables, i);
+      if (candidate->base > id)
+         break;
+      table = candidate;
+   }
+   if (!table) {
+      VG_(snprintf)(buf, size, "%s_%u", kind, id);
+      return;
+   }
+   for (j = 0; j < table->count; j++) {
+      Addr record = table->records + (Addr)j * ID_RECORD_SIZE;
+      if (*(Int*)record == (Int)(id - table->base)) {
+         VG_(snprintf)(buf, size, "%s_%u %s", kind, id - table->base,
+                       *(const HChar**)(record + ID_RECORD_FILEPATH));
+         return;
+      }
+   }
+   VG_(snprintf)(buf, size, "%s_%u", kind, id - table->base);
+}
+
+static Int compare_region_instructions(const void* a, const void* b)
+{
+   ULong x = (*(RegionCount* const*)a)->instructions, y = (*(RegionCount* const*)b)->instructions;
+   return (x < y) - (x > y);
+}
+
+static void print_regions(const HChar* title, VgHashTable* table, Bool pairs)
+{
+   UInt n, i;
+   RegionCount** regions = (RegionCount**)VG_(HT_to_array)(table, &n);
+   HChar from[256], to[256];
+
+   VG_(ssort)(regions, n, sizeof(RegionCount*), compare_region_instructions);
+   VG_(umsg)("\n");
+   VG_(umsg)("%s\n", title);
+   for (i = 0; i < n && i < (UInt)clo_hotspots; i++) {
+      RegionCount* region = regions[i];
+      format_event(pairs ? (ULong)region->key >> 32 : region->key, from, sizeof(from));
+      if (pairs) {
+         format_event(region->key & 0xFFFFFFFF, to, sizeof(to));
+         VG_(umsg)("%16llu %10llu x %10llu  %s -> %s\n", region->instructions, region->regions,
+                   region->instructions / region->regions, from, to);
+      } else {
+         VG_(umsg)("%16llu %10llu x %10llu  %s\n", region->instructions, region->regions,
+                   region->instructions / region->regions, from);
+      }
+   }
+   VG_(free)(regions);
+}
+
+/*------------------------------------------------------------*/
+/*--- Branch trace                                         ---*/
+/*------------------------------------------------------------*/
+
+/* --branch-trace gives the trace of the branch-trace pass for programs
+   that were not built with it. Conditional exits become br_N edges,
+   indirect calls cs_N sites with a fn_N target. The trace is made of
+   32-bit words in host byte order. Events are one or two words:
+
+      br_N                   N << 2
+      cs_N calls fn_M        N << 2 | 1, then M << 2 | 2
+
+   Every word carries its kind, so a reader can start decoding at any
+   word, which lets a decoder split the trace between threads.
+
+   After a two word header, the file is a sequence of chunks, one per
+   buffer that is written. Each starts with a FB_CHUNK_WORDS header:
+
+      0       FB_CHUNK_MAGIC
+      1       the number of event words that follow
+      2       the number of events in them
+      3       0
+      4, 5    the number of events before the chunk
+      6, 7    the millisecond timer at the first event
+      8, 9    the millisecond timer at the last event
+      10..    a bitmap of FB_SUMMARY_BITS bits, with bit N mod
+              FB_SUMMARY_BITS set for every br_N and cs_N in the chunk
+
+   At exit a sparse index follows the last chunk: FB_INDEX_MAGIC, the
+   number of chunks, and the file offset, first event and first time of
+   each chunk, as 64-bit values. The last four words of the file are the
+   offset of the index, the number of chunks and FB_INDEX_MAGIC, so a
+   reader finds any event or time in O(log n) and skips the chunks whose
+   bitmap does not have a branch. If the program dies before the index
+   is written, the chunk headers can still be walked one by one.
+
+   At exit <file>.info gets the br_N, cs_N and fn_N lines, in the format
+   of branch_info.txt. Only code with line info is traced, which leaves
+   out the PLT and libraries without debug info. */
+#define FB_TRACE_MAGIC   0x52544246   // "FBTR"
+#define FB_TRACE_VERSION 3
+#define FB_CHUNK_MAGIC   0x4b434246   // "FBCK"
+#define FB_INDEX_MAGIC   0x58494246   // "FBIX"
+#define FB_SUMMARY_BITS  2048
+#define FB_CHUNK_WORDS   (10 + FB_SUMMARY_BITS / 32)
+#define FB_TRACE_WORDS   16384
+
+/* br_N between two guest instructions, or, for an indirect jump to the
+   entry of a function, cs_N at the jump. Keyed by a hash of both. */
+typedef struct _TraceEdge {
+   struct _TraceEdge* next;
+   UWord              key;
+   Addr               src;
+   Addr               dest;
+   UInt               id;
+   Bool               pointer;
+} TraceEdge;
+
+/* A cs_N site or a fn_N target, keyed by its address. */
+typedef struct _TraceId {
+   struct _TraceId* next;
+   Addr             addr;
+   UInt             id;
+} TraceId;
+
+static VgHashTable* trace_edges   = NULL;
+static VgHashTable* trace_sites   = NULL;
+static VgHashTable* trace_targets = NULL;
+static UInt n_trace_edges = 0, n_trace_sites = 0, n_trace_targets = 0;
+
+/* An entry of the index at the end of the trace. */
+typedef struct {
+   ULong offset;
+   ULong first_event;
+   ULong first_time;
+} TraceChunkIndex;
+
+/* The chunk being filled: its header, then the event words. */
+static UInt     trace_buf[FB_CHUNK_WORDS + FB_TRACE_WORDS];
+static UInt     trace_used   = 0;
+static UInt     trace_events = 0;
+static ULong    trace_total_events = 0;
+static ULong    trace_offset = 0;
+static XArray*  trace_index  = NULL;
+static Int      trace_fd     = -1;
+static HChar*   trace_path   = NULL;
+
+static void write_trace(const void* data, SizeT size)
+{
+   VG_(write)(trace_fd, data, size);
+   trace_offset += size;
+}
+
+static void put_trace_ulong(UInt* words, ULong value)
+{
+   VG_(memcpy)(words, &value, sizeof(ULong));
+}
+
+static void flush_trace(void)
+{
+   TraceChunkIndex entry;
+   ULong last_time;
+
+   if (trace_used == 0)
+      return;
+   last_time = VG_(read_millisecond_timer)();
+   VG_(memcpy)(&entry.first_time, &trace_buf[6], sizeof(ULong));
+   entry.offset      = trace_offset;
+   entry.first_event = trace_total_events;
+   VG_(addToXA)(trace_index, &entry);
+
+   trace_buf[0] = FB_CHUNK_MAGIC;
+   trace_buf[1] = trace_used;
+   trace_buf[2] = trace_events;
+   trace_buf[3] = 0;
+   put_trace_ulong(&trace_buf[4], trace_total_events);
+   put_trace_ulong(&trace_buf[8], last_time);
+   write_trace(trace_buf, (FB_CHUNK_WORDS + trace_used) * sizeof(UInt));
+
+   trace_total_events += trace_events;
+   trace_used   = 0;
+   trace_events = 0;
+}
+
+/* Makes room for an event of n words, so that events do not span chunks,
+   and counts it. The first event of a chunk sets its start time. */
+static UInt* trace_event(UInt n, UInt id)
+{
+   UInt* words;
+
+   if (trace_used + n > FB_TRACE_WORDS)
+      flush_trace();
+   if (trace_used == 0) {
+      VG_(memset)(trace_buf, 0, FB_CHUNK_WORDS * sizeof(UInt));
+      put_trace_ulong(&trace_buf[6], VG_(read_millisecond_timer)());
+   }
+   trace_buf[10 + id % FB_SUMMARY_BITS / 32] |= 1u << (id % 32);
+   words = &trace_buf[FB_CHUNK_WORDS + trace_used];
+   trace_used += n;
+   trace_events++;
+   return words;
+}
+
+static void write_trace_index(void)
+{
+   Word i, n = VG_(sizeXA)(trace_index);
+   ULong index_offset = trace_offset;
+   UInt words[4];
+
+   words[0] = FB_INDEX_MAGIC;
+   words[1] = (UInt)n;
+   write_trace(words, 2 * sizeof(UInt));
+   for (i = 0; i < n; i++)
+      write_trace(VG_(indexXA)(trace_index, i), sizeof(TraceChunkIndex));
+   put_trace_ulong(&words[0], index_offset);
+   words[2] = (UInt)n;
+   words[3] = FB_INDEX_MAGIC;
+   write_trace(words, sizeof(words));
+}
+
+static Word compare_edge(const void* a, const void* b)
+{
+   const TraceEdge *x = a, *y = b;
+   return x->src != y->src || x->dest != y->dest;
+}
+
+static TraceEdge* get_trace_edge(Addr src, Addr dest, Bool* is_new)
+{
+   TraceEdge probe, *edge;
+
+   probe.key  = src ^ (dest << 7) ^ (dest >> 3);
+   probe.src  = src;
+   probe.dest = dest;
+   edge = VG_(HT_gen_lookup)(trace_edges, &probe, compare_edge);
+   *is_new = edge == NULL;
+   if (!edge) {
+      edge = VG_(malloc)("fb.trace_edge", sizeof(TraceEdge));
+      *edge = probe;
+      edge->id      = 0;
+      edge->pointer = False;
+      VG_(HT_add_node)(trace_edges, edge);
+   }
+   return edge;
+}
+
+static UInt get_trace_id(VgHashTable* table, UInt* counter, Addr addr)
+{
+   TraceId* node = VG_(HT_lookup)(table, addr);
+
+   if (!node) {
+      node = VG_(malloc)("fb.trace_id", sizeof(TraceId));
+      node->addr = addr;
+      node->id   = ++*counter;
+      VG_(HT_add_node)(table, node);
+   }
+   return node->id;
+}
+
+/* br_N ids of conditional exits are known when the code is translated. */
+static UInt get_branch_id(Addr src, Addr dest)
+{
+   Bool is_new;
+   TraceEdge* edge = get_trace_edge(src, dest, &is_new);
+
+   if (is_new)
+      edge->id = ++n_trace_edges;
+   return edge->id;
+}
+
+static VG_REGPARM(1) void fb_trace_branch(UWord id)
+{
+   *trace_event(1, (UInt)id) = (UInt)id << 2;
+}
+
+static VG_REGPARM(2) void fb_trace_call(UWord site, UWord target)
+{
+   UInt* words = trace_event(2, (UInt)site);
+   words[0] = (UInt)site << 2 | 1;
+   words[1] = get_trace_id(trace_targets, &n_trace_targets, target) << 2 | 2;
+}
+
+/* Jumps to the entry of a function are tail calls through a pointer,
+   other indirect jumps, e.g. through a jump table, are branch edges. */
+static VG_REGPARM(2) void fb_trace_jump(UWord src, UWord target)
+{
+   Bool is_new;
+   TraceEdge* edge = get_trace_edge(src, target, &is_new);
+
+   if (is_new) {
+      const HChar* fn;
+      edge->pointer = VG_(get_fnname_if_entry)(VG_(current_DiEpoch)(), target, &fn);
+      edge->id = edge->pointer ? get_trace_id(trace_sites, &n_trace_sites, src) : ++n_trace_edges;
+   }
+   if (edge->pointer)
+      fb_trace_call(edge->id, target);
+   else
+      fb_trace_branch(edge->id);
+}
+
+static Bool has_line_info(Addr addr)
+{
+   UInt line;
+   return VG_(get_linenum)(VG_(current_DiEpoch)(), addr, &line);
+}
+
+static Addr const_addr(const IRConst* con)
+{
+   return con->tag == Ico_U32 ? (Addr)con->Ico.U32 : (Addr)con->Ico.U64;
+}
+
+static void add_branch_call(IRSB* bb_out, UInt id, IRExpr* guard)
+{
+   IRDirty* dirty = unsafeIRDirty_0_N(
+      1, "fb_trace_branch", VG_(fnptr_to_fnentry)(&fb_trace_branch),
+      mkIRExprVec_1(mkIRExpr_HWord(id)));
+   if (guard)
+      dirty->guard = guard;
+   addStmtToIRSB(bb_out, IRStmt_Dirty(dirty));
+}
+
+/* The edges of the conditional exit bb->stmts[ii] in the instruction at
+   src: to its target, and to where the superblock goes on otherwise,
+   which VEX may have swapped. False if the exit is not traced. */
+static Bool get_exit_edges(IRSB* bb, Int ii, Addr src, UInt* taken, UInt* not_taken)
+{
+   IRStmt* exit = bb->stmts[ii];
+   Addr dest = const_addr(exit->Ist.Exit.dst);
+   Addr next = 0;
+   Int jj;
+
+   // Others are e.g. signals, and the loop of a rep prefix jumps to itself
+   if (exit->Ist.Exit.jk != Ijk_Boring || dest == src || !has_line_info(src))
+      return False;
+   for (jj = ii + 1; jj < bb->stmts_used && !next; jj++) {
+      if (bb->stmts[jj] && bb->stmts[jj]->tag == Ist_IMark)
+         next = bb->stmts[jj]->Ist.IMark.addr;
+   }
+   if (!next && bb->next->tag == Iex_Const)
+      next = const_addr(bb->next->Iex.Const.con);
+   if (!next)
+      return False;
+
+   *taken     = get_branch_id(src, dest);
+   *not_taken = get_branch_id(src, next);
+   return True;
+}
+
+/* An indirect call or jump at the end of the superblock, from src. */
+static void add_indirect_call(IRSB* bb, IRSB* bb_out, Addr src)
+{
+   IRDirty* dirty;
+
+   if (bb->next->tag == Iex_Const || !has_line_info(src))
+      return;
+   if (bb->jumpkind == Ijk_Call) {
+      UInt site = get_trace_id(trace_sites, &n_trace_sites, src);
+      dirty = unsafeIRDirty_0_N(
+         2, "fb_trace_call", VG_(fnptr_to_fnentry)(&fb_trace_call),
+         mkIRExprVec_2(mkIRExpr_HWord(site), bb->next));
+   } else if (bb->jumpkind == Ijk_Boring) {
+      dirty = unsafeIRDirty_0_N(
+         2, "fb_trace_jump", VG_(fnptr_to_fnentry)(&fb_trace_jump),
+         mkIRExprVec_2(mkIRExpr_HWord(src), bb->next));
+   } else {
+      return;
+   }
+   addStmtToIRSB(bb_out, IRStmt_Dirty(dirty));
+}
+
+static void open_branch_trace(void)
+{
+   UInt header[2] = { FB_TRACE_MAGIC, FB_TRACE_VERSION };
+   SysRes sres;
+
+   trace_path = VG_(expand_file_name)("--branch-trace", clo_branch_trace);
+   sres = VG_(open)(trace_path, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY, VKI_S_IRUSR|VKI_S_IWUSR);
+   if (sr_isError(sres))
+      VG_(fmsg_bad_option)("--branch-trace", "Can not open '%s'.\n", trace_path);
+   trace_fd = sr_Res(sres);
+   trace_edges   = VG_(HT_construct)("fb.trace_edges");
+   trace_sites   = VG_(HT_construct)("fb.trace_sites");
+   trace_targets = VG_(HT_construct)("fb.trace_targets");
+   trace_index   = VG_(newXA)(VG_(malloc), "fb.trace_index", VG_(free), sizeof(TraceChunkIndex));
+   write_trace(header, sizeof(header));
+}
+
+static Int compare_trace_id(const void* a, const void* b)
+{
+   UInt x = (*(TraceId* const*)a)->id, y = (*(TraceId* const*)b)->id;
+   return (x > y) - (x < y);
+}
+
+static Int compare_trace_edge_id(const void* a, const void* b)
+{
+   UInt x = (*(TraceEdge* const*)a)->id, y = (*(TraceEdge* const*)b)->id;
+   return (x > y) - (x < y);
+}
+
+static void location(Addr addr, const HChar** file, UInt* line)
+{
+   const HChar* dir;
+   if (!VG_(get_filename_linenum)(VG_(current_DiEpoch)(), addr, file, &dir, line)) {
+      *file = "???";
+      *line = 0;
+   }
+}
+
+static void close_branch_trace(void)
+{
+   HChar* info_path = VG_(malloc)("fb.trace_info", VG_(strlen)(trace_path) + 6);
+   VgFile* file;
+   UInt n, i;
+   TraceEdge** edges;
+   TraceId** ids;
+
+   flush_trace();
+   write_trace_index();
+   VG_(close)(trace_fd);
+
+   VG_(sprintf)(info_path, "%s.info", trace_path);
+   file = VG_(fopen)(info_path, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY, VKI_S_IRUSR|VKI_S_IWUSR);
+   if (!file) {
+      VG_(umsg)("Error: can not open branch trace info file '%s'\n", info_path);
+      VG_(free)(info_path);
+      return;
+   }
+
+   // Names are only valid until the next lookup, only the line of the
+   // destination is kept
+   edges = (TraceEdge**)VG_(HT_to_array)(trace_edges, &n);
+   VG_(ssort)(edges, n, sizeof(TraceEdge*), compare_trace_edge_id);
+   for (i = 0; i < n; i++) {
+      const HChar *src_file, *dest_file;
+      UInt src_line, dest_line;
+      if (edges[i]->pointer)
+         continue;
+      location(edges[i]->dest, &dest_file, &dest_line);
+      location(edges[i]->src, &src_file, &src_line);
+      VG_(fprintf)(file, "br_%u: %s, %u, %u\n", edges[i]->id, src_file, src_line, dest_line);
+   }
+   VG_(free)(edges);
+
+   ids = (TraceId**)VG_(HT_to_array)(trace_sites, &n);
+   VG_(ssort)(ids, n, sizeof(TraceId*), compare_trace_id);
+   for (i = 0; i < n; i++) {
+      const HChar* src_file;
+      UInt src_line;
+      location(ids[i]->addr, &src_file, &src_line);
+      VG_(fprintf)(file, "cs_%u: %s, %u\n", ids[i]->id, src_file, src_line);
+   }
+   VG_(free)(ids);
+
+   ids = (TraceId**)VG_(HT_to_array)(trace_targets, &n);
+   VG_(ssort)(ids, n, sizeof(TraceId*), compare_trace_id);
+   for (i = 0; i < n; i++) {
+      const HChar *fn, *fn_file;
+      UInt fn_line;
+      location(ids[i]->addr, &fn_file, &fn_line);
+      if (!VG_(get_fnname)(VG_(current_DiEpoch)(), ids[i]->addr, &fn))
+         fn = "???";
+      VG_(fprintf)(file, "fn_%u: %s, %s, %u\n", ids[i]->id, fn, fn_file, fn_line);
+   }
+   VG_(free)(ids);
+
+   VG_(fclose)(file);
+   VG_(free)(info_path);
+}
+
+
+/*------------------------------------------------------------*/
+/*--- Reuse distance                                       ---*/
+/*------------------------------------------------------------*/
+
+/* The reuse distance of an access is the number of distinct cache lines
+   touched since the previous access to its line. A fully associative LRU
+   cache of C lines hits exactly the accesses with a distance below C.
+
+   Every line has the time of its last access, and a Fenwick tree over
+   the times has a 1 at each of them, so the distance is the sum over the
+   times in between: O(log n) per access. When the times reach the size
+   of the tree they are renumbered in order, and the tree grows once more
+   than half of it is in use.
+
+   With --reuse-sample=<n> only lines whose hash is 0 modulo n are
+   tracked, and their distances are multiplied by n. */
+#define FB_REUSE_BUCKETS 42   // 0, then [2^(b-1), 2^b) for b = 1..40, then cold
+#define FB_REUSE_COLD    (FB_REUSE_BUCKETS - 1)
+
+/* Histogram of the accesses of one instruction, keyed by its address. */
+typedef struct _ReuseSite {
+   struct _ReuseSite* next;
+   Addr               addr;
+   ULong              buckets[FB_REUSE_BUCKETS];
+} ReuseSite;
+
+typedef struct _LineTime {
+   struct _LineTime* next;
+   UWord             line;
+   UWord             time;
+} LineTime;
+
+static VgHashTable* reuse_sites = NULL;
+static VgHashTable* line_times  = NULL;
+static UInt*  reuse_tree      = NULL;   // 1-based
+static UWord  reuse_tree_size = 1 << 20;
+static UWord  reuse_now       = 0;
+static UInt   line_shift      = 0;
+
+static void tree_add(UWord time, Int delta)
+{
+   UWord i;
+   for (i = time + 1; i <= reuse_tree_size; i += i & -i)
+      reuse_tree[i] += delta;
+}
+
+/* Lines last used before time. */
+static UWord tree_sum(UWord time)
+{
+   UWord i, sum = 0;
+   for (i = time; i > 0; i -= i & -i)
+      sum += reuse_tree[i];
+   return sum;
+}
+
+static Int compare_line_time(const void* a, const void* b)
+{
+   UWord x = (*(LineTime* const*)a)->time, y = (*(LineTime* const*)b)->time;
+   return (x > y) - (x < y);
+}
+
+static void compact_times(void)
+{
+   UInt n, i;
+   LineTime** lines = (LineTime**)VG_(HT_to_array)(line_times, &n);
+
+   VG_(ssort)(lines, n, sizeof(LineTime*), compare_line_time);
+   if (n > reuse_tree_size / 2) {
+      reuse_tree_size *= 2;
+      VG_(free)(reuse_tree);
+      reuse_tree = VG_(malloc)("fb.reuse_tree", (reuse_tree_size + 1) * sizeof(UInt));
+   }
+   VG_(memset)(reuse_tree, 0, (reuse_tree_size + 1) * sizeof(UInt));
+   for (i = 0; i < n; i++) {
+      lines[i]->time = i;
+      tree_add(i, 1);
+   }
+   reuse_now = n;
+   VG_(free)(lines);
+}
+
+static UInt distance_bucket(ULong distance)
+{
+   UInt bucket = 0;
+
+   while (distance > 0 && bucket < FB_REUSE_COLD - 1) {
+      distance >>= 1;
+      bucket++;
+   }
+   return bucket;
+}
+
+static VG_REGPARM(2) void fb_reuse_access(Addr addr, ReuseSite* site)
+{
+   UWord line = addr >> line_shift;
+   LineTime* node;
+
+   if (clo_reuse_sample > 1 &&
+       (((ULong)line * 0x9E3779B97F4A7C15ULL) >> 40) % clo_reuse_sample != 0)
+      return;
+   if (reuse_now == reuse_tree_size)
+      compact_times();
+
+   node = VG_(HT_lookup)(line_times, line);
+   if (node) {
+      ULong distance = (ULong)(tree_sum(reuse_now) - tree_sum(node->time + 1)) * clo_reuse_sample;
+      site->buckets[distance_bucket(distance)]++;
+      tree_add(node->time, -1);
+   } else {
+      node = VG_(malloc)("fb.line_time", sizeof(LineTime));
+      node->line = line;
+      VG_(HT_add_node)(line_times, node);
+      site->buckets[FB_REUSE_COLD]++;
+   }
+   node->time = reuse_now++;
+   tree_add(node->time, 1);
+}
+
+static ReuseSite* get_reuse_site(Addr addr)
+{
+   ReuseSite* site = VG_(HT_lookup)(reuse_sites, addr);
+
+   if (!site) {
+      site = VG_(calloc)("fb.reuse_site", 1, sizeof(ReuseSite));
+      site->addr = addr;
+      VG_(HT_add_node)(reuse_sites, site);
+   }
+   return site;
+}
+
+static void add_reuse_call(IRSB* bb_out, IRExpr* addr, Addr instr_addr, IRExpr* guard)
+{
+   IRDirty* dirty = unsafeIRDirty_0_N(
+      2, "fb_reuse_access", VG_(fnptr_to_fnentry)(&fb_reuse_access),
+      mkIRExprVec_2(addr, mkIRExpr_HWord((HWord)get_reuse_site(instr_addr))));
+   if (guard)
+      dirty->guard = guard;
+   addStmtToIRSB(bb_out, IRStmt_Dirty(dirty));
+}
+
+/* The memory accesses of a statement of the instruction at instr_addr.
+   An access that spans two lines counts for the first one. */
+static void add_reuse_calls(IRSB* bb_out, IRStmt* st, Addr instr_addr)
+{
+   switch (st->tag) {
+   case Ist_WrTmp:
+      if (st->Ist.WrTmp.data->tag == Iex_Load)
+         add_reuse_call(bb_out, st->Ist.WrTmp.data->Iex.Load.addr, instr_addr, NULL);
+      break;
+   case Ist_Store:
+      add_reuse_call(bb_out, st->Ist.Store.addr, instr_addr, NULL);
+      break;
+   case Ist_LoadG:
+      add_reuse_call(bb_out, st->Ist.LoadG.details->addr, instr_addr, st->Ist.LoadG.details->guard);
+      break;
+   case Ist_StoreG:
+      add_reuse_call(bb_out, st->Ist.StoreG.details->addr, instr_addr, st->Ist.StoreG.details->guard);
+      break;
+   case Ist_CAS:
+      add_reuse_call(bb_out, st->Ist.CAS.details->addr, instr_addr, NULL);
+      break;
+   case Ist_LLSC:
+      add_reuse_call(bb_out, st->Ist.LLSC.addr, instr_addr, NULL);
+      break;
+   case Ist_Dirty:
+      if (st->Ist.Dirty.details->mFx != Ifx_None)
+         add_reuse_call(bb_out, st->Ist.Dirty.details->mAddr, instr_addr, st->Ist.Dirty.details->guard);
+      break;
+   default:
+      break;
+   }
+}
+
+
+/*------------------------------------------------------------*/
+/*--- Collection control                                   ---*/
+/*------------------------------------------------------------*/
+
+/* Whether code is counted is decided when it is translated: while
+   counting is off superblocks get no counters at all, so unmeasured
+   phases run at nearly the speed of an uninstrumented Valgrind run.
+   Switching counting on or off therefore discards every translation, and
+   code is translated again in the new state when it next runs. */
+static Bool collecting = True;
+
+/* Set while counting was switched on by a --toggle-collect function: the
+   address it returns to and the stack pointer at its entry. */
+static Addr  toggle_return = 0;
+static UWord toggle_sp     = 0;
+
+/* Counting periods, from switching counting on to switching it off, are
+   merged by what switched them on. Snapshots keep the count so far. */
+typedef struct {
+   const HChar* label;
+   ULong        periods;
+   ULong        instructions;
+} Period;
+
+static XArray*      periods       = NULL;
+static XArray*      snapshots     = NULL;
+static const HChar* period_label  = NULL;
+static ULong        period_start  = 0;
+static Bool         ever_switched = False;
+
+/* Instructions counted so far, in all threads. */
+static ULong counted_instructions(void)
+{
+   ULong total = running_instructions;
+   ThreadId tid;
+
+   for (tid = 1; tid < VG_N_THREADS; tid++) {
+      if (tid != running_tid)
+         total += thread_counts[tid].instructions;
+   }
+   return total;
+}
+
+static void end_period(void)
+{
+   ULong instructions = counted_instructions() - period_start;
+   Word i;
+   Period period;
+
+   for (i = 0; i < VG_(sizeXA)(periods); i++) {
+      Period* existing = VG_(indexXA)(periods, i);
+      if (VG_(strcmp)(existing->label, period_label) == 0) {
+         existing->periods++;
+         existing->instructions += instructions;
+         return;
+      }
+   }
+   period.label        = period_label;
+   period.periods      = 1;
+   period.instructions = instructions;
+   VG_(addToXA)(periods, &period);
+}
+
+/* Set when counting was switched and the translations made for the old
+   state are still in use. They are thrown away outside generated code, by
+   discard_if_pending, never by a helper running inside one of them. */
+static UInt discard_pending = 0;
+
+static void set_collecting(Bool on, const HChar* label)
+{
+   if (on == collecting)
+      return;
+   if (on) {
+      period_label = label;
+      period_start = counted_instructions();
+   } else {
+      end_period();
+   }
+   collecting      = on;
+   ever_switched   = True;
+   discard_pending = 1;
+}
+
+static void discard_if_pending(void)
+{
+   if (!discard_pending)
+      return;
+   discard_pending = 0;
+   VG_(discard_translations_safely)((Addr)0x1000, ~(SizeT)0xfff, "foobar");
+}
+
+/* Zeroes every count. Snapshots and periods taken before are kept. */
+static void reset_counts(void)
+{
+   UInt n_sbs, i, j;
+   VgHashNode** sbs = VG_(HT_to_array)(sb_table, &n_sbs);
+   ThreadId tid;
+
+   for (i = 0; i < n_sbs; i++) {
+      SBInfo* sb = (SBInfo*)sbs[i];
+      for (j = 0; j < sb->n_segments; j++)
+         sb->segments[j].executions = 0;
+      // The next interval reports the counts dropped here
+      if (interval_sbs)
+         mark_interval_sb(sb);
+   }
+   VG_(free)(sbs);
+
+   running_instructions = 0;
+   for (tid = 1; tid < VG_N_THREADS; tid++) {
+      thread_counts[tid].instructions = 0;
+      thread_counts[tid].region_start = 0;
+   }
+   if (clo_branch_regions) {
+      VgHashTable* tables[2] = { event_regions, pair_regions };
+      for (i = 0; i < 2; i++) {
+         RegionCount* region;
+         VG_(HT_ResetIter)(tables[i]);
+         while ((region = VG_(HT_Next)(tables[i]))) {
+            region->regions      = 0;
+            region->instructions = 0;
+         }
+      }
+   }
+   if (clo_reuse_distance) {
+      ReuseSite* site;
+      VG_(HT_ResetIter)(reuse_sites);
+      while ((site = VG_(HT_Next)(reuse_sites)))
+         VG_(memset)(site->buckets, 0, sizeof(site->buckets));
+   }
+   period_start = 0;
+}
+
+static void take_snapshot(const HChar* name)
+{
+   Period snapshot;
+
+   snapshot.label        = VG_(strdup)("fb.snapshot", name ? name : "(unnamed)");
+   snapshot.periods      = 1;
+   snapshot.instructions = counted_instructions();
+   VG_(addToXA)(snapshots, &snapshot);
+}
+
+static Bool fb_handle_client_request(ThreadId tid, UWord* args, UWord* ret)
+{
+   if (!VG_IS_TOOL_USERREQ('F','B',args[0]))
+      return False;
+
+   switch (args[0]) {
+   case VG_USERREQ__FOOBAR_START_COUNTING:
+      // From here on the program decides, not a toggled function's return
+      toggle_return = 0;
+      set_collecting(True, "FOOBAR_START_COUNTING");
+      // Client requests run outside generated code
+      discard_if_pending();
+      break;
+   case VG_USERREQ__FOOBAR_STOP_COUNTING:
+      toggle_return = 0;
+      set_collecting(False, NULL);
+      discard_if_pending();
+      break;
+   case VG_USERREQ__FOOBAR_RESET_COUNTS:
+      reset_counts();
+      break;
+   case VG_USERREQ__FOOBAR_SNAPSHOT:
+      take_snapshot((const HChar*)args[1]);
+      break;
+   default:
+      return False;
+   }
+   *ret = 0;
+   return True;
+}
+
+/* Is addr the first instruction of a --toggle-collect function? */
+static Bool is_toggle_entry(Addr addr)
+{
+   const HChar* fn;
+
+   if (clo_toggle_collect.n == 0 ||
+       !VG_(get_fnname_if_entry)(VG_(current_DiEpoch)(), addr, &fn))
+      return False;
+   return match_pattern(&clo_toggle_collect, fn);
+}
+
+/* Called at the entry of a --toggle-collect function while not counting. */
+static VG_REGPARM(3) void fb_toggle_enter(UWord entry, UWord sp, UWord return_addr)
+{
+   const HChar* fn;
+
+   if (collecting)
+      return;
+   if (!VG_(get_fnname)(VG_(current_DiEpoch)(), entry, &fn))
+      fn = "???";
+   toggle_return = return_addr;
+   toggle_sp     = sp;
+   set_collecting(True, VG_(strdup)("fb.toggle", fn));
+}
+
+/* Called at the start of the superblock at toggle_return. Deeper calls
+   of the same function reach it with a lower stack pointer. */
+static VG_REGPARM(1) void fb_toggle_return(UWord sp)
+{
+   // Counting was switched on again by the program in the meantime
+   if (toggle_return == 0 || sp < toggle_sp)
+      return;
+   toggle_return = 0;
+   set_collecting(False, NULL);
+}
+
+#if defined(FB_GUEST_ARG1)
+/* Follows a toggle helper. If it switched counting, the superblock is left
+   with a yield back to addr, whose instruction has not run yet. The
+   scheduler then calls fb_start_client_code, which throws the translations
+   away, and addr runs again from a new one. */
+static void add_pending_discard_exit(IRSB* bb_out, const VexGuestLayout* layout, Addr addr)
+{
+   IRTemp pending = newIRTemp(bb_out->tyenv, Ity_I32);
+   IRTemp guard   = newIRTemp(bb_out->tyenv, Ity_I1);
+
+   addStmtToIRSB(bb_out, IRStmt_WrTmp(pending, IRExpr_Load(FB_ENDIAN, Ity_I32,
+                    mkIRExpr_HWord((HWord)&discard_pending))));
+   addStmtToIRSB(bb_out, IRStmt_WrTmp(guard, IRExpr_Binop(Iop_CmpNE32, IRExpr_RdTmp(pending),
+                    IRExpr_Const(IRConst_U32(0)))));
+   addStmtToIRSB(bb_out, IRStmt_Exit(IRExpr_RdTmp(guard), Ijk_Yield, IRConst_U64(addr),
+                    layout->offset_IP));
+}
+
+/* The helpers write discard_pending, which the exit after them reads. */
+static void mark_writes_discard_pending(IRDirty* dirty)
+{
+   dirty->mFx   = Ifx_Write;
+   dirty->mAddr = mkIRExpr_HWord((HWord)&discard_pending);
+   dirty->mSize = sizeof(discard_pending);
+}
+
+static void add_toggle_enter_call(IRSB* bb_out, const VexGuestLayout* layout, Addr entry)
+{
+   IRTemp sp          = newIRTemp(bb_out->tyenv, Ity_I64);
+   IRTemp return_addr = newIRTemp(bb_out->tyenv, Ity_I64);
+   IRDirty* dirty = unsafeIRDirty_0_N(
+      3, "fb_toggle_enter", VG_(fnptr_to_fnentry)(&fb_toggle_enter),
+      mkIRExprVec_3(mkIRExpr_HWord(entry), IRExpr_RdTmp(sp), IRExpr_RdTmp(return_addr)));
+
+   addStmtToIRSB(bb_out, IRStmt_WrTmp(sp, IRExpr_Get(layout->offset_SP, Ity_I64)));
+#if defined(VGA_amd64)
+   // The call pushed the return address
+   addStmtToIRSB(bb_out, IRStmt_WrTmp(return_addr,
+                    IRExpr_Load(FB_ENDIAN, Ity_I64, IRExpr_RdTmp(sp))));
+#else
+   addStmtToIRSB(bb_out, IRStmt_WrTmp(return_addr, IRExpr_Get(FB_GUEST_LR, Ity_I64)));
+#endif
+   mark_writes_discard_pending(dirty);
+   addStmtToIRSB(bb_out, IRStmt_Dirty(dirty));
+   add_pending_discard_exit(bb_out, layout, entry);
+}
+
+static void add_toggle_return_call(IRSB* bb_out, const VexGuestLayout* layout, Addr addr)
+{
+   IRTemp sp = newIRTemp(bb_out->tyenv, Ity_I64);
+   IRDirty* dirty = unsafeIRDirty_0_N(
+      1, "fb_toggle_return", VG_(fnptr_to_fnentry)(&fb_toggle_return),
+      mkIRExprVec_1(IRExpr_RdTmp(sp)));
+
+   addStmtToIRSB(bb_out, IRStmt_WrTmp(sp, IRExpr_Get(layout->offset_SP, Ity_I64)));
+   mark_writes_discard_pending(dirty);
+   addStmtToIRSB(bb_out, IRStmt_Dirty(dirty));
+   add_pending_discard_exit(bb_out, layout, addr);
+}
+#else
+static void add_toggle_enter_call(IRSB* bb_out, const VexGuestLayout* layout, Addr entry)
+{
+   tl_assert(0);
+}
+
+static void add_toggle_return_call(IRSB* bb_out, const VexGuestLayout* layout, Addr addr)
+{
+   tl_assert(0);
+}
+#endif
+
+/* While counting is off only the entries of --toggle-collect functions
+   are instrumented. */
+static IRSB* instrument_toggle_entries(IRSB* bb, const VexGuestLayout* layout)
+{
+   IRSB *bb_out;
+   Int ii;
+
+   if (clo_toggle_collect.n == 0)
+      return bb;
+
+   bb_out = deepCopyIRSBExceptStmts(bb);
+   for (ii = 0; ii < bb->stmts_used; ii++) {
+      IRStmt *ir_statement = bb->stmts[ii];
+      if (!ir_statement)
+         continue;
+      addStmtToIRSB(bb_out, ir_statement);
+      if (ir_statement->tag == Ist_IMark && is_toggle_entry(ir_statement->Ist.IMark.addr))
+         add_toggle_enter_call(bb_out, layout, ir_statement->Ist.IMark.addr);
+   }
+   return bb_out;
+}
+
+static void print_periods(void)
+{
+   Word i;
+   ULong previous = 0;
+
+   if (ever_switched) {
+      VG_(umsg)("\n");
+      VG_(umsg)("Counting periods (total, periods x average):\n");
+      for (i = 0; i < VG_(sizeXA)(periods); i++) {
+         Period* period = VG_(indexXA)(periods, i);
+         VG_(umsg)("%16llu %10llu x %10llu  %s\n", period->instructions, period->periods,
+                   period->instructions / period->periods, period->label);
+      }
+   }
+   if (VG_(sizeXA)(snapshots) > 0) {
+      VG_(umsg)("\n");
+      VG_(umsg)("Snapshots (counted so far, since the previous one):\n");
+      for (i = 0; i < VG_(sizeXA)(snapshots); i++) {
+         Period* snapshot = VG_(indexXA)(snapshots, i);
+         // A reset in between starts again from zero
+         ULong since = snapshot->instructions >= previous
+                          ? snapshot->instructions - previous : snapshot->instructions;
+         VG_(umsg)("%16llu %16llu  %s\n", snapshot->instructions, since, snapshot->label);
+         previous = snapshot->instructions;
+      }
+   }
+}
+
+/*------------------------------------------------------------*/
+/*--- Intervals                                            ---*/
+/*------------------------------------------------------------*/
+
+/* With --interval or --interval-ms, the instructions of each function
+   since the previous interval are appended to a file while the program
+   runs, so phases show up in programs that never exit. The check runs
+   each time Valgrind's scheduler resumes a thread, at least every
+   100000 superblocks or so, which adds nothing to the instrumented code
+   but makes intervals only roughly even. Only the superblocks in
+   interval_sbs are visited. The file is line based:
+
+      fn=<id> <name>                      first time a function appears
+      i <n> <ms> <instructions> <delta>   start of an interval
+      <id> <delta>                        instructions of a function in it
+
+   Deltas are negative after FOOBAR_RESET_COUNTS. */
+typedef struct _FnTotal {
+   struct _FnTotal* next;
+   UWord            key;   // hash of the name
+   const HChar*     name;
+   UInt             id;
+   // Instructions in the current interval, and whether it is in interval_fns
+   Long             delta;
+   Bool             touched;
+} FnTotal;
+
+static VgHashTable* fn_totals    = NULL;
+static XArray*      interval_fns = NULL;
+static UInt  n_fn_totals      = 0;
+static Int   interval_fd      = -1;
+static UInt  n_intervals      = 0;
+static ULong interval_start   = 0;
+static ULong interval_start_ms = 0;
+
+static void interval_printf(const HChar* format, ...)
+{
+   HChar line[1024];
+   va_list vargs;
+   Int len;
+
+   va_start(vargs, format);
+   len = VG_(vsnprintf)(line, sizeof(line), format, vargs);
+   va_end(vargs);
+   if (len > (Int)sizeof(line) - 1)
+      len = sizeof(line) - 1;
+   VG_(write)(interval_fd, line, len);
+}
+
+static Word compare_fn_total(const void* a, const void* b)
+{
+   return VG_(strcmp)(((const FnTotal*)a)->name, ((const FnTotal*)b)->name);
+}
+
+static FnTotal* get_fn_total(const HChar* name)
+{
+   FnTotal probe, *fn;
+   const HChar* c;
+
+   probe.key  = 5381;
+   probe.name = name;
+   for (c = name; *c; c++)
+      probe.key = probe.key * 33 + (UChar)*c;
+   fn = VG_(HT_gen_lookup)(fn_totals, &probe, compare_fn_total);
+   if (!fn) {
+      fn = VG_(malloc)("fb.fn_total", sizeof(FnTotal));
+      fn->key      = probe.key;
+      fn->name     = VG_(strdup)("fb.fn_total.name", name);
+      fn->id       = ++n_fn_totals;
+      fn->delta    = 0;
+      fn->touched  = False;
+      VG_(HT_add_node)(fn_totals, fn);
+      interval_printf("fn=%u %s\n", fn->id, fn->name);
+   }
+   return fn;
+}
+
+static void write_interval(ULong instructions_now, ULong ms_now)
+{
+   Word n_sbs = VG_(sizeXA)(interval_sbs), n_fns, i;
+   UInt j, k;
+   DiEpoch ep = VG_(current_DiEpoch)();
+
+   for (i = 0; i < n_sbs; i++) {
+      SBInfo* sb = *(SBInfo**)VG_(indexXA)(interval_sbs, i);
+      sb->interval_marked = 0;
+      if (!sb->instr_fns) {
+         sb->instr_fns = VG_(malloc)("fb.sb.fns", (sb->n_instrs ? sb->n_instrs : 1) * sizeof(FnTotal*));
+         for (j = 0; j < sb->n_instrs; j++) {
+            const HChar* name;
+            if (!VG_(get_fnname)(ep, sb->instr_addrs[j], &name))
+               name = "???";
+            sb->instr_fns[j] = get_fn_total(name);
+         }
+      }
+      for (j = 0; j < sb->n_segments; j++) {
+         Segment* segment = &sb->segments[j];
+         Long delta = (Long)(segment->executions - segment->reported);
+         if (delta == 0)
+            continue;
+         segment->reported = segment->executions;
+         for (k = 0; k < segment->n_instrs; k++) {
+            FnTotal* fn = sb->instr_fns[segment->first + k];
+            fn->delta += delta;
+            if (!fn->touched) {
+               fn->touched = True;
+               VG_(addToXA)(interval_fns, &fn);
+            }
+         }
+      }
+   }
+   VG_(dropTailXA)(interval_sbs, n_sbs);
+
+   interval_printf("i %u %llu %llu %lld\n", ++n_intervals, ms_now, instructions_now,
+                   (Long)(instructions_now - interval_start));
+   n_fns = VG_(sizeXA)(interval_fns);
+   for (i = 0; i < n_fns; i++) {
+      FnTotal* fn = *(FnTotal**)VG_(indexXA)(interval_fns, i);
+      if (fn->delta != 0)
+         interval_printf("%u %lld\n", fn->id, fn->delta);
+      fn->delta   = 0;
+      fn->touched = False;
+   }
+   VG_(dropTailXA)(interval_fns, n_fns);
+   interval_start    = instructions_now;
+   interval_start_ms = ms_now;
+}
+
+static void check_interval(void)
+{
+   ULong instructions_now = counted_instructions();
+   ULong ms_now = VG_(read_millisecond_timer)();
+
+   // Counting was reset since the last interval
+   if (instructions_now < interval_start)
+      interval_start = 0;
+   if ((clo_interval > 0 && instructions_now - interval_start >= (ULong)clo_interval) ||
+       (clo_interval_ms > 0 && ms_now - interval_start_ms >= (ULong)clo_interval_ms))
+      write_interval(instructions_now, ms_now);
+}
+
+static void open_intervals(void)
+{
+   HChar* path = VG_(expand_file_name)("--interval-out-file", clo_interval_out_file);
+   SysRes sres = VG_(open)(path, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY, VKI_S_IRUSR|VKI_S_IWUSR);
+
+   if (sr_isError(sres))
+      VG_(fmsg_bad_option)("--interval-out-file", "Can not open '%s'.\n", path);
+   interval_fd  = sr_Res(sres);
+   fn_totals    = VG_(HT_construct)("fb.fn_totals");
+   interval_fns = VG_(newXA)(VG_(malloc), "fb.interval_fns", VG_(free), sizeof(FnTotal*));
+   interval_sbs = VG_(newXA)(VG_(malloc), "fb.interval_sbs", VG_(free), sizeof(SBInfo*));
+   interval_printf("version: 1\ncmd: %s\n", VG_(args_the_exename));
+   interval_start_ms = VG_(read_millisecond_timer)();
+   VG_(free)(path);
+}
+
+static void fb_start_client_code(ThreadId tid, ULong blocks_done)
+{
+   discard_if_pending();
+   switch_thread(tid);
+   if (interval_fd >= 0)
+      check_interval();
+}
 
 static void fb_post_clo_init(void)
 {
@@ -40,6 +1956,43 @@ static void fb_post_clo_init(void)
       handle any errors.  */
    if (!VG_(clo_track_fds))
      VG_(needs_core_errors)(False);
+
+   sb_table = VG_(HT_construct)("fb.sb_table");
+   thread_counts = VG_(calloc)("fb.thread_counts", VG_N_THREADS, sizeof(ThreadCounts));
+
+#if !defined(FB_GUEST_ARG1)
+   if (clo_branch_regions)
+      VG_(fmsg_bad_option)("--branch-regions=yes", "Only supported on amd64 and arm64.\n");
+#endif
+   if (clo_branch_regions) {
+      event_regions = VG_(HT_construct)("fb.event_regions");
+      pair_regions  = VG_(HT_construct)("fb.pair_regions");
+      branch_id_tables   = VG_(newXA)(VG_(malloc), "fb.branch_id_tables", VG_(free), sizeof(IdTable));
+      callsite_id_tables = VG_(newXA)(VG_(malloc), "fb.callsite_id_tables", VG_(free), sizeof(IdTable));
+   }
+
+#if !defined(FB_GUEST_ARG1)
+   if (clo_toggle_collect.n > 0)
+      VG_(fmsg_bad_option)("--toggle-collect", "Only supported on amd64 and arm64.\n");
+#endif
+   if (clo_branch_trace)
+      open_branch_trace();
+   if (clo_interval > 0 || clo_interval_ms > 0)
+      open_intervals();
+   if (clo_reuse_distance) {
+      if ((clo_cache_line & (clo_cache_line - 1)) != 0)
+         VG_(fmsg_bad_option)("--cache-line", "Must be a power of two.\n");
+      while ((1 << line_shift) < clo_cache_line)
+         line_shift++;
+      reuse_sites = VG_(HT_construct)("fb.reuse_sites");
+      line_times  = VG_(HT_construct)("fb.line_times");
+      reuse_tree  = VG_(calloc)("fb.reuse_tree", reuse_tree_size + 1, sizeof(UInt));
+   }
+   objects      = VG_(newXA)(VG_(malloc), "fb.objects", VG_(free), sizeof(ObjInfo));
+   periods      = VG_(newXA)(VG_(malloc), "fb.periods", VG_(free), sizeof(Period));
+   snapshots    = VG_(newXA)(VG_(malloc), "fb.snapshots", VG_(free), sizeof(Period));
+   collecting   = clo_collect_atstart;
+   period_label = "program start";
 }
 
 static
@@ -51,33 +2004,668 @@ IRSB* fb_instrument ( VgCallbackClosure* closure,
                       IRType gWordTy, IRType hWordTy )
 {
    
-   IRSB *bb_out = deepCopyIRSBExceptStmts(bb);
+   IRSB *bb_out;
+   SBInfo *sb;
    Int ii;
+   UInt segment = 0;
+   // Instructions seen since the last counter update
+   Int pending = 0;
+   // The same for the running count, which is also updated at events
+   Int running_pending = 0;
+   UWord kind;
+   Bool toggle_return_site;
+   // The guest instruction being copied
+   Addr instr_addr = 0;
+   UInt taken, not_taken;
+   UInt obj;
 
-   for (ii = 0; ii < bb->stmts_used; ii++) {
+   if (!collecting)
+      return instrument_toggle_entries(bb, layout);
+
+   // Where the --toggle-collect function that switched counting on returns to
+   toggle_return_site = toggle_return != 0 && closure->nraddr == toggle_return;
+   if (!is_selected((Addr)closure->nraddr, &obj) && !toggle_return_site)
+      return bb;
+
+   bb_out = deepCopyIRSBExceptStmts(bb);
+   sb = get_sb_info(bb, (Addr)closure->nraddr);
+   sb->obj = obj;
+
+   // Copy verbatim any IR preamble preceding the first IMark
+   for (ii = 0; ii < bb->stmts_used && (!bb->stmts[ii] || bb->stmts[ii]->tag != Ist_IMark); ii++) {
+      if (bb->stmts[ii])
+         addStmtToIRSB(bb_out, bb->stmts[ii]);
+   }
+   if (interval_sbs)
+      add_interval_mark(bb_out, sb);
+
+   for (; ii < bb->stmts_used; ii++) {
       IRStmt *ir_statement = bb->stmts[ii];
       if (!ir_statement)
          continue;
 
+      if (ir_statement->tag == Ist_IMark) {
+         instr_addr = ir_statement->Ist.IMark.addr;
+         // The event ends the region before the entry of the logger call,
+         // so the running count must include everything up to it.
+         if (clo_branch_regions && is_event_entry(ir_statement->Ist.IMark.addr, &kind)) {
+            if (running_pending > 0)
+               add_counter_update(bb_out, &running_instructions, running_pending);
+            running_pending = 0;
+            addStmtToIRSB(bb_out, ir_statement);
+            add_event_call(bb_out, kind);
+            pending++;
+            running_pending++;
+            continue;
+         }
+         if (toggle_return_site) {
+            addStmtToIRSB(bb_out, ir_statement);
+            add_toggle_return_call(bb_out, layout, ir_statement->Ist.IMark.addr);
+            toggle_return_site = False;
+            pending++;
+            running_pending++;
+            continue;
+         }
+         pending++;
+         running_pending++;
+      }
+
+      // A side exit leaves the superblock early, so the segment of every
+      // instruction up to and including the one containing the exit is
+      // counted before it. Those ran whether or not the exit is taken.
+      if (ir_statement->tag == Ist_Exit && pending > 0) {
+         add_counter_update(bb_out, &sb->segments[segment++].executions, 1);
+         pending = 0;
+      }
+      if (ir_statement->tag == Ist_Exit && running_pending > 0) {
+         add_counter_update(bb_out, &running_instructions, running_pending);
+         running_pending = 0;
+      }
+
+      // The taken edge under the guard of the exit, the other after it
+      if (clo_branch_trace && ir_statement->tag == Ist_Exit &&
+          get_exit_edges(bb, ii, instr_addr, &taken, &not_taken)) {
+         add_branch_call(bb_out, taken, ir_statement->Ist.Exit.guard);
+         addStmtToIRSB(bb_out, ir_statement);
+         add_branch_call(bb_out, not_taken, NULL);
+         continue;
+      }
+
+      if (clo_reuse_distance)
+         add_reuse_calls(bb_out, ir_statement, instr_addr);
+
       // Copy statement to output block
       addStmtToIRSB(bb_out, ir_statement);
+   }
 
-      // Instrumentation: count the instruction at Ist_IMark
-      if (ir_statement->tag == Ist_IMark) {
-         IRDirty *dirty_statament = unsafeIRDirty_0_N(
-            0, "incement_count",
-            VG_(fnptr_to_fnentry)(&incement_count), mkIRExprVec_0());
-         addStmtToIRSB(bb_out, IRStmt_Dirty(dirty_statament));
+   // The rest of the superblock, before its final jump
+   if (pending > 0)
+      add_counter_update(bb_out, &sb->segments[segment].executions, 1);
+   if (running_pending > 0)
+      add_counter_update(bb_out, &running_instructions, running_pending);
+   if (clo_branch_trace && instr_addr)
+      add_indirect_call(bb, bb_out, instr_addr);
+
+  return bb_out;
+}
+
+
+/*------------------------------------------------------------*/
+/*--- Hotspot report                                       ---*/
+/*------------------------------------------------------------*/
+
+/* Executions of one instruction, then of one (function, file, line). */
+typedef struct {
+   Addr  addr;
+   ULong count;
+} InstrCount;
+
+typedef struct {
+   const HChar* fn;
+   const HChar* file;
+   UInt         line;
+   ULong        count;
+} LineCount;
+
+static Int compare_instr_addr(const void* a, const void* b)
+{
+   Addr x = ((const InstrCount*)a)->addr, y = ((const InstrCount*)b)->addr;
+   return (x > y) - (x < y);
+}
+
+static Int compare_line_location(const void* a, const void* b)
+{
+   const LineCount *x = a, *y = b;
+   Int cmp = VG_(strcmp)(x->fn, y->fn);
+   if (cmp == 0)
+      cmp = VG_(strcmp)(x->file, y->file);
+   if (cmp == 0)
+      cmp = (x->line > y->line) - (x->line < y->line);
+   return cmp;
+}
+
+static Int compare_line_count(const void* a, const void* b)
+{
+   ULong x = ((const LineCount*)a)->count, y = ((const LineCount*)b)->count;
+   return (x < y) - (x > y);
+}
+
+/* Names are only valid until the next debuginfo query, so each distinct
+   one is copied once; consecutive instructions mostly share them. */
+static const HChar* intern(const HChar* name, const HChar** last)
+{
+   if (*last && VG_(strcmp)(*last, name) == 0)
+      return *last;
+   *last = VG_(strdup)("fb.intern", name);
+   return *last;
+}
+
+/* Every executed instruction, merged by address. */
+static InstrCount* collect_instr_counts(UInt* n_counts, ULong* total)
+{
+   UInt n_sbs, i, j, k, n = 0;
+   VgHashNode** sbs = VG_(HT_to_array)(sb_table, &n_sbs);
+   InstrCount* counts;
+
+   *total = 0;
+   for (i = 0; i < n_sbs; i++)
+      n += ((SBInfo*)sbs[i])->n_instrs;
+   counts = VG_(malloc)("fb.instr_counts", (n ? n : 1) * sizeof(InstrCount));
+
+   n = 0;
+   for (i = 0; i < n_sbs; i++) {
+      SBInfo* sb = (SBInfo*)sbs[i];
+      for (j = 0; j < sb->n_segments; j++) {
+         Segment* segment = &sb->segments[j];
+         if (segment->executions == 0)
+            continue;
+         for (k = 0; k < segment->n_instrs; k++) {
+            counts[n].addr  = sb->instr_addrs[segment->first + k];
+            counts[n].count = segment->executions;
+            *total += segment->executions;
+            n++;
+         }
       }
    }
+   VG_(free)(sbs);
 
-  return bb_out;
+   VG_(ssort)(counts, n, sizeof(InstrCount), compare_instr_addr);
+   for (i = 0, j = 0; i < n; i++) {
+      if (j > 0 && counts[j - 1].addr == counts[i].addr)
+         counts[j - 1].count += counts[i].count;
+      else
+         counts[j++] = counts[i];
+   }
+   *n_counts = j;
+   return counts;
+}
+
+/* Resolves instructions to source lines and merges them per (fn, file, line). */
+static LineCount* collect_line_counts(const InstrCount* counts, UInt n_counts, UInt* n_lines)
+{
+   LineCount* lines = VG_(malloc)("fb.line_counts", (n_counts ? n_counts : 1) * sizeof(LineCount));
+   DiEpoch ep = VG_(current_DiEpoch)();
+   const HChar *last_fn = NULL, *last_file = NULL;
+   UInt i, j;
+
+   for (i = 0; i < n_counts; i++) {
+      const HChar *fn, *file, *dir;
+      UInt line;
+      if (!VG_(get_fnname)(ep, counts[i].addr, &fn))
+         fn = "???";
+      lines[i].fn = intern(fn, &last_fn);
+      if (!VG_(get_filename_linenum)(ep, counts[i].addr, &file, &dir, &line)) {
+         file = "???";
+         line = 0;
+      }
+      lines[i].file  = intern(file, &last_file);
+      lines[i].line  = line;
+      lines[i].count = counts[i].count;
+   }
+
+   VG_(ssort)(lines, n_counts, sizeof(LineCount), compare_line_location);
+   for (i = 0, j = 0; i < n_counts; i++) {
+      if (j > 0 && compare_line_location(&lines[j - 1], &lines[i]) == 0)
+         lines[j - 1].count += lines[i].count;
+      else
+         lines[j++] = lines[i];
+   }
+   *n_lines = j;
+   return lines;
+}
+
+/* One LineCount per function with line 0, from lines sorted by location. */
+static LineCount* collect_fn_counts(const LineCount* lines, UInt n_lines, UInt* n_fns)
+{
+   LineCount* fns = VG_(malloc)("fb.fn_counts", (n_lines ? n_lines : 1) * sizeof(LineCount));
+   UInt i, j;
+
+   for (i = 0, j = 0; i < n_lines; i++) {
+      if (j > 0 && VG_(strcmp)(fns[j - 1].fn, lines[i].fn) == 0) {
+         fns[j - 1].count += lines[i].count;
+         continue;
+      }
+      fns[j] = lines[i];
+      fns[j].line = 0;
+      j++;
+   }
+   *n_fns = j;
+   return fns;
+}
+
+static Int compare_obj_instructions(const void* a, const void* b)
+{
+   ULong x = ((const ObjInfo*)a)->instructions, y = ((const ObjInfo*)b)->instructions;
+   return (x < y) - (x > y);
+}
+
+static void print_objects(ULong total)
+{
+   UInt n_sbs, i, j;
+   VgHashNode** sbs = VG_(HT_to_array)(sb_table, &n_sbs);
+   Word n = VG_(sizeXA)(objects), k;
+   ObjInfo* sorted;
+
+   for (k = 0; k < n; k++)
+      ((ObjInfo*)VG_(indexXA)(objects, k))->instructions = 0;
+   for (i = 0; i < n_sbs; i++) {
+      SBInfo* sb = (SBInfo*)sbs[i];
+      ObjInfo* obj = VG_(indexXA)(objects, sb->obj);
+      for (j = 0; j < sb->n_segments; j++)
+         obj->instructions += sb->segments[j].executions * sb->segments[j].n_instrs;
+   }
+   VG_(free)(sbs);
+
+   sorted = VG_(malloc)("fb.objects.sorted", (n ? n : 1) * sizeof(ObjInfo));
+   for (k = 0; k < n; k++)
+      sorted[k] = *(ObjInfo*)VG_(indexXA)(objects, k);
+   VG_(ssort)(sorted, n, sizeof(ObjInfo), compare_obj_instructions);
+   VG_(umsg)("\n");
+   VG_(umsg)("Instructions by object:\n");
+   for (k = 0; k < n && k < clo_hotspots && sorted[k].instructions > 0; k++) {
+      ULong permille = total ? sorted[k].instructions * 1000 / total : 0;
+      VG_(umsg)("%16llu %3llu.%llu%%  %s\n", sorted[k].instructions, permille / 10, permille % 10,
+                sorted[k].name);
+   }
+   VG_(free)(sorted);
+}
+
+static void print_hotspots(const HChar* title, LineCount* entries, UInt n, ULong total, Bool with_line)
+{
+   UInt i;
+
+   VG_(ssort)(entries, n, sizeof(LineCount), compare_line_count);
+   VG_(umsg)("\n");
+   VG_(umsg)("%s\n", title);
+   for (i = 0; i < n && i < (UInt)clo_hotspots; i++) {
+      ULong permille = total ? entries[i].count * 1000 / total : 0;
+      if (with_line)
+         VG_(umsg)("%16llu %3llu.%llu%%  %s (%s:%u)\n", entries[i].count, permille / 10, permille % 10,
+                   entries[i].fn, entries[i].file, entries[i].line);
+      else
+         VG_(umsg)("%16llu %3llu.%llu%%  %s (%s)\n", entries[i].count, permille / 10, permille % 10,
+                   entries[i].fn, entries[i].file);
+   }
+}
+
+/* Lines must still be sorted by location, so fl=/fn= only change between groups. */
+static void write_callgrind(const LineCount* lines, UInt n_lines, ULong total)
+{
+   HChar* path = VG_(expand_file_name)("--callgrind-out-file", clo_callgrind_out_file);
+   VgFile* file = VG_(fopen)(path, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY, VKI_S_IRUSR|VKI_S_IWUSR);
+   UInt i;
+
+   if (!file) {
+      VG_(umsg)("Error: can not open callgrind output file '%s'\n", path);
+      VG_(free)(path);
+      return;
+   }
+
+   VG_(fprintf)(file, "version: 1\ncreator: foobar\n");
+   VG_(fprintf)(file, "cmd: %s\n", VG_(args_the_exename));
+   VG_(fprintf)(file, "positions: line\nevents: Ir\nsummary: %llu\n", total);
+   for (i = 0; i < n_lines; i++) {
+      if (i == 0 || VG_(strcmp)(lines[i - 1].file, lines[i].file) != 0)
+         VG_(fprintf)(file, "\nfl=%s\n", lines[i].file);
+      if (i == 0 || VG_(strcmp)(lines[i - 1].fn, lines[i].fn) != 0 ||
+          VG_(strcmp)(lines[i - 1].file, lines[i].file) != 0)
+         VG_(fprintf)(file, "fn=%s\n", lines[i].fn);
+      VG_(fprintf)(file, "%u %llu\n", lines[i].line, lines[i].count);
+   }
+   VG_(fclose)(file);
+   VG_(free)(path);
+}
+
+/*------------------------------------------------------------*/
+/*--- Instruction mix                                      ---*/
+/*------------------------------------------------------------*/
+
+/* Executed instructions and IR operations of one function. */
+typedef struct {
+   const HChar* fn;
+   ULong        instructions;
+   ULong        ops[FB_N_MIX];
+} FnMix;
+
+static Int compare_fn_mix_name(const void* a, const void* b)
+{
+   return VG_(strcmp)(((const FnMix*)a)->fn, ((const FnMix*)b)->fn);
+}
+
+static Int compare_fn_mix_instructions(const void* a, const void* b)
+{
+   ULong x = ((const FnMix*)a)->instructions, y = ((const FnMix*)b)->instructions;
+   return (x < y) - (x > y);
+}
+
+/* Operations per 100 instructions, so builds of different size compare. */
+static void print_mix(const FnMix* mix)
+{
+   HChar line[256];
+   Int pos = VG_(sprintf)(line, "%16llu", mix->instructions);
+   UInt k;
+
+   for (k = 0; k < FB_N_MIX; k++) {
+      ULong permille = mix->instructions ? mix->ops[k] * 1000 / mix->instructions : 0;
+      pos += VG_(sprintf)(line + pos, " %5llu.%llu", permille / 10, permille % 10);
+   }
+   VG_(umsg)("%s  %s\n", line, mix->fn);
+}
+
+static void print_instr_mix(void)
+{
+   UInt n_sbs, i, j, k, m, n = 0;
+   VgHashNode** sbs = VG_(HT_to_array)(sb_table, &n_sbs);
+   DiEpoch ep = VG_(current_DiEpoch)();
+   const HChar* last_fn = NULL;
+   FnMix total, *fns;
+   HChar header[256];
+   Int pos;
+
+   for (i = 0; i < n_sbs; i++)
+      n += ((SBInfo*)sbs[i])->n_instrs;
+   fns = VG_(malloc)("fb.fn_mix", (n ? n : 1) * sizeof(FnMix));
+   VG_(memset)(&total, 0, sizeof(total));
+   total.fn = "(total)";
+
+   // One entry per counted instruction, merged per function below
+   n = 0;
+   for (i = 0; i < n_sbs; i++) {
+      SBInfo* sb = (SBInfo*)sbs[i];
+      if (!sb->mix)
+         continue;
+      for (j = 0; j < sb->n_segments; j++) {
+         Segment* segment = &sb->segments[j];
+         if (segment->executions == 0)
+            continue;
+         for (k = 0; k < segment->n_instrs; k++) {
+            UInt instr = segment->first + k;
+            const HChar* fn;
+            if (!VG_(get_fnname)(ep, sb->instr_addrs[instr], &fn))
+               fn = "???";
+            fns[n].fn           = intern(fn, &last_fn);
+            fns[n].instructions = segment->executions;
+            total.instructions += segment->executions;
+            for (m = 0; m < FB_N_MIX; m++) {
+               fns[n].ops[m] = sb->mix[instr * FB_N_MIX + m] * segment->executions;
+               total.ops[m] += fns[n].ops[m];
+            }
+            n++;
+         }
+      }
+   }
+   VG_(free)(sbs);
+
+   VG_(ssort)(fns, n, sizeof(FnMix), compare_fn_mix_name);
+   for (i = 0, j = 0; i < n; i++) {
+      if (j > 0 && VG_(strcmp)(fns[j - 1].fn, fns[i].fn) == 0) {
+         fns[j - 1].instructions += fns[i].instructions;
+         for (m = 0; m < FB_N_MIX; m++)
+            fns[j - 1].ops[m] += fns[i].ops[m];
+      } else {
+         fns[j++] = fns[i];
+      }
+   }
+   n = j;
+   VG_(ssort)(fns, n, sizeof(FnMix), compare_fn_mix_instructions);
+
+   pos = VG_(sprintf)(header, "%16s", "instructions");
+   for (m = 0; m < FB_N_MIX; m++)
+      pos += VG_(sprintf)(header + pos, " %7s", mix_names[m]);
+   VG_(umsg)("\n");
+   VG_(umsg)("Instruction mix (IR operations per 100 instructions):\n");
+   VG_(umsg)("%s\n", header);
+   print_mix(&total);
+   for (i = 0; i < n && i < (UInt)clo_hotspots; i++)
+      print_mix(&fns[i]);
+   VG_(free)(fns);
+}
+
+/*------------------------------------------------------------*/
+/*--- Reuse distance report                                ---*/
+/*------------------------------------------------------------*/
+
+/* The accesses of one (function, file, line) and how many of them would
+   hit in each of the --cache-sizes. */
+typedef struct {
+   const HChar* fn;
+   const HChar* file;
+   UInt         line;
+   ULong        accesses;
+   ULong        cold;
+   ULong        hits[FB_MAX_CACHES];
+} ReuseLine;
+
+static Int compare_reuse_location(const void* a, const void* b)
+{
+   const ReuseLine *x = a, *y = b;
+   Int cmp = VG_(strcmp)(x->fn, y->fn);
+   if (cmp == 0)
+      cmp = VG_(strcmp)(x->file, y->file);
+   if (cmp == 0)
+      cmp = (x->line > y->line) - (x->line < y->line);
+   return cmp;
+}
+
+static Int compare_reuse_accesses(const void* a, const void* b)
+{
+   ULong x = ((const ReuseLine*)a)->accesses, y = ((const ReuseLine*)b)->accesses;
+   return (x < y) - (x > y);
+}
+
+static void add_reuse_line(ReuseLine* to, const ReuseLine* from)
+{
+   Int c;
+
+   to->accesses += from->accesses;
+   to->cold     += from->cold;
+   for (c = 0; c < clo_n_cache_sizes; c++)
+      to->hits[c] += from->hits[c];
+}
+
+/* Entries with the same key next to each other are merged in place. */
+static UInt merge_reuse_lines(ReuseLine* lines, UInt n, Bool by_fn)
+{
+   UInt i, j;
+
+   for (i = 0, j = 0; i < n; i++) {
+      if (j > 0 && (by_fn ? VG_(strcmp)(lines[j - 1].fn, lines[i].fn) == 0
+                          : compare_reuse_location(&lines[j - 1], &lines[i]) == 0)) {
+         add_reuse_line(&lines[j - 1], &lines[i]);
+      } else {
+         lines[j] = lines[i];
+         if (by_fn)
+            lines[j].line = 0;
+         j++;
+      }
+   }
+   return j;
+}
+
+static void format_size(ULong bytes, HChar* buf)
+{
+   if (bytes >= (1ULL << 30) && bytes % (1ULL << 30) == 0)
+      VG_(sprintf)(buf, "%lluG", bytes >> 30);
+   else if (bytes >= (1ULL << 20) && bytes % (1ULL << 20) == 0)
+      VG_(sprintf)(buf, "%lluM", bytes >> 20);
+   else if (bytes >= (1ULL << 10) && bytes % (1ULL << 10) == 0)
+      VG_(sprintf)(buf, "%lluK", bytes >> 10);
+   else
+      VG_(sprintf)(buf, "%llu", bytes);
+}
+
+static void print_reuse_lines(const HChar* title, ReuseLine* lines, UInt n, Bool with_line)
+{
+   HChar header[256], line[256], size[32];
+   Int pos, c;
+   UInt i;
+
+   pos = VG_(sprintf)(header, "%16s %7s", "accesses", "cold");
+   for (c = 0; c < clo_n_cache_sizes; c++) {
+      format_size(clo_cache_sizes[c], size);
+      pos += VG_(sprintf)(header + pos, " %7s", size);
+   }
+   VG_(ssort)(lines, n, sizeof(ReuseLine), compare_reuse_accesses);
+   VG_(umsg)("\n");
+   VG_(umsg)("%s\n", title);
+   VG_(umsg)("%s\n", header);
+   for (i = 0; i < n && i < (UInt)clo_hotspots && lines[i].accesses > 0; i++) {
+      ULong permille = lines[i].cold * 1000 / lines[i].accesses;
+      pos = VG_(sprintf)(line, "%16llu %4llu.%llu%%", lines[i].accesses, permille / 10, permille % 10);
+      for (c = 0; c < clo_n_cache_sizes; c++) {
+         permille = lines[i].hits[c] * 1000 / lines[i].accesses;
+         pos += VG_(sprintf)(line + pos, " %4llu.%llu%%", permille / 10, permille % 10);
+      }
+      if (with_line)
+         VG_(umsg)("%s  %s (%s:%u)\n", line, lines[i].fn, lines[i].file, lines[i].line);
+      else
+         VG_(umsg)("%s  %s (%s)\n", line, lines[i].fn, lines[i].file);
+   }
+}
+
+static void print_reuse_distance(void)
+{
+   UInt n, i, b, n_lines;
+   ReuseSite** sites = (ReuseSite**)VG_(HT_to_array)(reuse_sites, &n);
+   ReuseLine* lines = VG_(malloc)("fb.reuse_lines", (n ? n : 1) * sizeof(ReuseLine));
+   DiEpoch ep = VG_(current_DiEpoch)();
+   const HChar *last_fn = NULL, *last_file = NULL;
+   ULong totals[FB_REUSE_BUCKETS], accesses = 0, cumulative = 0;
+   Int c;
+
+   VG_(memset)(totals, 0, sizeof(totals));
+   for (i = 0; i < n; i++) {
+      const HChar *fn, *file, *dir;
+      UInt line;
+      VG_(memset)(&lines[i], 0, sizeof(ReuseLine));
+      for (b = 0; b < FB_REUSE_BUCKETS; b++) {
+         totals[b]          += sites[i]->buckets[b];
+         lines[i].accesses  += sites[i]->buckets[b];
+         // The largest distance of bucket b is 2^b - 1
+         for (c = 0; c < clo_n_cache_sizes; c++) {
+            if (b != FB_REUSE_COLD && (1ULL << b) - 1 < clo_cache_sizes[c] / clo_cache_line)
+               lines[i].hits[c] += sites[i]->buckets[b];
+         }
+      }
+      lines[i].cold = sites[i]->buckets[FB_REUSE_COLD];
+      if (!VG_(get_fnname)(ep, sites[i]->addr, &fn))
+         fn = "???";
+      lines[i].fn = intern(fn, &last_fn);
+      if (!VG_(get_filename_linenum)(ep, sites[i]->addr, &file, &dir, &line)) {
+         file = "???";
+         line = 0;
+      }
+      lines[i].file = intern(file, &last_file);
+      lines[i].line = line;
+      accesses += lines[i].accesses;
+   }
+   VG_(free)(sites);
+
+   VG_(umsg)("\n");
+   VG_(umsg)("Reuse distance in cache lines of %d bytes (accesses, cumulative):\n", clo_cache_line);
+   for (b = 0; b < FB_REUSE_BUCKETS; b++) {
+      HChar range[64];
+      if (totals[b] == 0)
+         continue;
+      cumulative += totals[b];
+      if (b == FB_REUSE_COLD)
+         VG_(sprintf)(range, "cold");
+      else if (b == 0)
+         VG_(sprintf)(range, "0");
+      else
+         VG_(sprintf)(range, "%llu-%llu", 1ULL << (b - 1), (1ULL << b) - 1);
+      VG_(umsg)("%24s %16llu %5llu.%llu%%\n", range, totals[b],
+                cumulative * 1000 / accesses / 10, cumulative * 1000 / accesses % 10);
+   }
+
+   if (clo_hotspots > 0 && n > 0) {
+      VG_(ssort)(lines, n, sizeof(ReuseLine), compare_reuse_location);
+      n_lines = merge_reuse_lines(lines, n, False);
+      print_reuse_lines("Predicted hits by source line (accesses, cold misses, hits per cache size):",
+                        lines, n_lines, True);
+      VG_(ssort)(lines, n_lines, sizeof(ReuseLine), compare_reuse_location);
+      n = merge_reuse_lines(lines, n_lines, True);
+      print_reuse_lines("Predicted hits by function (accesses, cold misses, hits per cache size):",
+                        lines, n, False);
+   }
+   VG_(free)(lines);
 }
 
 static void fb_fini(Int exitcode)
 {
+   UInt n_counts, n_lines, n_fns;
+   ULong total;
+   InstrCount* counts = collect_instr_counts(&n_counts, &total);
+   LineCount *lines, *fns;
+
    VG_(umsg)
-  ("Total number of instructions executed: %llu\n", total_instructions);
+  ("Total number of instructions executed: %llu\n", total);
+
+   if (running_tid != VG_INVALID_THREADID)
+      thread_counts[running_tid].instructions = running_instructions;
+   print_threads();
+   if (collecting)
+      end_period();
+   print_periods();
+   if (clo_instr_mix)
+      print_instr_mix();
+   if (clo_branch_trace)
+      close_branch_trace();
+   if (clo_reuse_distance)
+      print_reuse_distance();
+   if (interval_fd >= 0) {
+      write_interval(counted_instructions(), VG_(read_millisecond_timer)());
+      VG_(close)(interval_fd);
+   }
+
+   if (clo_branch_regions) {
+      ThreadId tid;
+      for (tid = 1; tid < VG_N_THREADS; tid++) {
+         if (thread_counts[tid].seen)
+            end_region(&thread_counts[tid], thread_counts[tid].instructions, EVENT_EXIT);
+      }
+      print_regions("Instructions after each event (total, regions x average):", event_regions, False);
+      print_regions("Instructions between events (total, regions x average):", pair_regions, True);
+   }
+
+   if (clo_hotspots == 0 && !clo_callgrind_out_file) {
+      VG_(free)(counts);
+      return;
+   }
+
+   lines = collect_line_counts(counts, n_counts, &n_lines);
+   fns   = collect_fn_counts(lines, n_lines, &n_fns);
+   if (clo_callgrind_out_file)
+      write_callgrind(lines, n_lines, total);
+   if (clo_hotspots > 0) {
+      print_objects(total);
+      print_hotspots("Instructions by function:", fns, n_fns, total, False);
+      print_hotspots("Instructions by source line:", lines, n_lines, total, True);
+   }
+
+   VG_(free)(fns);
+   VG_(free)(lines);
+   VG_(free)(counts);
 }
 
 static void fb_pre_clo_init(void)
@@ -96,8 +2684,13 @@ static void fb_pre_clo_init(void)
                                  fb_fini);
    VG_(needs_xml_output)        ();
    VG_(needs_core_errors)       (True); /* Yes, but... see fb_post_clo_init  */
+   VG_(needs_command_line_options)(fb_process_cmd_line_option,
+                                   fb_print_usage,
+                                   fb_print_debug_usage);
+
+   VG_(needs_client_requests)   (fb_handle_client_request);
 
-   /* No needs, no core events to track */
+   VG_(track_start_client_code) (fb_start_client_code);
 }
 
 VG_DETERMINE_INTERFACE_VERSION(fb_pre_clo_init)
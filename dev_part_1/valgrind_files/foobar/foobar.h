@@ -0,0 +1,67 @@
+/*--------------------------------------------------------------------*/
+/*--- Client requests for foobar.                         foobar.h ---*/
+/*--------------------------------------------------------------------*/
+
+/*
+   This file is for inclusion into client (your!) code.
+
+   You can use these macros to start and stop instruction counting in
+   parts of your program, reset the counts and take named snapshots of
+   them when run on foobar. Like valgrind.h, this header has no effect
+   when the program runs natively, and only costs a few instructions.
+
+   #include "foobar.h"
+
+   FOOBAR_STOP_COUNTING;      // e.g. skip the setup phase
+   setup();
+   FOOBAR_START_COUNTING;
+   run();
+   FOOBAR_SNAPSHOT("after run");
+
+   Counting is on at program start unless foobar runs with
+   --collect-atstart=no.
+*/
+
+#ifndef __FOOBAR_H
+#define __FOOBAR_H
+
+#include "valgrind.h"
+
+/* !! ABIWARNING !! ABIWARNING !! ABIWARNING !! ABIWARNING !!
+   Only add new requests at the end, existing programs rely on the
+   numbers. */
+typedef
+   enum {
+      VG_USERREQ__FOOBAR_START_COUNTING = VG_USERREQ_TOOL_BASE('F','B'),
+      VG_USERREQ__FOOBAR_STOP_COUNTING,
+      VG_USERREQ__FOOBAR_RESET_COUNTS,
+      VG_USERREQ__FOOBAR_SNAPSHOT
+   } Vg_FoobarClientRequest;
+
+/* Count the instructions executed from here on. */
+#define FOOBAR_START_COUNTING                                           \
+  VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__FOOBAR_START_COUNTING,   \
+                                  0, 0, 0, 0, 0)
+
+/* Stop counting; code runs without instrumentation until the next
+   FOOBAR_START_COUNTING. */
+#define FOOBAR_STOP_COUNTING                                            \
+  VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__FOOBAR_STOP_COUNTING,    \
+                                  0, 0, 0, 0, 0)
+
+/* Set every count to zero, as if the program had just started. */
+#define FOOBAR_RESET_COUNTS                                             \
+  VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__FOOBAR_RESET_COUNTS,     \
+                                  0, 0, 0, 0, 0)
+
+/* Record the instructions counted so far under the given name; foobar
+   lists the snapshots at exit. */
+#define FOOBAR_SNAPSHOT(name)                                           \
+  VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__FOOBAR_SNAPSHOT,         \
+                                  (name), 0, 0, 0, 0)
+
+#endif /* __FOOBAR_H */
+
+/*--------------------------------------------------------------------*/
+/*--- end                                                          ---*/
+/*--------------------------------------------------------------------*/